@@ -169,6 +169,99 @@ using CandidateList = std::vector<Candidate>;
  */
 using Template = std::vector<double>;
 
+/**
+ * @brief
+ * Scores of one probe against every entry of a gallery, in gallery order,
+ * from an algorithm that scores the whole gallery rather than returning a
+ * candidate list.
+ *
+ * @details
+ * The scores are not owned: they may be in a memory-mapped file, for
+ * example, and must outlive the call they are passed to.
+ */
+struct ScoreVector {
+    /** @brief N scores, scores[i] for gallery entry i; NaN for none */
+    const double *scores;
+    /** @brief Number of gallery entries, N */
+    size_t count;
+
+    ScoreVector() :
+        scores{nullptr},
+        count{0}
+        {}
+
+    ScoreVector(
+        const double *scores,
+        size_t count) :
+        scores{scores},
+        count{count}
+        {}
+};
+using ScoreVector = struct ScoreVector;
+
+/**
+ * @brief
+ * Size and construction cost of a gallery, for capacity planning.
+ *
+ * @details
+ * Memory is reported per structure of the gallery (e.g. "matrix", "ids",
+ * "index", "cache"), so that the cost of an index choice is visible
+ * without measuring the process from outside.  Mapped bytes are the
+ * address space a structure occupies; resident bytes are the part of it
+ * in physical memory now, which for a gallery shared between processes
+ * is also shared.
+ */
+struct GalleryStats {
+    /** @brief Memory of one structure of the gallery */
+    struct Region {
+        /** @brief Name of the structure */
+        std::string name;
+        /** @brief Bytes of address space the structure occupies */
+        uint64_t mappedBytes;
+        /** @brief Bytes of the structure resident in memory */
+        uint64_t residentBytes;
+    };
+
+    /** @brief Wall-clock time of one phase of gallery construction */
+    struct Phase {
+        /** @brief Name of the phase */
+        std::string name;
+        /** @brief Duration of the phase, in seconds */
+        double seconds;
+    };
+
+    /** @brief A parameter of the search index, as text */
+    struct Parameter {
+        /** @brief Name of the parameter */
+        std::string name;
+        /** @brief Value of the parameter */
+        std::string value;
+    };
+
+    /** @brief Number of enrolled templates */
+    uint64_t entries;
+    /** @brief Number of distinct identities */
+    uint64_t identities;
+    /** @brief Dimension of each template */
+    uint64_t dimension;
+    /** @brief Bytes of gallery memory per enrolled template */
+    double bytesPerTemplate;
+    /** @brief Memory by structure */
+    std::vector<Region> regions;
+    /** @brief Construction time by phase, in order */
+    std::vector<Phase> buildPhases;
+    /** @brief Parameters of the search index */
+    std::vector<Parameter> indexParameters;
+
+    GalleryStats() :
+        entries{0},
+        identities{0},
+        dimension{0},
+        bytesPerTemplate{0.0}
+        {}
+};
+using GalleryStats = struct GalleryStats;
+
 
 /**
  * @brief
@@ -178,6 +271,12 @@ using Template = std::vector<double>;
  * @details
  * The submission software under test will implement this interface by
  * sub-classing this class and implementing each method therein.
+ *
+ * The NIST application may call fork() after initialize() to run several
+ * fusion processes from one initialized parent.  Implementations should
+ * not have threads running when initialize() returns, and should not
+ * write to the state loaded by initialize() (e.g. lazy caches or reference
+ * counts) when fusing, so that the children share that state's pages.
  */
 class ScoreFuserInterface {
 public:
@@ -248,6 +347,94 @@ public:
         const std::vector<CandidateList> &inputLists,
         CandidateList &fusedList) = 0;
 
+    /**
+     * @brief
+     * Fuse a batch of verification score sets.
+     *
+     * @details
+     * This function is optional.  The default calls fuseVerificationScores()
+     * for each score set; implementations may override it to amortize
+     * per-call work over the batch.  On failure, the contents of
+     * fusedScores are unspecified.
+     *
+     * @param[in] inputScores
+     * B score sets, each of K ≥ 2 scores
+     * @param[out] fusedScores
+     * B fused scores, fusedScores[i] fuses inputScores[i]
+     */
+    virtual ReturnStatus
+    fuseVerificationScoreBatch(
+        const std::vector<ScoreSet> &inputScores,
+        std::vector<double> &fusedScores)
+    {
+        fusedScores.resize(inputScores.size());
+        for (size_t i = 0; i < inputScores.size(); i++) {
+            const ReturnStatus rs = this->fuseVerificationScores(
+                inputScores[i], fusedScores[i]);
+            if (rs.code != ReturnCode::Success)
+                return (rs);
+        }
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /**
+     * @brief
+     * Fuse a batch of candidate list sets.
+     *
+     * @details
+     * This function is optional.  The default calls fuseCandidateLists()
+     * for each set of lists.  On failure, the contents of fusedLists are
+     * unspecified.
+     *
+     * @param[in] inputLists
+     * B sets of K ≥ 2 candidate lists
+     * @param[out] fusedLists
+     * B fused candidate lists, fusedLists[i] fuses inputLists[i]
+     */
+    virtual ReturnStatus
+    fuseCandidateListBatch(
+        const std::vector<std::vector<CandidateList>> &inputLists,
+        std::vector<CandidateList> &fusedLists)
+    {
+        fusedLists.assign(inputLists.size(), CandidateList());
+        for (size_t i = 0; i < inputLists.size(); i++) {
+            const ReturnStatus rs = this->fuseCandidateLists(
+                inputLists[i], fusedLists[i]);
+            if (rs.code != ReturnCode::Success)
+                return (rs);
+        }
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /**
+     * @brief
+     * Fuse K ≥ 2 dense score vectors, each scoring one probe against the
+     * whole gallery, into a candidate list.
+     *
+     * @details
+     * This function is optional.  It will be preceded by a call to
+     * initialize(type = Type::Identification).  Unlike
+     * fuseCandidateLists(), every gallery entry has a score from every
+     * algorithm, so no entry is missing from a list because another
+     * algorithm ranked it higher.  The number of candidates to populate
+     * is fusedList.size().
+     *
+     * @param[in] inputScores
+     * K score vectors over the same N gallery entries
+     * @param[in] ids
+     * N identity labels, ids[i] for gallery entry i
+     * @param[out] fusedList
+     * Pre-allocated candidate list, filled best first
+     */
+    virtual ReturnStatus
+    fuseScoreVectors(
+        const std::vector<ScoreVector> & /* inputScores */,
+        const uint32_t * /* ids */,
+        CandidateList & /* fusedList */)
+    {
+        return (ReturnStatus(ReturnCode::NotImplemented));
+    }
+
     /**
      * @brief
      * Factory method to return a managed pointer to the
@@ -272,6 +459,14 @@ public:
  * @details
  * The submission software under test will implement this interface by
  * sub-classing this class and implementing each method therein.
+ *
+ * The NIST application may call fork() after initialize() and
+ * createGallery() to run many search processes from one parent.
+ * Implementations should not have threads running when either function
+ * returns; thread pools should be started lazily, and restarted in the
+ * child, on first use.  verify() and search() should not write to the
+ * models or gallery (e.g. lazy caches, reference counts or statistics),
+ * since every page written in a child is copied for that child alone.
  */
 class TemplateFuserInterface {
 public:
@@ -280,6 +475,16 @@ public:
         Verify,
         Identify
     };
+
+    /** How searchMultiProbe() combines the scores of several probes */
+    enum class ProbeAggregation {
+        /** Highest similarity over the probes */
+        Max = 0,
+        /** Mean similarity over the probes */
+        Mean,
+        /** Developer-defined combination loaded by initialize() */
+        Learned
+    };
     virtual ~TemplateFuserInterface() {}
 
     /**
@@ -328,6 +533,35 @@ public:
        const std::vector<Template> &inputTemplates,
        Template &fusedTemplate) = 0;
 
+    /**
+     * @brief
+     * Fuse a batch of template sets.
+     *
+     * @details
+     * This function is optional.  The default calls fuseTemplates() for
+     * each set of templates.  On failure, the contents of fusedTemplates
+     * are unspecified.
+     *
+     * @param[in] inputTemplates
+     * B sets of K ≥ 2 templates
+     * @param[out] fusedTemplates
+     * B fused templates, fusedTemplates[i] fuses inputTemplates[i]
+     */
+    virtual ReturnStatus
+    fuseTemplateBatch(
+        const std::vector<std::vector<Template>> &inputTemplates,
+        std::vector<Template> &fusedTemplates)
+    {
+        fusedTemplates.assign(inputTemplates.size(), Template());
+        for (size_t i = 0; i < inputTemplates.size(); i++) {
+            const ReturnStatus rs = this->fuseTemplates(
+                inputTemplates[i], fusedTemplates[i]);
+            if (rs.code != ReturnCode::Success)
+                return (rs);
+        }
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
     /**
      * @brief
      * Given fused templates, the implementation must support one-to-one
@@ -347,6 +581,37 @@ public:
         const Template &authentication,
         double &score) = 0;
 
+    /**
+     * @brief
+     * Compare a batch of enrollment and authentication template pairs.
+     *
+     * @details
+     * This function is optional.  The default calls verify() for each
+     * pair.  On failure, the contents of scores are unspecified.
+     *
+     * @param[in] enroll, authentication
+     * B fused templates each; enroll[i] is compared with authentication[i]
+     * @param[out] scores
+     * B similarity scores
+     */
+    virtual ReturnStatus
+    verifyBatch(
+        const std::vector<Template> &enroll,
+        const std::vector<Template> &authentication,
+        std::vector<double> &scores)
+    {
+        if (enroll.size() != authentication.size())
+            return (ReturnStatus(ReturnCode::NonCongruentVectors));
+        scores.resize(enroll.size());
+        for (size_t i = 0; i < enroll.size(); i++) {
+            const ReturnStatus rs = this->verify(
+                enroll[i], authentication[i], scores[i]);
+            if (rs.code != ReturnCode::Success)
+                return (rs);
+        }
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
     /**
      * @brief
      * This function creates a gallery by adding a set of N identified templates
@@ -384,6 +649,191 @@ public:
         const Template &probe,
         CandidateList &candidates) = 0;
 
+    /**
+     * @brief
+     * Search a batch of probe templates against the gallery.
+     *
+     * @details
+     * This function is optional.  The default calls search() for each
+     * probe.  As for search(), the number of candidates to populate for
+     * probes[i] is candidates[i].size().  On failure, the contents of
+     * candidates are unspecified.
+     *
+     * @param[in] probes
+     * B probe templates to search
+     * @param[in,out] candidates
+     * B pre-allocated candidate lists, candidates[i] for probes[i]
+     */
+    virtual ReturnStatus
+    searchBatch(
+        const std::vector<Template> &probes,
+        std::vector<CandidateList> &candidates)
+    {
+        if (probes.size() != candidates.size())
+            return (ReturnStatus(ReturnCode::NonCongruentVectors));
+        for (size_t i = 0; i < probes.size(); i++) {
+            const ReturnStatus rs = this->search(probes[i], candidates[i]);
+            if (rs.code != ReturnCode::Success)
+                return (rs);
+        }
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /**
+     * @brief
+     * Search several probe templates of one subject against the gallery
+     * and return one candidate list.
+     *
+     * @details
+     * This function is optional.  Each probe is a fused template of the
+     * same subject, e.g. from different images of one encounter.  The
+     * similarity of each gallery identity is the aggregation of its
+     * similarities to all the probes.  Implementations should compute it in
+     * one pass over the gallery rather than one search per probe.  The
+     * number of candidates to populate is specified by candidates.size().
+     * This function will be preceded by a call to
+     * initialize(action=Action::Identify) and createGallery().
+     *
+     * @param[in] probes
+     * P ≥ 1 probe templates of one subject
+     * @param[in] aggregation
+     * How to combine each identity's P similarities
+     * @param[out] candidates
+     * Output candidate list populated with hypothesized candidates
+     */
+    virtual ReturnStatus
+    searchMultiProbe(
+        const std::vector<Template> & /* probes */,
+        const TemplateFuserInterface::ProbeAggregation & /* aggregation */,
+        CandidateList & /* candidates */)
+    {
+        return (ReturnStatus(ReturnCode::NotImplemented));
+    }
+
+    /**
+     * @brief
+     * Re-score a shortlist of candidates with the verify() comparator.
+     *
+     * @details
+     * This function is optional.  The shortlist may come from search() or
+     * from elsewhere, e.g. the candidate lists of the fused algorithms.
+     * Each candidate's score is replaced by the similarity verify() would
+     * return for the probe and that identity's gallery template, and the
+     * list is re-sorted in decreasing order of score.  Candidates whose
+     * identity is not in the gallery are removed.  This function will be
+     * preceded by a call to initialize(action=Action::Identify) and
+     * createGallery().
+     *
+     * @param[in] probe
+     * Probe template
+     * @param[in,out] candidates
+     * Shortlist to re-score and re-sort
+     */
+    virtual ReturnStatus
+    rerank(
+        const Template & /* probe */,
+        CandidateList & /* candidates */)
+    {
+        return (ReturnStatus(ReturnCode::NotImplemented));
+    }
+
+    /**
+     * @brief
+     * Hybrid identification: search a probe against the gallery and fuse
+     * the result with the candidate lists of the fused algorithms.
+     *
+     * @details
+     * This function is optional.  It replaces a call to search() followed
+     * by a call to ScoreFuserInterface::fuseCandidateLists() on its
+     * result and the algorithms' own lists, so that the implementation can
+     * share work between the two.  All input lists have the same length,
+     * L, and the output list may have variable length L ≤ x ≤ 2L.  This
+     * function will be preceded by a call to
+     * initialize(action=Action::Identify) and createGallery().
+     *
+     * @param[in] probe
+     * Fused probe template to search
+     * @param[in] inputLists
+     * K ≥ 1 candidate lists, each from one of the fused algorithms
+     * @param[out] fusedList
+     * Fused candidate list
+     */
+    virtual ReturnStatus
+    searchAndFuse(
+        const Template & /* probe */,
+        const std::vector<CandidateList> & /* inputLists */,
+        CandidateList & /* fusedList */)
+    {
+        return (ReturnStatus(ReturnCode::NotImplemented));
+    }
+
+    /**
+     * @brief
+     * Publish the gallery built by createGallery() so that other processes
+     * on the same host can search it without building their own copy.
+     *
+     * @details
+     * This function is optional.  It will be preceded by a call to
+     * createGallery().  The implementation writes everything search() needs
+     * (templates, identities and any search index) to the named location,
+     * which is a file path.  On Linux, a path under /dev/shm places the
+     * gallery in POSIX shared memory.  The location must only become
+     * visible once it is complete, so that a concurrent attachGallery()
+     * never sees a partially written gallery.
+     *
+     * @param[in] location
+     * Path of the shared gallery to write
+     */
+    virtual ReturnStatus
+    exportGallery(
+        const std::string & /* location */)
+    {
+        return (ReturnStatus(ReturnCode::NotImplemented));
+    }
+
+    /**
+     * @brief
+     * Attach, read-only, to a gallery previously written by exportGallery()
+     * and make it the gallery for subsequent calls to search().
+     *
+     * @details
+     * This function is optional and takes the place of createGallery() in
+     * a worker process.  It will be preceded by a call to
+     * initialize(action = Action::Identify).  The implementation should map
+     * the shared gallery rather than copy it, so that N worker processes
+     * hold one physical copy of the gallery between them.  The attached
+     * gallery must not be modified.
+     *
+     * @param[in] location
+     * Path of the shared gallery, as passed to exportGallery()
+     */
+    virtual ReturnStatus
+    attachGallery(
+        const std::string & /* location */)
+    {
+        return (ReturnStatus(ReturnCode::NotImplemented));
+    }
+
+    /**
+     * @brief
+     * Report the size and construction cost of the current gallery.
+     *
+     * @details
+     * This function is optional.  It will be preceded by a call to
+     * createGallery() or attachGallery(), and may be called at any time
+     * between searches.  It must be cheap relative to a search and must not
+     * modify the gallery.
+     *
+     * @param[out] stats
+     * Statistics of the current gallery
+     */
+    virtual ReturnStatus
+    galleryStats(
+        GalleryStats & /* stats */)
+    {
+        return (ReturnStatus(ReturnCode::NotImplemented));
+    }
+
     /**
      * @brief
      * Factory method to return a managed pointer to the
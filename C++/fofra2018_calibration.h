@@ -0,0 +1,325 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_CALIBRATION_H_
+#define FOFRA2018_CALIBRATION_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "fofra2018.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * Monotone map from fused scores to calibrated probabilities or
+ * log-likelihood ratios, trained by isotonic regression.
+ *
+ * @details
+ * The map is piecewise linear between knots and constant beyond the
+ * first and last.  Calibrated outputs of different combinations of
+ * algorithms are on one scale, so one threshold serves them all.  The
+ * table is stored in CalibrationTable::FileName in a model directory, in
+ * host byte order.
+ */
+struct CalibrationTable {
+    /** @brief What a calibrated score is */
+    enum class Output {
+        /** Probability of a mate, at the training set's mate prevalence */
+        Probability = 0,
+        /** Natural log of the likelihood ratio, independent of prevalence */
+        LogLikelihoodRatio
+    };
+
+    /** @brief What the values are */
+    Output output;
+    /** @brief Fused scores of the knots, strictly increasing */
+    std::vector<double> scores;
+    /** @brief Calibrated value at each knot, non-decreasing */
+    std::vector<double> values;
+
+    static constexpr const char *FileName = "calibration.bin";
+    static constexpr const char *Magic = "FOFRACAL";
+    static constexpr uint32_t Version = 1;
+
+    CalibrationTable() :
+        output{Output::LogLikelihoodRatio}
+        {}
+
+    /**
+     * @brief
+     * Return the calibrated value of a fused score.
+     *
+     * @details
+     * The knot is found by a binary search whose steps depend only on
+     * the number of knots and whose comparisons compile to conditional
+     * moves, so the cost is the same for every score and there are no
+     * mispredicted branches.  A NaN score calibrates to NaN.
+     */
+    double
+    apply(
+        double score) const
+    {
+        const size_t n = this->scores.size();
+        if (n < 2)
+            return (n == 0 ? score : this->values[0]);
+        const double *base = this->scores.data();
+        for (size_t size = n; size > 1; ) {
+            const size_t half = size / 2;
+            base = (base[half] <= score) ? base + half : base;
+            size -= half;
+        }
+        const size_t i = std::min<size_t>(
+            static_cast<size_t>(base - this->scores.data()), n - 2);
+        double t = (score - this->scores[i]) /
+            (this->scores[i + 1] - this->scores[i]);
+        t = (t < 0.0) ? 0.0 : t;
+        t = (t > 1.0) ? 1.0 : t;
+        return (this->values[i] + t * (this->values[i + 1] -
+            this->values[i]));
+    }
+
+    /** @brief Calibrate n scores; in and out may be the same. */
+    void
+    apply(
+        const double *in,
+        size_t n,
+        double *out) const
+    {
+        for (size_t i = 0; i < n; i++)
+            out[i] = this->apply(in[i]);
+    }
+
+    /**
+     * @brief
+     * Calibrate the scores of a fused candidate list in place.  The map
+     * is monotone, so the order of the list is unchanged.
+     */
+    void
+    apply(
+        CandidateList &candidates) const
+    {
+        for (auto &c : candidates)
+            c.score = this->apply(c.score);
+    }
+
+    /**
+     * @brief
+     * Write the table to FileName in a model directory, replacing any
+     * previous table atomically.
+     */
+    ReturnStatus
+    write(
+        const std::string &directory) const
+    {
+        const std::string path = directory + "/" + FileName;
+        const std::string temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            const uint32_t version = Version;
+            const uint32_t kind = static_cast<uint32_t>(this->output);
+            const uint64_t n = this->scores.size();
+            out.write(Magic, 8);
+            put(out, &version, 1);
+            put(out, &kind, 1);
+            put(out, &n, 1);
+            put(out, this->scores.data(), n);
+            put(out, this->values.data(), n);
+            if (!out.flush())
+                return (ReturnStatus(ReturnCode::VendorError,
+                    temporary + ": write failed"));
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0)
+            return (ReturnStatus(ReturnCode::VendorError,
+                path + ": " + std::strerror(errno)));
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /** @brief Read the table from FileName in a model directory. */
+    ReturnStatus
+    read(
+        const std::string &directory)
+    {
+        const std::string path = directory + "/" + FileName;
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return (ReturnStatus(ReturnCode::ConfigError, path));
+
+        char magic[8];
+        uint32_t version, kind;
+        uint64_t n;
+        in.read(magic, sizeof(magic));
+        if (!get(in, &version, 1) || !get(in, &kind, 1) ||
+            !get(in, &n, 1) ||
+            std::memcmp(magic, Magic, sizeof(magic)) != 0 ||
+            version != Version ||
+            kind > static_cast<uint32_t>(Output::LogLikelihoodRatio) ||
+            n > (UINT64_C(1) << 24))
+            return (ReturnStatus(ReturnCode::ConfigError,
+                path + ": not a calibration table"));
+
+        this->output = static_cast<Output>(kind);
+        this->scores.resize(n);
+        this->values.resize(n);
+        if (!get(in, this->scores.data(), n) ||
+            !get(in, this->values.data(), n))
+            return (ReturnStatus(ReturnCode::ConfigError,
+                path + ": truncated"));
+        for (size_t i = 1; i < n; i++)
+            if (!(this->scores[i] > this->scores[i - 1]) ||
+                !(this->values[i] >= this->values[i - 1]))
+                return (ReturnStatus(ReturnCode::ConfigError,
+                    path + ": not monotone"));
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+private:
+    template<typename T>
+    static void
+    put(
+        std::ostream &out,
+        const T *values,
+        size_t n)
+    {
+        out.write(reinterpret_cast<const char*>(values),
+            static_cast<std::streamsize>(n * sizeof(T)));
+    }
+
+    template<typename T>
+    static bool
+    get(
+        std::istream &in,
+        T *values,
+        size_t n)
+    {
+        return (static_cast<bool>(in.read(reinterpret_cast<char*>(values),
+            static_cast<std::streamsize>(n * sizeof(T)))));
+    }
+};
+using CalibrationTable = struct CalibrationTable;
+
+/**
+ * @brief
+ * Train a CalibrationTable by isotonic regression of mate status on
+ * fused score.
+ *
+ * @details
+ * Scores are sorted once and tied scores pooled; one pool-adjacent-
+ * violators pass over the sorted scores then merges neighbouring blocks
+ * until the mate rate never decreases, in O(N) after the sort.  Blocks
+ * are merged further, in order, to at most maxKnots of about equal
+ * weight, and each becomes a knot at its mean score.  Rates are kept
+ * 1/(2N) away from 0 and 1 so that log-likelihood ratios are finite.
+ *
+ * @param[in] scores
+ * N fused scores; NaNs are ignored
+ * @param[in] genuine
+ * true where scores[i] compares mates
+ * @param[in] output
+ * What the table's values are
+ * @param[in] maxKnots
+ * Largest number of knots in the table, ≥ 2
+ * @param[out] table
+ * Calibration table
+ */
+inline ReturnStatus
+trainCalibration(
+    const std::vector<double> &scores,
+    const std::vector<bool> &genuine,
+    CalibrationTable::Output output,
+    size_t maxKnots,
+    CalibrationTable &table)
+{
+    if (scores.size() != genuine.size())
+        return (ReturnStatus(ReturnCode::NonCongruentVectors,
+            "need one label per score"));
+    if (maxKnots < 2)
+        return (ReturnStatus(ReturnCode::NumDataError,
+            "need at least two knots"));
+
+    std::vector<std::pair<double, bool>> sorted;
+    sorted.reserve(scores.size());
+    double mates = 0.0;
+    for (size_t i = 0; i < scores.size(); i++)
+        if (scores[i] == scores[i]) {
+            sorted.emplace_back(scores[i], genuine[i]);
+            mates += genuine[i] ? 1.0 : 0.0;
+        }
+    const double N = static_cast<double>(sorted.size());
+    if (mates == 0.0 || mates == N)
+        return (ReturnStatus(ReturnCode::NumDataError,
+            "need genuine and impostor scores"));
+    std::sort(sorted.begin(), sorted.end());
+
+    /* Pool adjacent violators, tied scores forming one block */
+    struct Block {
+        double weight;
+        double mates;
+        double scoreSum;
+    };
+    std::vector<Block> blocks;
+    for (size_t i = 0; i < sorted.size(); ) {
+        Block b{0.0, 0.0, 0.0};
+        const double s = sorted[i].first;
+        for (; i < sorted.size() && sorted[i].first == s; i++) {
+            b.weight += 1.0;
+            b.mates += sorted[i].second ? 1.0 : 0.0;
+            b.scoreSum += s;
+        }
+        while (!blocks.empty() &&
+            blocks.back().mates * b.weight >= b.mates * blocks.back().weight) {
+            b.weight += blocks.back().weight;
+            b.mates += blocks.back().mates;
+            b.scoreSum += blocks.back().scoreSum;
+            blocks.pop_back();
+        }
+        blocks.push_back(b);
+    }
+
+    /* Merge runs of blocks to at most maxKnots of about equal weight */
+    std::vector<Block> knots;
+    const double share = N / static_cast<double>(maxKnots);
+    double before = 0.0, group = -1.0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (std::floor(before / share) != group) {
+            group = std::floor(before / share);
+            knots.push_back(Block{0.0, 0.0, 0.0});
+        }
+        knots.back().weight += blocks[i].weight;
+        knots.back().mates += blocks[i].mates;
+        knots.back().scoreSum += blocks[i].scoreSum;
+        before += blocks[i].weight;
+    }
+
+    const double margin = 0.5 / N;
+    const double priorLogOdds = std::log(mates / (N - mates));
+    table = CalibrationTable();
+    table.output = output;
+    for (const auto &k : knots) {
+        double rate = k.mates / k.weight;
+        rate = std::min(std::max(rate, margin), 1.0 - margin);
+        table.scores.push_back(k.scoreSum / k.weight);
+        table.values.push_back(output == CalibrationTable::Output::Probability ?
+            rate : std::log(rate / (1.0 - rate)) - priorLogOdds);
+    }
+    return (ReturnStatus(ReturnCode::Success));
+}
+}
+
+#endif /* FOFRA2018_CALIBRATION_H_ */
@@ -0,0 +1,330 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_DEDUP_H_
+#define FOFRA2018_DEDUP_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_gallery.h"
+#include "fofra2018_threads.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * Score every row of a against every row of b, a block at a time.
+ *
+ * @details
+ * Rows of b are taken Tile at a time and every row of a is scored against
+ * the tile before moving on, so a tile of b stays in cache while a
+ * streams past it.
+ *
+ * @param[in] a
+ * Pointers to m templates
+ * @param[in] b
+ * Pointers to n templates
+ * @param[in] dimension
+ * Dimension of every template
+ * @param[in] compare
+ * Comparator with the signature of l1Similarity()
+ * @param[out] scores
+ * m x n row-major scores, scores[i * n + j] for a[i] and b[j]
+ */
+template<typename Comparator>
+inline void
+scoreMatrix(
+    const std::vector<const double*> &a,
+    const std::vector<const double*> &b,
+    size_t dimension,
+    Comparator compare,
+    std::vector<double> &scores)
+{
+    const size_t m = a.size(), n = b.size();
+    const size_t Tile = std::max<size_t>(1, 16384 /
+        std::max<size_t>(1, dimension * sizeof(double)));
+    scores.resize(m * n);
+    for (size_t j0 = 0; j0 < n; j0 += Tile) {
+        const size_t j1 = std::min(n, j0 + Tile);
+        for (size_t i = 0; i < m; i++)
+            for (size_t j = j0; j < j1; j++)
+                scores[i * n + j] = compare(a[i], b[j], dimension);
+    }
+}
+
+/** @brief Two gallery rows whose templates are near-duplicates */
+struct DuplicatePair {
+    /** @brief Lower row */
+    uint32_t first;
+    /** @brief Higher row */
+    uint32_t second;
+    /** @brief Similarity of the two templates */
+    double score;
+    /** @brief true if both rows are enrolled under one identity */
+    bool sameIdentity;
+};
+using DuplicatePair = struct DuplicatePair;
+
+/** @brief Parameters of findNearDuplicates() */
+struct DeduplicationOptions {
+    /** @brief What to do with near-duplicates of one identity */
+    enum class Action {
+        /** Report them only */
+        Flag = 0,
+        /** Keep one template of each group, e.g. at gallery build */
+        Collapse
+    };
+
+    /** @brief Score at or above which two templates are near-duplicates */
+    double threshold;
+    /**
+     * @brief
+     * Also compare templates of different identities, e.g. to find one
+     * person enrolled under two labels.  This is an N x N pass; without
+     * it, only templates of the same identity are compared.
+     */
+    bool crossIdentity;
+    /** @brief Handling of same-identity near-duplicates */
+    Action action;
+
+    DeduplicationOptions() :
+        threshold{100.0},
+        crossIdentity{false},
+        action{Action::Flag}
+        {}
+};
+using DeduplicationOptions = struct DeduplicationOptions;
+
+/**
+ * @brief
+ * Find pairs of gallery templates scoring at or above a threshold.
+ *
+ * @details
+ * Same-identity pairs come from the identity index, which groups each
+ * identity's rows, so their cost is the sum of the squared group sizes.
+ * With crossIdentity, the upper triangle of the N x N score matrix is
+ * scored in tiles spread over the pool.  Pairs are returned sorted by
+ * (first, second) whatever the number of threads.
+ *
+ * @param[in] gallery
+ * Gallery of enrolled templates
+ * @param[in] options
+ * Threshold and scope of the search
+ * @param[in] compare
+ * Comparator with the signature of l1Similarity()
+ * @param[in] pool
+ * Threads to score on
+ * @param[out] duplicates
+ * Pairs at or above the threshold
+ */
+template<typename Comparator>
+inline ReturnStatus
+findNearDuplicates(
+    const GalleryView &gallery,
+    const DeduplicationOptions &options,
+    Comparator compare,
+    WorkerPool &pool,
+    std::vector<DuplicatePair> &duplicates)
+{
+    duplicates.clear();
+    const size_t N = gallery.count, D = gallery.dimension;
+
+    if (!options.crossIdentity) {
+        /* Runs of one identity in the sorted index */
+        std::vector<size_t> groups;
+        for (size_t i = 0; i < N; i++)
+            if (i == 0 || gallery.index[i].identity !=
+                gallery.index[i - 1].identity)
+                groups.push_back(i);
+        groups.push_back(N);
+
+        std::vector<std::vector<DuplicatePair>> found(groups.size() - 1);
+        pool.parallelFor(found.size(), 64, [&](size_t begin, size_t end) {
+            std::vector<const double*> rows;
+            std::vector<double> scores;
+            for (size_t g = begin; g < end; g++) {
+                const size_t size = groups[g + 1] - groups[g];
+                if (size < 2)
+                    continue;
+                rows.clear();
+                for (size_t k = groups[g]; k < groups[g + 1]; k++)
+                    rows.push_back(gallery.templateAt(
+                        gallery.index[k].row));
+                scoreMatrix(rows, rows, D, compare, scores);
+                for (size_t x = 0; x < size; x++)
+                    for (size_t y = x + 1; y < size; y++) {
+                        if (!(scores[x * size + y] >= options.threshold))
+                            continue;
+                        uint32_t r1 = gallery.index[groups[g] + x].row;
+                        uint32_t r2 = gallery.index[groups[g] + y].row;
+                        if (r1 > r2)
+                            std::swap(r1, r2);
+                        found[g].push_back(DuplicatePair{r1, r2,
+                            scores[x * size + y], true});
+                    }
+            }
+        });
+        for (const auto &f : found)
+            duplicates.insert(duplicates.end(), f.begin(), f.end());
+    } else {
+        /* Tiles of rows; tile pair (s, t) with s <= t */
+        const size_t Rows = 256;
+        const size_t tiles = (N + Rows - 1) / Rows;
+        std::vector<std::vector<DuplicatePair>> found(tiles);
+        pool.parallelFor(tiles, 1, [&](size_t begin, size_t end) {
+            std::vector<const double*> a, b;
+            std::vector<double> scores;
+            for (size_t s = begin; s < end; s++) {
+                a.clear();
+                for (size_t r = s * Rows; r < std::min(N, (s + 1) * Rows);
+                    r++)
+                    a.push_back(gallery.templateAt(r));
+                for (size_t t = s; t < tiles; t++) {
+                    b.clear();
+                    for (size_t r = t * Rows;
+                        r < std::min(N, (t + 1) * Rows); r++)
+                        b.push_back(gallery.templateAt(r));
+                    scoreMatrix(a, b, D, compare, scores);
+                    for (size_t x = 0; x < a.size(); x++)
+                        for (size_t y = (s == t ? x + 1 : 0); y < b.size();
+                            y++) {
+                            if (!(scores[x * b.size() + y] >=
+                                options.threshold))
+                                continue;
+                            const uint32_t r1 = static_cast<uint32_t>(
+                                s * Rows + x);
+                            const uint32_t r2 = static_cast<uint32_t>(
+                                t * Rows + y);
+                            found[s].push_back(DuplicatePair{r1, r2,
+                                scores[x * b.size() + y],
+                                gallery.ids[r1] == gallery.ids[r2]});
+                        }
+                }
+            }
+        });
+        for (const auto &f : found)
+            duplicates.insert(duplicates.end(), f.begin(), f.end());
+    }
+
+    std::sort(duplicates.begin(), duplicates.end(),
+        [](const DuplicatePair &a, const DuplicatePair &b) {
+            return (a.first != b.first ? a.first < b.first :
+                a.second < b.second); });
+    return (ReturnStatus(ReturnCode::Success));
+}
+
+/**
+ * @brief
+ * Choose the rows to keep when collapsing near-duplicates: of each group
+ * of one identity's templates linked by near-duplicate pairs, only the
+ * lowest row is kept.  Pairs of different identities never collapse.
+ *
+ * @param[in] count
+ * Number of gallery rows, N
+ * @param[in] duplicates
+ * Pairs from findNearDuplicates()
+ * @param[out] keep
+ * Rows to keep, in increasing order
+ */
+inline void
+collapseDuplicates(
+    size_t count,
+    const std::vector<DuplicatePair> &duplicates,
+    std::vector<uint32_t> &keep)
+{
+    /* Union-find, with each group's root its lowest row */
+    std::vector<uint32_t> parent(count);
+    std::iota(parent.begin(), parent.end(), 0);
+    const auto root = [&](uint32_t r) {
+        while (parent[r] != r) {
+            parent[r] = parent[parent[r]];
+            r = parent[r];
+        }
+        return (r);
+    };
+    for (const auto &d : duplicates) {
+        if (!d.sameIdentity)
+            continue;
+        const uint32_t a = root(d.first), b = root(d.second);
+        if (a != b)
+            parent[std::max(a, b)] = std::min(a, b);
+    }
+    keep.clear();
+    for (uint32_t r = 0; r < count; r++)
+        if (root(r) == r)
+            keep.push_back(r);
+}
+
+/**
+ * @brief
+ * Build a gallery as MappedGallery::build() does, with a near-duplicate
+ * pass over the enrolled templates.
+ *
+ * @details
+ * With Action::Collapse, the gallery is rebuilt from the rows that
+ * collapseDuplicates() keeps; the reported pairs refer to rows of the
+ * templates as given.
+ *
+ * @param[in] templates
+ * N fused templates, all of the same dimension
+ * @param[in] ids
+ * N identity labels, ids[i] corresponds to templates[i]
+ * @param[in] options
+ * Threshold, scope and handling of near-duplicates
+ * @param[in] compare
+ * Comparator with the signature of l1Similarity()
+ * @param[in] pool
+ * Threads to score on
+ * @param[out] gallery
+ * Gallery of the templates kept
+ * @param[out] duplicates
+ * Near-duplicate pairs found
+ */
+template<typename Comparator>
+inline ReturnStatus
+buildDeduplicatedGallery(
+    const std::vector<Template> &templates,
+    const std::vector<uint32_t> &ids,
+    const DeduplicationOptions &options,
+    Comparator compare,
+    WorkerPool &pool,
+    MappedGallery &gallery,
+    std::vector<DuplicatePair> &duplicates)
+{
+    ReturnStatus rs = gallery.build(templates, ids);
+    if (rs.code != ReturnCode::Success)
+        return (rs);
+    rs = findNearDuplicates(gallery.view(), options, compare, pool,
+        duplicates);
+    if (rs.code != ReturnCode::Success ||
+        options.action != DeduplicationOptions::Action::Collapse)
+        return (rs);
+
+    std::vector<uint32_t> keep;
+    collapseDuplicates(templates.size(), duplicates, keep);
+    if (keep.size() == templates.size())
+        return (rs);
+    std::vector<Template> keptTemplates;
+    std::vector<uint32_t> keptIds;
+    keptTemplates.reserve(keep.size());
+    keptIds.reserve(keep.size());
+    for (const auto r : keep) {
+        keptTemplates.push_back(templates[r]);
+        keptIds.push_back(ids[r]);
+    }
+    return (gallery.build(keptTemplates, keptIds));
+}
+}
+
+#endif /* FOFRA2018_DEDUP_H_ */
@@ -0,0 +1,340 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_DENSEFUSION_H_
+#define FOFRA2018_DENSEFUSION_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fofra2018.h"
+#include "fofra2018_gallery.h"
+#include "fofra2018_threads.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * Parameters of weighted-sum fusion of normalized dense score vectors,
+ * sum over k of weights[k] * (s_k - location[k]) / scale[k].
+ */
+struct DenseFusionModel {
+    /** @brief Weight of each of the K algorithms */
+    std::vector<double> weights;
+    /** @brief Location of each algorithm's impostor scores */
+    std::vector<double> location;
+    /** @brief Scale of each algorithm's impostor scores, > 0 */
+    std::vector<double> scale;
+    /**
+     * @brief
+     * Normalize each vector by its own mean and standard deviation
+     * instead of location and scale.  Nearly all of a probe's scores
+     * against a large gallery are impostor scores, so this is a per-probe
+     * z-norm that adapts to probe quality; the estimate costs a fraction
+     * (1 / sampleStride) of a pass over the scores.
+     */
+    bool perProbe;
+    /** @brief Estimate per-probe moments from every sampleStride-th block */
+    size_t sampleStride;
+
+    DenseFusionModel() :
+        perProbe{false},
+        sampleStride{8}
+        {}
+};
+using DenseFusionModel = struct DenseFusionModel;
+
+namespace Dense {
+
+/* Rows fused per buffer; the buffer and K input blocks stay in L1/L2 */
+constexpr size_t BlockRows = 1024;
+
+/**
+ * @brief
+ * Mean and standard deviation of the non-NaN scores of a vector, from
+ * every stride-th block of BlockRows scores.
+ *
+ * @details
+ * Whole blocks are read so that the sample costs 1/stride of the memory
+ * traffic of a full pass.  The sums are kept in independent lanes so the
+ * loop vectorizes; NaNs are masked rather than branched on.  Scores are
+ * taken relative to the first one, so the variance does not cancel when
+ * scores are large relative to their spread.
+ */
+inline void
+moments(
+    const ScoreVector &v,
+    size_t stride,
+    double &mean,
+    double &deviation)
+{
+    constexpr size_t Lanes = 8;
+    double sum[Lanes] = {}, squares[Lanes] = {}, seen[Lanes] = {};
+    const size_t blocks = (v.count + BlockRows - 1) / BlockRows;
+    /* Small vectors are read whole */
+    if (blocks < 64 * stride)
+        stride = 1;
+    double pivot = 0.0;
+    for (size_t i = 0; i < v.count; i++)
+        if (v.scores[i] == v.scores[i]) {
+            pivot = v.scores[i];
+            break;
+        }
+    for (size_t b = 0; b < blocks; b += std::max<size_t>(1, stride)) {
+        const size_t first = b * BlockRows;
+        const size_t rows = std::min(BlockRows, v.count - first);
+        const double *s = v.scores + first;
+        size_t i = 0;
+        for (; i + Lanes <= rows; i += Lanes)
+            for (size_t l = 0; l < Lanes; l++) {
+                const double x = s[i + l] - pivot;
+                const bool ok = (x == x);
+                sum[l] += ok ? x : 0.0;
+                squares[l] += ok ? x * x : 0.0;
+                seen[l] += ok ? 1.0 : 0.0;
+            }
+        for (; i < rows; i++)
+            if (s[i] == s[i]) {
+                sum[0] += s[i] - pivot;
+                squares[0] += (s[i] - pivot) * (s[i] - pivot);
+                seen[0] += 1.0;
+            }
+    }
+    double n = 0.0, total = 0.0, totalSquares = 0.0;
+    for (size_t l = 0; l < Lanes; l++) {
+        n += seen[l];
+        total += sum[l];
+        totalSquares += squares[l];
+    }
+    const double shifted = (n > 0.0) ? total / n : 0.0;
+    mean = pivot + shifted;
+    deviation = (n > 1.0) ? std::sqrt(std::max(0.0,
+        (totalSquares - n * shifted * shifted) / (n - 1.0))) : 0.0;
+}
+
+/*
+ * fused[i] = bias + sum over k of gain[k] * s_k[i], a missing (NaN) score
+ * counting as its algorithm's location.  Straight-line over i so that the
+ * compiler vectorizes each pass; each input is read once, in order.
+ */
+inline void
+fuseBlock(
+    const std::vector<const double*> &inputs,
+    const std::vector<double> &gain,
+    const std::vector<double> &fill,
+    double bias,
+    size_t rows,
+    double *fused)
+{
+    for (size_t i = 0; i < rows; i++)
+        fused[i] = bias;
+    for (size_t k = 0; k < inputs.size(); k++) {
+        const double *s = inputs[k];
+        const double g = gain[k], f = fill[k];
+        for (size_t i = 0; i < rows; i++) {
+            const double x = s[i];
+            fused[i] += g * ((x == x) ? x : f);
+        }
+    }
+}
+}
+
+/**
+ * @brief
+ * Fuse K dense score vectors with a DenseFusionModel and select the top
+ * candidates, in one streaming pass over the scores.
+ *
+ * @details
+ * The normalization and weights fold into one gain per algorithm and a
+ * constant, so fusion is a multiply-add per score.  Rows are fused a
+ * block at a time into a buffer that stays in cache, and only rows
+ * beating the current selection's floor reach the heap, so the pass runs
+ * at memory bandwidth; the rows are split over the pool's threads, each
+ * with its own selection, merged at the end.  Ties are broken in favour
+ * of the lower gallery entry, whatever the number of threads.
+ *
+ * @param[in] inputs
+ * K score vectors over the same N gallery entries
+ * @param[in] ids
+ * N identity labels, ids[i] for gallery entry i
+ * @param[in] model
+ * Normalization and weights, one of each per algorithm
+ * @param[in] pool
+ * Threads to fuse on
+ * @param[out] candidates
+ * Pre-allocated candidate list, filled best first; entries beyond N are
+ * left empty
+ */
+inline ReturnStatus
+fuseDenseScores(
+    const std::vector<ScoreVector> &inputs,
+    const uint32_t *ids,
+    const DenseFusionModel &model,
+    WorkerPool &pool,
+    CandidateList &candidates)
+{
+    const size_t K = inputs.size();
+    if (K == 0 || model.weights.size() != K ||
+        (!model.perProbe && (model.location.size() != K ||
+        model.scale.size() != K)))
+        return (ReturnStatus(ReturnCode::NonCongruentVectors,
+            "need one weight, location and scale per score vector"));
+    const size_t N = inputs[0].count;
+    for (const auto &v : inputs)
+        if (v.count != N || (N != 0 && v.scores == nullptr))
+            return (ReturnStatus(ReturnCode::NonCongruentVectors,
+                "score vectors differ in length"));
+
+    std::vector<double> gain(K), fill(K);
+    double bias = 0.0;
+    for (size_t k = 0; k < K; k++) {
+        double location, scale;
+        if (model.perProbe)
+            Dense::moments(inputs[k], model.sampleStride, location, scale);
+        else {
+            location = model.location[k];
+            scale = model.scale[k];
+        }
+        if (!(scale > 0.0))
+            return (ReturnStatus(ReturnCode::NumDataError,
+                "score scale must be positive"));
+        gain[k] = model.weights[k] / scale;
+        fill[k] = location;
+        bias -= gain[k] * location;
+    }
+
+    /* Whole blocks per task, several tasks per thread for balance */
+    const size_t blocks = (N + Dense::BlockRows - 1) / Dense::BlockRows;
+    const size_t tasks = std::min(blocks, 4 * pool.size());
+    const size_t L = std::min(candidates.size(), N);
+    std::vector<std::vector<TopCandidates::Entry>> found(tasks);
+    pool.parallelFor(tasks, 1, [&](size_t begin, size_t end) {
+        std::vector<double> fused(Dense::BlockRows);
+        std::vector<const double*> block(K);
+        for (size_t t = begin; t < end; t++) {
+            TopCandidates top(L);
+            for (size_t b = t * blocks / tasks; b < (t + 1) * blocks / tasks;
+                b++) {
+                const size_t first = b * Dense::BlockRows;
+                const size_t rows = std::min(Dense::BlockRows, N - first);
+                for (size_t k = 0; k < K; k++)
+                    block[k] = inputs[k].scores + first;
+                Dense::fuseBlock(block, gain, fill, bias, rows,
+                    fused.data());
+                double floor = top.floor();
+                for (size_t i = 0; i < rows; i++)
+                    if (fused[i] > floor) {
+                        top.offer(fused[i], static_cast<uint32_t>(first + i));
+                        floor = top.floor();
+                    }
+            }
+            top.drain(found[t]);
+        }
+    });
+
+    TopCandidates top(L);
+    for (const auto &f : found)
+        for (const auto &e : f)
+            top.offer(e.score, e.row);
+    std::vector<TopCandidates::Entry> best;
+    top.drain(best);
+    for (size_t i = 0; i < candidates.size(); i++)
+        candidates[i] = (i < best.size()) ?
+            Candidate(ids[best[i].row], best[i].score) : Candidate();
+    return (ReturnStatus(ReturnCode::Success));
+}
+
+/**
+ * @brief
+ * A score vector in a file of N little-endian doubles, mapped read-only,
+ * for fuseDenseScores() without reading the file into memory first.
+ */
+class MappedScoreVector {
+public:
+    MappedScoreVector() :
+        base{nullptr},
+        length{0}
+        {}
+
+    ~MappedScoreVector()
+    {
+        this->release();
+    }
+
+    MappedScoreVector(const MappedScoreVector&) = delete;
+    MappedScoreVector &operator=(const MappedScoreVector&) = delete;
+
+    /** @brief Map a file of scores; the pages are read ahead in order. */
+    ReturnStatus
+    open(
+        const std::string &path)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return (ReturnStatus(ReturnCode::InputLocationError,
+                path + ": " + std::strerror(errno)));
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size % sizeof(double) != 0) {
+            close(fd);
+            return (ReturnStatus(ReturnCode::TemplateFormatError,
+                path + ": not a file of doubles"));
+        }
+        const size_t size = static_cast<size_t>(st.st_size);
+        void *image = (size == 0) ? nullptr : mmap(nullptr, size, PROT_READ,
+            MAP_SHARED, fd, 0);
+        close(fd);
+        if (image == MAP_FAILED)
+            return (ReturnStatus(ReturnCode::MemoryError,
+                std::strerror(errno)));
+        if (image != nullptr)
+            madvise(image, size, MADV_SEQUENTIAL);
+
+        this->release();
+        this->base = image;
+        this->length = size;
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /** @brief Unmap the file, if any. */
+    void
+    release()
+    {
+        if (this->base != nullptr)
+            munmap(this->base, this->length);
+        this->base = nullptr;
+        this->length = 0;
+    }
+
+    /** @brief Return the mapped scores. */
+    ScoreVector
+    view() const
+    {
+        return (ScoreVector(static_cast<const double*>(this->base),
+            this->length / sizeof(double)));
+    }
+
+private:
+    void *base;
+    size_t length;
+};
+}
+
+#endif /* FOFRA2018_DENSEFUSION_H_ */
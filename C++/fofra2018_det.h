@@ -0,0 +1,340 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_DET_H_
+#define FOFRA2018_DET_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_threads.h"
+
+namespace FOFRA {
+
+/** @brief One operating point of a DET */
+struct DetPoint {
+    /** @brief Score at or above which comparisons are matches */
+    double threshold;
+    /** @brief Fraction of impostor scores at or above threshold */
+    double fmr;
+    /** @brief Fraction of genuine scores below threshold */
+    double fnmr;
+};
+using DetPoint = struct DetPoint;
+
+/** @brief Bootstrap confidence interval of FNMR at a target FMR */
+struct DetInterval {
+    /** @brief Target FMR */
+    double targetFMR;
+    /** @brief Operating point on all the data */
+    DetPoint point;
+    /** @brief Lower percentile bound of FNMR */
+    double fnmrLower;
+    /** @brief Upper percentile bound of FNMR */
+    double fnmrUpper;
+};
+using DetInterval = struct DetInterval;
+
+/**
+ * @brief
+ * DET operating points at target FMRs, as compute_det() in
+ * R/fusion_example_score_level.R, with subject-level bootstrap
+ * confidence intervals.
+ *
+ * @details
+ * The scores are sorted once, when the object is built.  A bootstrap
+ * replicate draws subjects with replacement and gives each score the
+ * multiplicity of its subject, so the resampled data are the sorted
+ * arrays with integer weights: thresholds and error rates come from
+ * weighted counting in one pass over each array, with no re-sorting.
+ * Replicate r draws from its own generator seeded with seed + r, so
+ * results do not depend on the number of threads, and two objects over
+ * the same subjects (e.g. two fusers' scores for the same comparisons)
+ * resample identically for a given seed, which pairs their replicates.
+ */
+class DetBootstrap {
+public:
+    /**
+     * @param[in] scores
+     * Comparison scores, higher meaning more similar
+     * @param[in] genuine
+     * true for mated comparisons, per score
+     * @param[in] subjects
+     * Subject, 0..S-1, whose resampling carries each score, e.g. the
+     * probe's subject
+     */
+    DetBootstrap(
+        const std::vector<double> &scores,
+        const std::vector<bool> &genuine,
+        const std::vector<uint32_t> &subjects) :
+        subjectCount{0}
+    {
+        const size_t n = std::min(scores.size(),
+            std::min(genuine.size(), subjects.size()));
+        for (size_t i = 0; i < n; i++) {
+            if (std::isnan(scores[i]))
+                continue;
+            Scored s{scores[i], subjects[i]};
+            (genuine[i] ? this->mated : this->nonmated).push_back(s);
+            this->subjectCount = std::max<size_t>(this->subjectCount,
+                subjects[i] + size_t(1));
+        }
+        /* Impostors from high to low, genuines from low to high */
+        std::sort(this->nonmated.begin(), this->nonmated.end(),
+            [](const Scored &a, const Scored &b) {
+                return (a.score > b.score); });
+        std::sort(this->mated.begin(), this->mated.end(),
+            [](const Scored &a, const Scored &b) {
+                return (a.score < b.score); });
+    }
+
+    /**
+     * @brief
+     * Compute DET points at target FMRs on all the data.
+     *
+     * @param[in] fmrs
+     * Target FMRs, each in [0, 1]
+     * @param[out] points
+     * One point per target
+     */
+    ReturnStatus
+    compute(
+        const std::vector<double> &fmrs,
+        std::vector<DetPoint> &points) const
+    {
+        if (!this->usable(fmrs))
+            return (ReturnStatus(ReturnCode::NumDataError,
+                "need genuine and impostor scores and FMRs in [0, 1]"));
+        const std::vector<uint32_t> ones(this->subjectCount, 1);
+        this->evaluate(fmrs, ones, points);
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /**
+     * @brief
+     * Compute FNMR at target FMRs on bootstrap replicates.
+     *
+     * @param[in] fmrs
+     * Target FMRs, each in [0, 1]
+     * @param[in] replicates
+     * Number of replicates, B
+     * @param[in] seed
+     * Seed of replicate 0
+     * @param[in] pool
+     * Threads to resample on
+     * @param[out] fnmr
+     * B x T row-major FNMR, for replicate b and target t at b * T + t
+     */
+    ReturnStatus
+    resample(
+        const std::vector<double> &fmrs,
+        size_t replicates,
+        uint64_t seed,
+        WorkerPool &pool,
+        std::vector<double> &fnmr) const
+    {
+        if (!this->usable(fmrs))
+            return (ReturnStatus(ReturnCode::NumDataError,
+                "need genuine and impostor scores and FMRs in [0, 1]"));
+        const size_t T = fmrs.size();
+        fnmr.assign(replicates * T, 0.0);
+        pool.parallelFor(replicates, 4, [&](size_t begin, size_t end) {
+            std::vector<uint32_t> multiplicity(this->subjectCount);
+            std::vector<DetPoint> points;
+            for (size_t b = begin; b < end; b++) {
+                std::mt19937_64 rng(seed + b);
+                std::uniform_int_distribution<size_t> pick(0,
+                    this->subjectCount - 1);
+                std::fill(multiplicity.begin(), multiplicity.end(), 0);
+                for (size_t s = 0; s < this->subjectCount; s++)
+                    multiplicity[pick(rng)]++;
+                this->evaluate(fmrs, multiplicity, points);
+                for (size_t t = 0; t < T; t++)
+                    fnmr[b * T + t] = points[t].fnmr;
+            }
+        });
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /**
+     * @brief
+     * Compute percentile bootstrap confidence intervals of FNMR at
+     * target FMRs.
+     *
+     * @param[in] fmrs
+     * Target FMRs, each in [0, 1]
+     * @param[in] replicates
+     * Number of replicates, e.g. 2000
+     * @param[in] level
+     * Coverage of the intervals, e.g. 0.95
+     * @param[in] seed
+     * Seed of replicate 0
+     * @param[in] pool
+     * Threads to resample on
+     * @param[out] intervals
+     * One interval per target
+     */
+    ReturnStatus
+    confidenceIntervals(
+        const std::vector<double> &fmrs,
+        size_t replicates,
+        double level,
+        uint64_t seed,
+        WorkerPool &pool,
+        std::vector<DetInterval> &intervals) const
+    {
+        std::vector<DetPoint> points;
+        ReturnStatus rs = this->compute(fmrs, points);
+        if (rs.code != ReturnCode::Success)
+            return (rs);
+        if (replicates == 0 || !(level > 0.0 && level < 1.0))
+            return (ReturnStatus(ReturnCode::NumDataError,
+                "need replicates and 0 < level < 1"));
+        std::vector<double> fnmr;
+        rs = this->resample(fmrs, replicates, seed, pool, fnmr);
+        if (rs.code != ReturnCode::Success)
+            return (rs);
+
+        const size_t T = fmrs.size();
+        intervals.resize(T);
+        std::vector<double> column(replicates);
+        for (size_t t = 0; t < T; t++) {
+            for (size_t b = 0; b < replicates; b++)
+                column[b] = fnmr[b * T + t];
+            std::sort(column.begin(), column.end());
+            intervals[t].targetFMR = fmrs[t];
+            intervals[t].point = points[t];
+            intervals[t].fnmrLower = percentile(column, (1.0 - level) / 2.0);
+            intervals[t].fnmrUpper = percentile(column, (1.0 + level) / 2.0);
+        }
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+private:
+    struct Scored {
+        double score;
+        uint32_t subject;
+    };
+
+    bool
+    usable(
+        const std::vector<double> &fmrs) const
+    {
+        if (this->mated.empty() || this->nonmated.empty())
+            return (false);
+        for (const auto f : fmrs)
+            if (!(f >= 0.0 && f <= 1.0))
+                return (false);
+        return (true);
+    }
+
+    /* Type 7 quantile of sorted values, as R's quantile() */
+    static double
+    percentile(
+        const std::vector<double> &sorted,
+        double p)
+    {
+        const double h = (static_cast<double>(sorted.size()) - 1.0) * p;
+        const size_t lo = static_cast<size_t>(std::floor(h));
+        const size_t hi = std::min(lo + 1, sorted.size() - 1);
+        return (sorted[lo] + (h - static_cast<double>(lo)) *
+            (sorted[hi] - sorted[lo]));
+    }
+
+    /*
+     * DET points when every score of subject s counts multiplicity[s]
+     * times.  The threshold for FMR f is R's -quantile(-impostors, f) on
+     * the expanded impostor scores: in descending order, the value at
+     * 0-based position h = (W - 1) f, interpolated.
+     */
+    void
+    evaluate(
+        const std::vector<double> &fmrs,
+        const std::vector<uint32_t> &multiplicity,
+        std::vector<DetPoint> &points) const
+    {
+        const size_t T = fmrs.size();
+        points.resize(T);
+        std::vector<size_t> order(T);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return (fmrs[a] < fmrs[b]); });
+
+        double impostors = 0.0, genuines = 0.0;
+        for (const auto &s : this->nonmated)
+            impostors += multiplicity[s.subject];
+        for (const auto &s : this->mated)
+            genuines += multiplicity[s.subject];
+        if (impostors == 0.0 || genuines == 0.0) {
+            for (auto &p : points)
+                p = DetPoint{std::nan(""), std::nan(""), std::nan("")};
+            return;
+        }
+
+        /* Thresholds in increasing FMR are decreasing: one pass */
+        size_t i = 0;
+        double through = 0.0;   /* expanded positions before i */
+        for (const auto t : order) {
+            const double h = (impostors - 1.0) * fmrs[t];
+            const double lo = std::floor(h);
+            while (i < this->nonmated.size() &&
+                through + multiplicity[this->nonmated[i].subject] <= lo) {
+                through += multiplicity[this->nonmated[i].subject];
+                i++;
+            }
+            /* Position lo is in score i; position lo + 1 in i or later */
+            const double a = this->nonmated[i].score;
+            double b = a;
+            if (through + multiplicity[this->nonmated[i].subject] <=
+                lo + 1.0) {
+                size_t j = i + 1;
+                while (j < this->nonmated.size() &&
+                    multiplicity[this->nonmated[j].subject] == 0)
+                    j++;
+                if (j < this->nonmated.size())
+                    b = this->nonmated[j].score;
+            }
+            points[t].threshold = a - (h - lo) * (a - b);
+        }
+
+        /* FMR: impostors at or above; FNMR: genuines below */
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return (points[a].threshold > points[b].threshold); });
+        i = 0;
+        double above = 0.0;
+        for (const auto t : order) {
+            while (i < this->nonmated.size() &&
+                this->nonmated[i].score >= points[t].threshold)
+                above += multiplicity[this->nonmated[i++].subject];
+            points[t].fmr = above / impostors;
+        }
+        std::reverse(order.begin(), order.end());
+        i = 0;
+        double below = 0.0;
+        for (const auto t : order) {
+            while (i < this->mated.size() &&
+                this->mated[i].score < points[t].threshold)
+                below += multiplicity[this->mated[i++].subject];
+            points[t].fnmr = below / genuines;
+        }
+    }
+
+    size_t subjectCount;
+    std::vector<Scored> mated;
+    std::vector<Scored> nonmated;
+};
+}
+
+#endif /* FOFRA2018_DET_H_ */
@@ -0,0 +1,209 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+/*
+ * Checks that a search workload in forked children shares the parent's
+ * gallery rather than copying it, and that a WorkerPool carried across
+ * fork() still runs.  The parent builds a synthetic MappedGallery,
+ * searches it once on a WorkerPool, and forks children, as the NIST
+ * application does after createGallery(): half of them while the pool's
+ * workers are running and half after stop().  Every other child searches
+ * on the inherited pool with parallelFor(), the rest with searchGallery()
+ * on the calling thread.  Each child measures its privateDirtyBytes()
+ * before and after and checks its results against the parent's.  The
+ * test fails if a child's results differ, if it does not finish within a
+ * minute, or if its growth exceeds the bound, by default 4 MiB, a small
+ * fraction of the default 80 MiB gallery: a workload that wrote to the
+ * gallery, or to any structure of comparable size, would copy far more.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_gallery.h"
+#include "fofra2018_threads.h"
+
+using namespace FOFRA;
+
+namespace {
+
+/* Exit statuses of a child */
+const int ChildPassed = 0;
+const int ChildExceeded = 1;
+const int ChildFailed = 2;
+
+/* Search every probe, on the pool if there is one */
+bool
+searchAll(
+    const MappedGallery &gallery,
+    const std::vector<Template> &probes,
+    WorkerPool *pool,
+    std::vector<CandidateList> &results)
+{
+    std::vector<ReturnCode> codes(probes.size(), ReturnCode::Success);
+    auto body = [&](size_t begin, size_t end) {
+        for (size_t p = begin; p < end; p++)
+            codes[p] = searchGallery(gallery.view(), probes[p],
+                results[p]).code;
+    };
+    if (pool != nullptr)
+        pool->parallelFor(probes.size(), 1, body);
+    else
+        body(0, probes.size());
+    for (const auto code : codes)
+        if (code != ReturnCode::Success)
+            return (false);
+    return (true);
+}
+
+int
+child(
+    unsigned int number,
+    const MappedGallery &gallery,
+    const std::vector<Template> &probes,
+    const std::vector<CandidateList> &reference,
+    WorkerPool *pool,
+    std::vector<CandidateList> &results,
+    uint64_t bound)
+{
+    /* A pool that deadlocked after fork() would never return */
+    alarm(60);
+    uint64_t before, after;
+    ReturnStatus rs = privateDirtyBytes(getpid(), before);
+    if (rs.code != ReturnCode::Success) {
+        std::cerr << "child " << number << ": " << rs.code << " (" <<
+            rs.info << ")" << std::endl;
+        return (ChildFailed);
+    }
+    if (!searchAll(gallery, probes, pool, results)) {
+        std::cerr << "child " << number << ": search failed" << std::endl;
+        return (ChildFailed);
+    }
+    for (size_t p = 0; p < probes.size(); p++)
+        for (size_t i = 0; i < results[p].size(); i++)
+            if (results[p][i].identity != reference[p][i].identity ||
+                results[p][i].score != reference[p][i].score) {
+                std::cerr << "child " << number << ": probe " << p <<
+                    " differs from the parent's search" << std::endl;
+                return (ChildFailed);
+            }
+    rs = privateDirtyBytes(getpid(), after);
+    if (rs.code != ReturnCode::Success) {
+        std::cerr << "child " << number << ": " << rs.code << " (" <<
+            rs.info << ")" << std::endl;
+        return (ChildFailed);
+    }
+
+    const uint64_t growth = (after > before) ? after - before : 0;
+    std::cout << "child " << number << " (" << (pool != nullptr ? "pool" :
+        "serial") << "): private dirty " << before / 1024 << " KiB -> " <<
+        after / 1024 << " KiB (+" << growth / 1024 << " KiB)" << std::endl;
+    return (growth <= bound ? ChildPassed : ChildExceeded);
+}
+}
+
+int
+main(
+    int argc,
+    char *argv[])
+{
+    const size_t N = (argc > 1) ? std::stoul(argv[1]) : 40000;
+    const size_t D = (argc > 2) ? std::stoul(argv[2]) : 256;
+    const unsigned int C = (argc > 3) ? std::stoul(argv[3]) : 4;
+    const size_t P = (argc > 4) ? std::stoul(argv[4]) : 20;
+    const uint64_t bound = ((argc > 5) ? std::stoull(argv[5]) : 4096) * 1024;
+    const size_t T = (argc > 6) ? std::stoul(argv[6]) : 4;
+    const size_t L = 20;
+
+    std::mt19937_64 rng(2018);
+    std::normal_distribution<double> normal;
+    std::vector<Template> templates(N, Template(D));
+    std::vector<uint32_t> ids(N);
+    for (size_t i = 0; i < N; i++) {
+        for (auto &v : templates[i])
+            v = normal(rng);
+        ids[i] = static_cast<uint32_t>(i);
+    }
+    std::vector<Template> probes(P);
+    for (size_t p = 0; p < P; p++) {
+        probes[p] = templates[(p * 7919) % N];
+        for (auto &v : probes[p])
+            v += 0.3 * normal(rng);
+    }
+
+    MappedGallery gallery;
+    const ReturnStatus rs = gallery.build(templates, ids);
+    if (rs.code != ReturnCode::Success) {
+        std::cerr << "build: " << rs.code << std::endl;
+        return (EXIT_FAILURE);
+    }
+    templates.clear();
+    templates.shrink_to_fit();
+
+    /* Searching on the pool leaves its workers running */
+    WorkerPool pool(T);
+    std::vector<CandidateList> reference(P, CandidateList(L));
+    if (!searchAll(gallery, probes, &pool, reference)) {
+        std::cerr << "search failed" << std::endl;
+        return (EXIT_FAILURE);
+    }
+
+    /* Allocate the results before forking, as a harness would */
+    std::vector<CandidateList> results(P, CandidateList(L));
+    std::cout << "N=" << N << " D=" << D << " children=" << C <<
+        " probes=" << P << " threads=" << T << " gallery=" <<
+        gallery.bytes() / 1024 << " KiB bound=" << bound / 1024 << " KiB" <<
+        std::endl;
+
+    std::vector<pid_t> children;
+    for (unsigned int c = 0; c < C; c++) {
+        if (c == C / 2)
+            pool.stop();
+        const pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "fork: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        if (pid == 0)
+            _exit(child(c, gallery, probes, reference,
+                (c % 2 == 1) ? &pool : nullptr, results, bound));
+        children.push_back(pid);
+    }
+
+    bool passed = (children.size() == C);
+    for (size_t c = 0; c < children.size(); c++) {
+        int status = 0;
+        pid_t waited;
+        while ((waited = waitpid(children[c], &status, 0)) < 0 &&
+            errno == EINTR)
+            ;
+        if (waited < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != ChildPassed) {
+            std::cerr << "child " << c << ": " << (WIFEXITED(status) &&
+                WEXITSTATUS(status) == ChildExceeded ?
+                "private dirty memory grew beyond the bound" : "failed") <<
+                std::endl;
+            passed = false;
+        }
+    }
+    std::cout << (passed ? "PASS" : "FAIL") << std::endl;
+    return (passed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,561 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+/*
+ * Serves a ScoreFuserInterface and a TemplateFuserInterface implementation
+ * over a Unix domain socket, using the protocol in fofra2018_protocol.h.
+ * Link with the library that implements the interfaces' getImplementation().
+ *
+ * Each connection has a reader thread that decodes frames and hands them to
+ * a worker pool, so a client may pipeline requests; responses are written
+ * as they complete.  Unless --reentrant is given, calls into any one
+ * implementation object are serialized.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fofra2018.h"
+#include "fofra2018_protocol.h"
+#include "fofra2018_threads.h"
+
+using namespace FOFRA;
+using namespace FOFRA::Protocol;
+
+namespace {
+
+/* An implementation object and the lock that serializes calls into it */
+template<typename Interface>
+struct Service {
+    std::shared_ptr<Interface> impl;
+    std::mutex mutex;
+};
+
+struct Services {
+    Service<ScoreFuserInterface> scoreVerification;
+    Service<ScoreFuserInterface> scoreIdentification;
+    Service<TemplateFuserInterface> templateFuse;
+    Service<TemplateFuserInterface> templateVerify;
+    Service<TemplateFuserInterface> templateIdentify;
+    bool reentrant = false;
+    /* Longest candidate list and largest response a request may ask for */
+    size_t maxCandidates = 10000;
+    size_t maxPayloadBytes = 256 << 20;
+};
+
+struct Connection {
+    explicit Connection(
+        int fd) :
+        fd{fd},
+        inflight{0}
+        {}
+
+    ~Connection()
+    {
+        close(this->fd);
+    }
+
+    int fd;
+    std::mutex writeMutex;
+    std::mutex inflightMutex;
+    std::condition_variable inflightChanged;
+    size_t inflight;
+};
+
+struct Options {
+    std::string socketPath;
+    std::string scoreVerificationDir;
+    std::string scoreIdentificationDir;
+    std::string fuseDir;
+    std::string verifyDir;
+    std::string identifyDir;
+    std::string gallery;
+    size_t threads = 0;
+    size_t maxInflight = 64;
+    size_t maxPayloadBytes = 256 << 20;
+    size_t maxCandidates = 10000;
+    bool reentrant = false;
+};
+
+/* Call f on the service's implementation, serialized unless reentrant */
+template<typename Interface, typename F>
+ReturnStatus
+call(
+    Service<Interface> &service,
+    bool reentrant,
+    F f)
+{
+    if (!service.impl)
+        return (ReturnStatus(ReturnCode::NotImplemented,
+            "service not configured on this server"));
+    if (reentrant)
+        return (f(*service.impl));
+    std::lock_guard<std::mutex> lock(service.mutex);
+    return (f(*service.impl));
+}
+
+/* Decode a request, call the implementation and encode the response */
+ReturnStatus
+dispatch(
+    Services &services,
+    const FrameHeader &header,
+    const std::vector<uint8_t> &payload,
+    Encoder &out)
+{
+    const ReturnStatus parseError(ReturnCode::ParseError,
+        "malformed request payload");
+    Decoder in(payload.data(), payload.size());
+    uint32_t batch;
+
+    switch (static_cast<Opcode>(header.opcode)) {
+    case Opcode::FuseVerificationScores: {
+        if (!in.count(batch, 4))
+            return (parseError);
+        std::vector<ScoreSet> scores(batch);
+        for (auto &s : scores)
+            if (!in.values(s))
+                return (parseError);
+        if (!in.done())
+            return (parseError);
+        std::vector<double> fused;
+        const ReturnStatus rs = call(services.scoreVerification,
+            services.reentrant, [&](ScoreFuserInterface &impl) {
+                return (impl.fuseVerificationScoreBatch(scores, fused)); });
+        if (rs.code == ReturnCode::Success)
+            out.values(fused);
+        return (rs);
+    }
+    case Opcode::FuseCandidateLists: {
+        if (!in.count(batch, 4))
+            return (parseError);
+        std::vector<std::vector<CandidateList>> lists(batch);
+        for (auto &set : lists) {
+            uint32_t k;
+            if (!in.count(k, 4))
+                return (parseError);
+            set.resize(k);
+            for (auto &l : set)
+                if (!in.list(l))
+                    return (parseError);
+        }
+        if (!in.done())
+            return (parseError);
+        std::vector<CandidateList> fused;
+        const ReturnStatus rs = call(services.scoreIdentification,
+            services.reentrant, [&](ScoreFuserInterface &impl) {
+                return (impl.fuseCandidateListBatch(lists, fused)); });
+        if (rs.code == ReturnCode::Success) {
+            out.u32(static_cast<uint32_t>(fused.size()));
+            for (const auto &l : fused)
+                out.list(l);
+        }
+        return (rs);
+    }
+    case Opcode::FuseTemplates: {
+        if (!in.count(batch, 4))
+            return (parseError);
+        std::vector<std::vector<Template>> templates(batch);
+        for (auto &set : templates) {
+            uint32_t k;
+            if (!in.count(k, 4))
+                return (parseError);
+            set.resize(k);
+            for (auto &t : set)
+                if (!in.values(t))
+                    return (parseError);
+        }
+        if (!in.done())
+            return (parseError);
+        std::vector<Template> fused;
+        const ReturnStatus rs = call(services.templateFuse,
+            services.reentrant, [&](TemplateFuserInterface &impl) {
+                return (impl.fuseTemplateBatch(templates, fused)); });
+        if (rs.code == ReturnCode::Success) {
+            out.u32(static_cast<uint32_t>(fused.size()));
+            for (const auto &t : fused)
+                out.values(t);
+        }
+        return (rs);
+    }
+    case Opcode::Verify: {
+        if (!in.count(batch, 8))
+            return (parseError);
+        std::vector<Template> enroll(batch), authentication(batch);
+        for (uint32_t i = 0; i < batch; i++)
+            if (!in.values(enroll[i]) || !in.values(authentication[i]))
+                return (parseError);
+        if (!in.done())
+            return (parseError);
+        std::vector<double> scores;
+        const ReturnStatus rs = call(services.templateVerify,
+            services.reentrant, [&](TemplateFuserInterface &impl) {
+                return (impl.verifyBatch(enroll, authentication, scores)); });
+        if (rs.code == ReturnCode::Success)
+            out.values(scores);
+        return (rs);
+    }
+    case Opcode::Search: {
+        uint32_t length;
+        if (!in.count(batch, 4) || !in.u32(length))
+            return (parseError);
+        if (length > services.maxCandidates)
+            return (ReturnStatus(ReturnCode::NumDataError,
+                "candidate list longer than --max-candidates"));
+        /* Count, then per list a count and 12 bytes per candidate */
+        if (4 + static_cast<uint64_t>(batch) * (4 + 12 * uint64_t{length}) >
+            services.maxPayloadBytes)
+            return (ReturnStatus(ReturnCode::NumDataError,
+                "candidate lists too long for one response"));
+        std::vector<Template> probes(batch);
+        for (auto &p : probes)
+            if (!in.values(p))
+                return (parseError);
+        if (!in.done())
+            return (parseError);
+        std::vector<CandidateList> candidates(batch, CandidateList(length));
+        const ReturnStatus rs = call(services.templateIdentify,
+            services.reentrant, [&](TemplateFuserInterface &impl) {
+                return (impl.searchBatch(probes, candidates)); });
+        if (rs.code == ReturnCode::Success) {
+            out.u32(static_cast<uint32_t>(candidates.size()));
+            for (const auto &l : candidates)
+                out.list(l);
+        }
+        return (rs);
+    }
+    default:
+        return (ReturnStatus(ReturnCode::NotImplemented, "unknown opcode"));
+    }
+}
+
+void
+respond(
+    Services &services,
+    const std::shared_ptr<Connection> &conn,
+    const FrameHeader &header,
+    const std::vector<uint8_t> &payload)
+{
+    std::vector<uint8_t> frame;
+    {
+        Encoder out(frame, header.requestId,
+            static_cast<Opcode>(header.opcode));
+        const ReturnStatus rs = dispatch(services, header, payload, out);
+        if (rs.code != ReturnCode::Success) {
+            Encoder error(frame, header.requestId,
+                static_cast<Opcode>(header.opcode), rs.code);
+            error.string(rs.info);
+            error.finish();
+        } else {
+            out.finish();
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(conn->writeMutex);
+        Protocol::writeFrame(conn->fd, frame);
+    }
+    {
+        std::lock_guard<std::mutex> lock(conn->inflightMutex);
+        conn->inflight--;
+    }
+    conn->inflightChanged.notify_one();
+}
+
+class Server {
+public:
+    Server(
+        const Options &options,
+        Services &services) :
+        options(options),
+        services(services),
+        pool{options.threads},
+        readers{0}
+        {}
+
+    /* Read frames from one connection until it closes */
+    void
+    serve(
+        std::shared_ptr<Connection> conn)
+    {
+        FrameHeader header;
+        std::vector<uint8_t> payload;
+        while (Protocol::readFrame(conn->fd, this->options.maxPayloadBytes,
+            header, payload)) {
+            {
+                /* Bound the work queued per connection */
+                std::unique_lock<std::mutex> lock(conn->inflightMutex);
+                conn->inflightChanged.wait(lock, [&]() {
+                    return (conn->inflight < this->options.maxInflight); });
+                conn->inflight++;
+            }
+            auto request = std::make_shared<std::vector<uint8_t>>();
+            request->swap(payload);
+            Services &s = this->services;
+            this->pool.submit([&s, conn, header, request]() {
+                respond(s, conn, header, *request); });
+        }
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->open.erase(conn->fd);
+        if (--this->readers == 0)
+            this->idle.notify_all();
+    }
+
+    void
+    accepted(
+        int fd)
+    {
+        auto conn = std::make_shared<Connection>(fd);
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->open.insert(fd);
+            this->readers++;
+        }
+        std::thread(&Server::serve, this, conn).detach();
+    }
+
+    /* Close every connection, then drain outstanding requests */
+    void
+    shutdown()
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        for (const int fd : this->open)
+            ::shutdown(fd, SHUT_RDWR);
+        this->idle.wait(lock, [this]() { return (this->readers == 0); });
+        lock.unlock();
+        this->pool.stop();
+    }
+
+private:
+    const Options &options;
+    Services &services;
+    WorkerPool pool;
+    std::mutex mutex;
+    std::condition_variable idle;
+    std::set<int> open;
+    size_t readers;
+};
+
+void
+usage(
+    const char *argv0)
+{
+    std::cerr << "Usage: " << argv0 << " <socket> [options]\n"
+        "  --score-verification <dir>    ScoreFuserInterface, Type::Verification\n"
+        "  --score-identification <dir>  ScoreFuserInterface, Type::Identification\n"
+        "  --fuse <dir>                  TemplateFuserInterface, Action::Fuse\n"
+        "  --verify <dir>                TemplateFuserInterface, Action::Verify\n"
+        "  --identify <dir>              TemplateFuserInterface, Action::Identify\n"
+        "  --gallery <location>          gallery to attachGallery() for --identify\n"
+        "  --threads <n>                 worker threads (default: one per CPU)\n"
+        "  --max-inflight <n>            queued requests per connection (64)\n"
+        "  --max-frame <bytes>           largest request or response payload (256 MiB)\n"
+        "  --max-candidates <L>          longest candidate list per probe (10000)\n"
+        "  --reentrant                   implementations are thread-safe\n";
+}
+
+bool
+parseOptions(
+    int argc,
+    char *argv[],
+    Options &options)
+{
+    if (argc < 2 || argv[1][0] == '-')
+        return (false);
+    options.socketPath = argv[1];
+    for (int i = 2; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--reentrant") {
+            options.reentrant = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return (false);
+        const std::string value = argv[++i];
+        if (arg == "--score-verification")
+            options.scoreVerificationDir = value;
+        else if (arg == "--score-identification")
+            options.scoreIdentificationDir = value;
+        else if (arg == "--fuse")
+            options.fuseDir = value;
+        else if (arg == "--verify")
+            options.verifyDir = value;
+        else if (arg == "--identify")
+            options.identifyDir = value;
+        else if (arg == "--gallery")
+            options.gallery = value;
+        else if (arg == "--threads")
+            options.threads = std::stoul(value);
+        else if (arg == "--max-inflight")
+            options.maxInflight = std::max<size_t>(1, std::stoul(value));
+        else if (arg == "--max-frame")
+            options.maxPayloadBytes = std::stoul(value);
+        else if (arg == "--max-candidates")
+            options.maxCandidates = std::stoul(value);
+        else
+            return (false);
+    }
+    return (!options.identifyDir.empty() || options.gallery.empty());
+}
+
+bool
+check(
+    const std::string &what,
+    const ReturnStatus &rs)
+{
+    if (rs.code == ReturnCode::Success)
+        return (true);
+    std::cerr << what << ": " << rs.code;
+    if (!rs.info.empty())
+        std::cerr << " (" << rs.info << ")";
+    std::cerr << std::endl;
+    return (false);
+}
+
+bool
+startScoreFuser(
+    const std::string &dir,
+    ScoreFuserInterface::Type type,
+    Service<ScoreFuserInterface> &service)
+{
+    if (dir.empty())
+        return (true);
+    service.impl = ScoreFuserInterface::getImplementation();
+    return (check("initialize " + dir, service.impl->initialize(dir, type)));
+}
+
+bool
+startTemplateFuser(
+    const std::string &dir,
+    TemplateFuserInterface::Action action,
+    Service<TemplateFuserInterface> &service)
+{
+    if (dir.empty())
+        return (true);
+    service.impl = TemplateFuserInterface::getImplementation();
+    return (check("initialize " + dir, service.impl->initialize(dir, action)));
+}
+}
+
+int
+main(
+    int argc,
+    char *argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return (EXIT_FAILURE);
+    }
+
+    /*
+     * Block the shutdown signals before any thread starts, so that every
+     * thread inherits the mask and they are only ever taken from the
+     * signalfd polled with the listener, whichever thread the kernel
+     * would have picked.
+     */
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    Services services;
+    services.reentrant = options.reentrant;
+    services.maxCandidates = options.maxCandidates;
+    services.maxPayloadBytes = options.maxPayloadBytes;
+    if (!startScoreFuser(options.scoreVerificationDir,
+        ScoreFuserInterface::Type::Verification,
+        services.scoreVerification) ||
+        !startScoreFuser(options.scoreIdentificationDir,
+        ScoreFuserInterface::Type::Identification,
+        services.scoreIdentification) ||
+        !startTemplateFuser(options.fuseDir,
+        TemplateFuserInterface::Action::Fuse, services.templateFuse) ||
+        !startTemplateFuser(options.verifyDir,
+        TemplateFuserInterface::Action::Verify, services.templateVerify) ||
+        !startTemplateFuser(options.identifyDir,
+        TemplateFuserInterface::Action::Identify, services.templateIdentify))
+        return (EXIT_FAILURE);
+    if (!options.gallery.empty() && !check("attachGallery " + options.gallery,
+        services.templateIdentify.impl->attachGallery(options.gallery)))
+        return (EXIT_FAILURE);
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (options.socketPath.size() >= sizeof(addr.sun_path)) {
+        std::cerr << options.socketPath << ": socket path too long\n";
+        return (EXIT_FAILURE);
+    }
+    options.socketPath.copy(addr.sun_path, options.socketPath.size());
+
+    const int listener = socket(AF_UNIX,
+        SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    unlink(options.socketPath.c_str());
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr),
+        sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        std::perror(options.socketPath.c_str());
+        return (EXIT_FAILURE);
+    }
+
+    const int stop = signalfd(-1, &stopSignals, SFD_CLOEXEC);
+    if (stop < 0) {
+        std::perror("signalfd");
+        return (EXIT_FAILURE);
+    }
+
+    Server server(options, services);
+    for (;;) {
+        pollfd ready[2] = {{stop, POLLIN, 0}, {listener, POLLIN, 0}};
+        if (poll(ready, 2, -1) < 0) {
+            if (errno != EINTR) {
+                std::perror("poll");
+                break;
+            }
+            continue;
+        }
+        if (ready[0].revents != 0)
+            break;
+        if (ready[1].revents == 0)
+            continue;
+        /* The listener is non-blocking: a client may have gone already */
+        const int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0)
+            server.accepted(fd);
+        else if (errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINTR && errno != ECONNABORTED)
+            std::perror("accept");
+    }
+
+    close(stop);
+    close(listener);
+    unlink(options.socketPath.c_str());
+    server.shutdown();
+    return (EXIT_SUCCESS);
+}
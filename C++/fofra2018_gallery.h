@@ -0,0 +1,869 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_GALLERY_H_
+#define FOFRA2018_GALLERY_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fofra2018.h"
+#include "fofra2018_threads.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * One entry of the identity index of a gallery, which maps an identity
+ * label to the row of its template.  The index is sorted by identity.
+ */
+struct IdentityIndexEntry {
+    /** @brief Gallery identity label */
+    uint32_t identity;
+    /** @brief Row of the gallery matrix holding the template */
+    uint32_t row;
+};
+using IdentityIndexEntry = struct IdentityIndexEntry;
+
+/**
+ * @brief
+ * Read-only view of a flat gallery: an N x D row-major matrix of fused
+ * templates, the N identity labels and the identity index.
+ *
+ * @details
+ * A view holds raw pointers only.  Copying it, or searching through it,
+ * never writes to the memory it describes, so a view of a shared gallery
+ * can be used from any number of processes without duplicating pages.
+ */
+struct GalleryView {
+    /** @brief N x D row-major matrix of templates */
+    const double *matrix;
+    /** @brief N identity labels, ids[i] labels row i */
+    const uint32_t *ids;
+    /** @brief N index entries sorted by identity */
+    const IdentityIndexEntry *index;
+    /** @brief Number of templates, N */
+    size_t count;
+    /** @brief Dimension of each template, D */
+    size_t dimension;
+
+    GalleryView() :
+        matrix{nullptr},
+        ids{nullptr},
+        index{nullptr},
+        count{0},
+        dimension{0}
+        {}
+
+    /** @brief Return a pointer to the D values of the template in row. */
+    const double *
+    templateAt(
+        size_t row) const
+    {
+        return (this->matrix + row * this->dimension);
+    }
+
+    /**
+     * @brief
+     * Find the row holding the template of an identity.
+     *
+     * @param[in] identity
+     * Gallery identity label
+     * @param[out] row
+     * Row of the template, set only when the identity is enrolled
+     *
+     * @return
+     * true if the identity is enrolled, false otherwise
+     */
+    bool
+    findIdentity(
+        uint32_t identity,
+        size_t &row) const
+    {
+        const IdentityIndexEntry *end = this->index + this->count;
+        const IdentityIndexEntry *it = std::lower_bound(this->index, end,
+            identity, [](const IdentityIndexEntry &e, uint32_t id) {
+                return (e.identity < id); });
+        if (it == end || it->identity != identity)
+            return (false);
+        row = it->row;
+        return (true);
+    }
+};
+using GalleryView = struct GalleryView;
+
+/**
+ * @brief
+ * Fixed-size header at the start of a flat gallery image.
+ *
+ * @details
+ * The image is laid out as the header, the N identity labels, the N
+ * identity index entries and, aligned to 64 bytes, the N x D matrix.
+ * All offsets are in bytes from the start of the image.
+ */
+struct GalleryHeader {
+    /** @brief Always GalleryHeader::Magic */
+    char magic[8];
+    /** @brief Always GalleryHeader::Version */
+    uint32_t version;
+    /** @brief sizeof(GalleryHeader) */
+    uint32_t headerBytes;
+    /** @brief Number of templates, N */
+    uint64_t count;
+    /** @brief Dimension of each template, D */
+    uint64_t dimension;
+    /** @brief Offset of the identity labels */
+    uint64_t idsOffset;
+    /** @brief Offset of the identity index */
+    uint64_t indexOffset;
+    /** @brief Offset of the template matrix */
+    uint64_t matrixOffset;
+    /** @brief Size of the whole image */
+    uint64_t totalBytes;
+
+    static constexpr const char *Magic = "FOFRAGAL";
+    static constexpr uint32_t Version = 1;
+};
+using GalleryHeader = struct GalleryHeader;
+static_assert(sizeof(GalleryHeader) == 64, "GalleryHeader must be 64 bytes");
+
+/**
+ * @brief
+ * A flat gallery image held in memory mapped pages, either private to
+ * this process or shared with others through a file.
+ *
+ * @details
+ * A builder process calls build() from createGallery() and publish() from
+ * exportGallery().  Worker processes call attach() from attachGallery(),
+ * which maps the published image read-only; every worker then shares the
+ * same physical pages.  The location may be any file path; a path under
+ * /dev/shm keeps the image in POSIX shared memory.
+ */
+class MappedGallery {
+public:
+    MappedGallery() :
+        base{nullptr},
+        length{0},
+        gallery{},
+        shared{false}
+        {}
+
+    ~MappedGallery()
+    {
+        this->release();
+    }
+
+    MappedGallery(const MappedGallery&) = delete;
+    MappedGallery &operator=(const MappedGallery&) = delete;
+
+    MappedGallery(
+        MappedGallery &&other) :
+        base{other.base},
+        length{other.length},
+        gallery{other.gallery},
+        shared{other.shared},
+        phases(std::move(other.phases))
+    {
+        other.base = nullptr;
+        other.length = 0;
+        other.gallery = GalleryView();
+        other.shared = false;
+    }
+
+    MappedGallery &
+    operator=(
+        MappedGallery &&other)
+    {
+        if (this != &other) {
+            this->release();
+            std::swap(this->base, other.base);
+            std::swap(this->length, other.length);
+            std::swap(this->gallery, other.gallery);
+            std::swap(this->shared, other.shared);
+            std::swap(this->phases, other.phases);
+        }
+        return (*this);
+    }
+
+    /**
+     * @brief
+     * Lay out a gallery image in private memory from N templates and
+     * their N identity labels, replacing any current gallery.
+     *
+     * @param[in] templates
+     * N fused templates, all of the same dimension
+     * @param[in] ids
+     * N identity labels, ids[i] corresponds to templates[i]
+     */
+    ReturnStatus
+    build(
+        const std::vector<Template> &templates,
+        const std::vector<uint32_t> &ids)
+    {
+        if (templates.size() != ids.size())
+            return (ReturnStatus(ReturnCode::NonCongruentVectors,
+                "templates and ids differ in length"));
+        if (templates.size() > UINT32_MAX)
+            return (ReturnStatus(ReturnCode::NumDataError));
+
+        const size_t dimension = templates.empty() ? 0 :
+            templates.front().size();
+        for (const auto &t : templates)
+            if (t.size() != dimension)
+                return (ReturnStatus(ReturnCode::NonCongruentVectors,
+                    "templates differ in dimension"));
+
+        std::vector<GalleryStats::Phase> timing;
+        auto start = std::chrono::steady_clock::now();
+        GalleryHeader header;
+        layout(templates.size(), dimension, header);
+
+        void *image = mmap(nullptr, header.totalBytes,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (image == MAP_FAILED)
+            return (ReturnStatus(ReturnCode::MemoryError,
+                std::strerror(errno)));
+
+        lap("allocate", start, timing);
+        uint8_t *bytes = static_cast<uint8_t*>(image);
+        std::memcpy(bytes, &header, sizeof(header));
+
+        uint32_t *imageIds = reinterpret_cast<uint32_t*>(
+            bytes + header.idsOffset);
+        IdentityIndexEntry *imageIndex =
+            reinterpret_cast<IdentityIndexEntry*>(bytes + header.indexOffset);
+        double *imageMatrix = reinterpret_cast<double*>(
+            bytes + header.matrixOffset);
+        for (size_t i = 0; i < templates.size(); i++) {
+            imageIds[i] = ids[i];
+            imageIndex[i].identity = ids[i];
+            imageIndex[i].row = static_cast<uint32_t>(i);
+            std::copy(templates[i].begin(), templates[i].end(),
+                imageMatrix + i * dimension);
+        }
+        lap("copy", start, timing);
+        std::stable_sort(imageIndex, imageIndex + templates.size(),
+            [](const IdentityIndexEntry &a, const IdentityIndexEntry &b) {
+                return (a.identity < b.identity); });
+        lap("index", start, timing);
+
+        this->release();
+        this->base = image;
+        this->length = header.totalBytes;
+        this->phases = std::move(timing);
+        return (view(this->base, this->length, this->gallery));
+    }
+
+    /**
+     * @brief
+     * Write the current gallery image to a file so that other processes
+     * can attach() to it.
+     *
+     * @details
+     * The image is written to a temporary file beside the location,
+     * synced and renamed into place, so the location never holds a
+     * partial image, even after a crash.
+     *
+     * @param[in] location
+     * Path of the shared gallery
+     */
+    ReturnStatus
+    publish(
+        const std::string &location) const
+    {
+        if (this->base == nullptr)
+            return (ReturnStatus(ReturnCode::VendorError,
+                "no gallery to publish"));
+
+        std::vector<char> name(location.begin(), location.end());
+        const char suffix[] = ".XXXXXX";
+        name.insert(name.end(), suffix, suffix + sizeof(suffix));
+        const int fd = mkstemp(name.data());
+        if (fd < 0)
+            return (ReturnStatus(ReturnCode::InputLocationError,
+                location + ": " + std::strerror(errno)));
+
+        const uint8_t *bytes = static_cast<const uint8_t*>(this->base);
+        size_t written = 0;
+        while (written < this->length) {
+            const ssize_t rv = write(fd, bytes + written,
+                this->length - written);
+            if (rv < 0 && errno == EINTR)
+                continue;
+            if (rv <= 0)
+                break;
+            written += static_cast<size_t>(rv);
+        }
+        bool ok = (written == this->length) && (fchmod(fd, 0644) == 0) &&
+            (fsync(fd) == 0);
+        std::string reason = ok ? "" : std::strerror(errno);
+        if (close(fd) != 0 && ok) {
+            ok = false;
+            reason = std::strerror(errno);
+        }
+        if (ok && rename(name.data(), location.c_str()) != 0) {
+            ok = false;
+            reason = std::strerror(errno);
+        }
+        if (!ok) {
+            unlink(name.data());
+            return (ReturnStatus(ReturnCode::VendorError,
+                location + ": " + reason));
+        }
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /**
+     * @brief
+     * Map a published gallery read-only, replacing any current gallery.
+     *
+     * @param[in] location
+     * Path of the shared gallery, as passed to publish()
+     */
+    ReturnStatus
+    attach(
+        const std::string &location)
+    {
+        auto start = std::chrono::steady_clock::now();
+        const int fd = open(location.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return (ReturnStatus(ReturnCode::InputLocationError,
+                location + ": " + std::strerror(errno)));
+        struct stat st;
+        if (fstat(fd, &st) != 0 ||
+            static_cast<size_t>(st.st_size) < sizeof(GalleryHeader)) {
+            close(fd);
+            return (ReturnStatus(ReturnCode::TemplateFormatError,
+                location + ": not a gallery image"));
+        }
+
+        const size_t size = static_cast<size_t>(st.st_size);
+        void *image = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (image == MAP_FAILED)
+            return (ReturnStatus(ReturnCode::MemoryError,
+                std::strerror(errno)));
+
+        GalleryView attached;
+        const ReturnStatus rs = view(image, size, attached);
+        if (rs.code != ReturnCode::Success) {
+            munmap(image, size);
+            return (rs);
+        }
+
+        this->release();
+        this->base = image;
+        this->length = size;
+        this->gallery = attached;
+        this->shared = true;
+        lap("attach", start, this->phases);
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /** @brief Unmap the current gallery, if any. */
+    void
+    release()
+    {
+        if (this->base != nullptr)
+            munmap(this->base, this->length);
+        this->base = nullptr;
+        this->length = 0;
+        this->gallery = GalleryView();
+        this->shared = false;
+        this->phases.clear();
+    }
+
+    /** @brief Return a view of the current gallery. */
+    const GalleryView &
+    view() const
+    {
+        return (this->gallery);
+    }
+
+    /** @brief Return the size in bytes of the current gallery image. */
+    size_t
+    bytes() const
+    {
+        return (this->length);
+    }
+
+    /**
+     * @brief
+     * Report the current gallery's memory by structure, as in
+     * TemplateFuserInterface::galleryStats().
+     *
+     * @details
+     * Build time is reported for the build() or attach() that produced
+     * the gallery.  Finding resident pages costs one mincore() call per
+     * structure; counting identities is a pass over the sorted index.
+     */
+    ReturnStatus
+    stats(
+        GalleryStats &out) const
+    {
+        out = GalleryStats();
+        if (this->base == nullptr)
+            return (ReturnStatus(ReturnCode::VendorError, "no gallery"));
+
+        const GalleryView &g = this->gallery;
+        out.entries = g.count;
+        out.dimension = g.dimension;
+        for (size_t i = 0; i < g.count; i++)
+            if (i == 0 || g.index[i].identity != g.index[i - 1].identity)
+                out.identities++;
+        out.bytesPerTemplate = g.count == 0 ? 0.0 :
+            static_cast<double>(this->length) / static_cast<double>(g.count);
+
+        const uint8_t *image = static_cast<const uint8_t*>(this->base);
+        const uint8_t *ids = reinterpret_cast<const uint8_t*>(g.ids);
+        const uint8_t *index = reinterpret_cast<const uint8_t*>(g.index);
+        const uint8_t *matrix = reinterpret_cast<const uint8_t*>(g.matrix);
+        const struct {
+            const char *name;
+            const uint8_t *begin;
+            const uint8_t *end;
+        } regions[] = {
+            {"header", image, ids},
+            {"ids", ids, index},
+            {"index", index, matrix},
+            {"matrix", matrix, image + this->length}
+        };
+        for (const auto &r : regions) {
+            GalleryStats::Region region;
+            region.name = r.name;
+            region.mappedBytes = static_cast<uint64_t>(r.end - r.begin);
+            const ReturnStatus rs = residentBytes(r.begin,
+                static_cast<size_t>(r.end - r.begin),
+                region.residentBytes);
+            if (rs.code != ReturnCode::Success)
+                return (rs);
+            /* Pages straddling two structures count in both, up to size */
+            region.residentBytes = std::min(region.residentBytes,
+                region.mappedBytes);
+            out.regions.push_back(region);
+        }
+        out.buildPhases = this->phases;
+
+        out.indexParameters.push_back({"layout", "flat row-major"});
+        out.indexParameters.push_back({"identity index", "sorted"});
+        out.indexParameters.push_back({"matrix alignment", "64"});
+        out.indexParameters.push_back({"mapping",
+            this->shared ? "shared read-only" : "private"});
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+private:
+    /* Record the time since start as a phase and restart the clock */
+    static void
+    lap(
+        const char *name,
+        std::chrono::steady_clock::time_point &start,
+        std::vector<GalleryStats::Phase> &timing)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        GalleryStats::Phase phase;
+        phase.name = name;
+        phase.seconds = std::chrono::duration<double>(now - start).count();
+        timing.push_back(phase);
+        start = now;
+    }
+
+    static uint64_t
+    alignUp(
+        uint64_t offset,
+        uint64_t alignment)
+    {
+        return ((offset + alignment - 1) / alignment * alignment);
+    }
+
+    static void
+    layout(
+        size_t count,
+        size_t dimension,
+        GalleryHeader &header)
+    {
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, GalleryHeader::Magic, sizeof(header.magic));
+        header.version = GalleryHeader::Version;
+        header.headerBytes = sizeof(GalleryHeader);
+        header.count = count;
+        header.dimension = dimension;
+        header.idsOffset = sizeof(GalleryHeader);
+        header.indexOffset = alignUp(header.idsOffset +
+            count * sizeof(uint32_t), alignof(IdentityIndexEntry));
+        header.matrixOffset = alignUp(header.indexOffset +
+            count * sizeof(IdentityIndexEntry), 64);
+        header.totalBytes = header.matrixOffset +
+            count * dimension * sizeof(double);
+    }
+
+    /* Check the header of an image and point a view into it */
+    static ReturnStatus
+    view(
+        const void *image,
+        size_t size,
+        GalleryView &out)
+    {
+        GalleryHeader header;
+        std::memcpy(&header, image, sizeof(header));
+
+        GalleryHeader expected;
+        layout(header.count, header.dimension, expected);
+        if (std::memcmp(header.magic, GalleryHeader::Magic,
+            sizeof(header.magic)) != 0 ||
+            header.version != GalleryHeader::Version ||
+            header.count > UINT32_MAX ||
+            (header.dimension != 0 &&
+            header.count > SIZE_MAX / sizeof(double) / header.dimension) ||
+            std::memcmp(&header, &expected, sizeof(header)) != 0 ||
+            header.totalBytes != size)
+            return (ReturnStatus(ReturnCode::TemplateFormatError,
+                "gallery image header is defective"));
+
+        const uint8_t *bytes = static_cast<const uint8_t*>(image);
+        out.ids = reinterpret_cast<const uint32_t*>(bytes + header.idsOffset);
+        out.index = reinterpret_cast<const IdentityIndexEntry*>(
+            bytes + header.indexOffset);
+        out.matrix = reinterpret_cast<const double*>(
+            bytes + header.matrixOffset);
+        out.count = static_cast<size_t>(header.count);
+        out.dimension = static_cast<size_t>(header.dimension);
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    void *base;
+    size_t length;
+    GalleryView gallery;
+    bool shared;
+    std::vector<GalleryStats::Phase> phases;
+};
+
+/**
+ * @brief
+ * Reference comparator, as in R/fusion_example_template_level.R: the L1
+ * distance between two templates mapped to a non-negative similarity.
+ */
+inline double
+l1Similarity(
+    const double *a,
+    const double *b,
+    size_t dimension)
+{
+    double distance = 0.0;
+    for (size_t i = 0; i < dimension; i++)
+        distance += std::fabs(a[i] - b[i]);
+    return (100.0 / (1.0 + distance));
+}
+
+/**
+ * @brief
+ * Bounded selection of the highest scoring gallery rows.
+ *
+ * @details
+ * Ties are broken in favour of the lower row so results are repeatable.
+ */
+class TopCandidates {
+public:
+    /** @brief A scored gallery row */
+    struct Entry {
+        double score;
+        uint32_t row;
+    };
+
+    explicit TopCandidates(
+        size_t capacity) :
+        capacity{capacity}
+    {
+        this->heap.reserve(capacity);
+    }
+
+    /** @brief Consider one scored row for the selection. */
+    void
+    offer(
+        double score,
+        uint32_t row)
+    {
+        if (this->capacity == 0)
+            return;
+        const Entry e{score, row};
+        if (this->heap.size() < this->capacity) {
+            this->heap.push_back(e);
+            std::push_heap(this->heap.begin(), this->heap.end(), better);
+        } else if (better(e, this->heap.front())) {
+            std::pop_heap(this->heap.begin(), this->heap.end(), better);
+            this->heap.back() = e;
+            std::push_heap(this->heap.begin(), this->heap.end(), better);
+        }
+    }
+
+    /**
+     * @brief
+     * Return the score a row must exceed to be selected over every row
+     * offered so far (a later row cannot win a tie); -infinity until the
+     * selection is full.
+     */
+    double
+    floor() const
+    {
+        if (this->capacity == 0)
+            return (std::numeric_limits<double>::infinity());
+        return (this->heap.size() < this->capacity ?
+            -std::numeric_limits<double>::infinity() :
+            this->heap.front().score);
+    }
+
+    /** @brief Move the selection out, best first, and reset. */
+    void
+    drain(
+        std::vector<Entry> &entries)
+    {
+        std::sort_heap(this->heap.begin(), this->heap.end(), better);
+        entries.swap(this->heap);
+        this->heap.clear();
+    }
+
+    /** @brief Strict ordering: a ranks ahead of b. */
+    static bool
+    better(
+        const Entry &a,
+        const Entry &b)
+    {
+        return (a.score > b.score || (a.score == b.score && a.row < b.row));
+    }
+
+private:
+    size_t capacity;
+    std::vector<Entry> heap;
+};
+
+/**
+ * @brief
+ * Fill a pre-allocated candidate list, best first, from a selection of
+ * gallery rows; candidates beyond the selection are left empty.
+ */
+inline void
+fillCandidates(
+    const GalleryView &gallery,
+    TopCandidates &top,
+    CandidateList &candidates)
+{
+    std::vector<TopCandidates::Entry> best;
+    top.drain(best);
+    for (size_t i = 0; i < candidates.size(); i++)
+        candidates[i] = (i < best.size()) ?
+            Candidate(gallery.ids[best[i].row], best[i].score) : Candidate();
+}
+
+/**
+ * @brief
+ * Reference exhaustive search of a probe against a gallery with
+ * l1Similarity().  The number of candidates to populate is
+ * candidates.size(); candidates beyond the gallery size are left empty.
+ *
+ * @param[in] gallery
+ * Gallery to search
+ * @param[in] probe
+ * Probe template of the gallery's dimension
+ * @param[out] candidates
+ * Pre-allocated candidate list, filled best first
+ */
+inline ReturnStatus
+searchGallery(
+    const GalleryView &gallery,
+    const Template &probe,
+    CandidateList &candidates)
+{
+    if (probe.size() != gallery.dimension)
+        return (ReturnStatus(ReturnCode::NonCongruentVectors,
+            "probe and gallery differ in dimension"));
+
+    TopCandidates top(std::min(candidates.size(), gallery.count));
+    for (size_t row = 0; row < gallery.count; row++)
+        top.offer(l1Similarity(probe.data(), gallery.templateAt(row),
+            gallery.dimension), static_cast<uint32_t>(row));
+    fillCandidates(gallery, top, candidates);
+    return (ReturnStatus(ReturnCode::Success));
+}
+
+/**
+ * @brief
+ * Reference multi-probe search: one pass over the gallery that scores
+ * every probe against each block of gallery rows with l1Similarity() and
+ * aggregates each row's P scores.
+ *
+ * @details
+ * Blocks are sized to stay in the L1 cache while all P probes are compared
+ * with them, so the gallery is streamed from memory once rather than P
+ * times.  For ProbeAggregation::Learned, the row's P scores are sorted in
+ * decreasing order and combined with the P weights, an ordered weighted
+ * average whose weights a developer would fit offline.
+ *
+ * @param[in] gallery
+ * Gallery to search
+ * @param[in] probes
+ * P ≥ 1 probe templates of the gallery's dimension
+ * @param[in] aggregation
+ * How to combine each row's P scores
+ * @param[in] weights
+ * P weights for ProbeAggregation::Learned, otherwise ignored
+ * @param[out] candidates
+ * Pre-allocated candidate list, filled best first
+ */
+inline ReturnStatus
+searchGalleryMultiProbe(
+    const GalleryView &gallery,
+    const std::vector<Template> &probes,
+    TemplateFuserInterface::ProbeAggregation aggregation,
+    const std::vector<double> &weights,
+    CandidateList &candidates)
+{
+    using Aggregation = TemplateFuserInterface::ProbeAggregation;
+    const size_t P = probes.size();
+    if (P == 0)
+        return (ReturnStatus(ReturnCode::NumDataError, "no probes"));
+    for (const auto &p : probes)
+        if (p.size() != gallery.dimension)
+            return (ReturnStatus(ReturnCode::NonCongruentVectors,
+                "probe and gallery differ in dimension"));
+    if (aggregation == Aggregation::Learned && weights.size() != P)
+        return (ReturnStatus(ReturnCode::NonCongruentVectors,
+            "need one weight per probe"));
+
+    const size_t blockRows = std::max<size_t>(1,
+        32768 / (sizeof(double) * std::max<size_t>(1, gallery.dimension)));
+    std::vector<double> scores(P * blockRows);
+    std::vector<double> sorted(P);
+    TopCandidates top(std::min(candidates.size(), gallery.count));
+
+    for (size_t first = 0; first < gallery.count; first += blockRows) {
+        const size_t rows = std::min(blockRows, gallery.count - first);
+        for (size_t p = 0; p < P; p++)
+            for (size_t r = 0; r < rows; r++)
+                scores[p * blockRows + r] = l1Similarity(probes[p].data(),
+                    gallery.templateAt(first + r), gallery.dimension);
+
+        for (size_t r = 0; r < rows; r++) {
+            double aggregate = 0.0;
+            switch (aggregation) {
+            case Aggregation::Max:
+                aggregate = scores[r];
+                for (size_t p = 1; p < P; p++)
+                    aggregate = std::max(aggregate, scores[p * blockRows + r]);
+                break;
+            case Aggregation::Mean:
+                for (size_t p = 0; p < P; p++)
+                    aggregate += scores[p * blockRows + r];
+                aggregate /= static_cast<double>(P);
+                break;
+            case Aggregation::Learned:
+                for (size_t p = 0; p < P; p++)
+                    sorted[p] = scores[p * blockRows + r];
+                std::sort(sorted.begin(), sorted.end(),
+                    [](double a, double b) { return (a > b); });
+                for (size_t p = 0; p < P; p++)
+                    aggregate += weights[p] * sorted[p];
+                break;
+            }
+            top.offer(aggregate, static_cast<uint32_t>(first + r));
+        }
+    }
+    fillCandidates(gallery, top, candidates);
+    return (ReturnStatus(ReturnCode::Success));
+}
+
+/**
+ * @brief
+ * Reference shortlist re-ranking: re-score B shortlists against their
+ * probes' gallery templates with a full comparator, in parallel.
+ *
+ * @details
+ * Every (probe, candidate) pair of the batch is scored as one parallel
+ * loop, so a single long shortlist is spread over the pool as well as
+ * many short ones.  Each shortlist is then re-sorted in decreasing order
+ * of score; candidates not in the gallery are removed.
+ *
+ * @param[in] gallery
+ * Gallery holding the candidates' templates
+ * @param[in] probes
+ * B probe templates of the gallery's dimension
+ * @param[in,out] shortlists
+ * B shortlists, shortlists[i] for probes[i]
+ * @param[in] compare
+ * Comparator with the signature of l1Similarity(), e.g. the verify metric
+ * @param[in] pool
+ * Threads to score on
+ */
+template<typename Comparator>
+inline ReturnStatus
+rerankCandidates(
+    const GalleryView &gallery,
+    const std::vector<Template> &probes,
+    std::vector<CandidateList> &shortlists,
+    Comparator compare,
+    WorkerPool &pool)
+{
+    if (probes.size() != shortlists.size())
+        return (ReturnStatus(ReturnCode::NonCongruentVectors,
+            "need one shortlist per probe"));
+    for (const auto &p : probes)
+        if (p.size() != gallery.dimension)
+            return (ReturnStatus(ReturnCode::NonCongruentVectors,
+                "probe and gallery differ in dimension"));
+
+    /* Start of each shortlist in the flattened batch of pairs */
+    std::vector<size_t> offsets(shortlists.size() + 1, 0);
+    for (size_t i = 0; i < shortlists.size(); i++)
+        offsets[i + 1] = offsets[i] + shortlists[i].size();
+
+    const double missing = std::numeric_limits<double>::quiet_NaN();
+    pool.parallelFor(offsets.back(), 64, [&](size_t begin, size_t end) {
+        size_t list = static_cast<size_t>(std::upper_bound(offsets.begin(),
+            offsets.end(), begin) - offsets.begin()) - 1;
+        for (size_t k = begin; k < end; k++) {
+            while (k >= offsets[list + 1])
+                list++;
+            Candidate &c = shortlists[list][k - offsets[list]];
+            size_t row;
+            c.score = gallery.findIdentity(c.identity, row) ?
+                compare(probes[list].data(), gallery.templateAt(row),
+                gallery.dimension) : missing;
+        }
+    });
+
+    pool.parallelFor(shortlists.size(), 16, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            CandidateList &l = shortlists[i];
+            l.erase(std::remove_if(l.begin(), l.end(),
+                [](const Candidate &c) { return (std::isnan(c.score)); }),
+                l.end());
+            std::stable_sort(l.begin(), l.end(),
+                [](const Candidate &a, const Candidate &b) {
+                    return (a.score > b.score); });
+        }
+    });
+    return (ReturnStatus(ReturnCode::Success));
+}
+}
+
+#endif /* FOFRA2018_GALLERY_H_ */
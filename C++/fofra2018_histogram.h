@@ -0,0 +1,321 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_HISTOGRAM_H_
+#define FOFRA2018_HISTOGRAM_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <limits>
+#include <ostream>
+#include <vector>
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * Histogram of non-negative integer values (e.g. latencies in
+ * nanoseconds) with a fixed relative precision over a wide range, after
+ * the layout of Gil Tene's HdrHistogram.
+ *
+ * @details
+ * Values are counted in buckets that double in width; each bucket has
+ * enough sub-buckets that any value is reported to within
+ * significantDigits decimal digits.  Recording is a few shifts and an
+ * increment, and the memory is fixed at construction (about 260 KiB for
+ * 3 digits over 1 ns to 1 hour), so each thread can record into its own
+ * histogram and the histograms merged afterwards with add().  Values
+ * above the highest trackable value are counted as that value.
+ */
+class LatencyHistogram {
+public:
+    /**
+     * @param[in] highest
+     * Highest value to distinguish, e.g. 3600e9 for an hour in ns
+     * @param[in] significantDigits
+     * Decimal digits of precision, 1 to 5
+     */
+    explicit LatencyHistogram(
+        int64_t highest = int64_t(3600) * 1000000000,
+        int significantDigits = 3) :
+        highest{std::max<int64_t>(highest, 2)},
+        total{0},
+        minimum{std::numeric_limits<int64_t>::max()},
+        maximum{0},
+        sum{0.0}
+    {
+        significantDigits = std::min(5, std::max(1, significantDigits));
+        int64_t largestSingleUnit = 2;
+        for (int i = 0; i < significantDigits; i++)
+            largestSingleUnit *= 10;
+        this->halfMagnitude = LatencyHistogram::magnitude(
+            largestSingleUnit - 1);
+        this->subBuckets = int64_t(1) << (this->halfMagnitude + 1);
+        this->mask = this->subBuckets - 1;
+
+        int buckets = 1;
+        for (int64_t smallestUntracked = this->subBuckets;
+            smallestUntracked <= this->highest; buckets++) {
+            if (smallestUntracked > std::numeric_limits<int64_t>::max() / 2)
+                break;
+            smallestUntracked <<= 1;
+        }
+        this->counts.assign(static_cast<size_t>(buckets + 1) *
+            static_cast<size_t>(this->subBuckets / 2), 0);
+    }
+
+    /** @brief Count one value; negative values count as 0. */
+    void
+    record(
+        int64_t value,
+        uint64_t count = 1)
+    {
+        value = std::min(std::max<int64_t>(value, 0), this->highest);
+        this->counts[this->indexOf(value)] += count;
+        this->total += count;
+        this->minimum = std::min(this->minimum, value);
+        this->maximum = std::max(this->maximum, value);
+        this->sum += static_cast<double>(value) * static_cast<double>(count);
+    }
+
+    /** @brief Add the counts of a histogram of the same range. */
+    void
+    add(
+        const LatencyHistogram &other)
+    {
+        if (other.counts.size() != this->counts.size() ||
+            other.subBuckets != this->subBuckets) {
+            /* Different layout; re-record at each bucket's value */
+            for (size_t i = 0; i < other.counts.size(); i++)
+                if (other.counts[i] != 0)
+                    this->record(other.valueAt(i), other.counts[i]);
+            return;
+        }
+        for (size_t i = 0; i < this->counts.size(); i++)
+            this->counts[i] += other.counts[i];
+        this->total += other.total;
+        this->minimum = std::min(this->minimum, other.minimum);
+        this->maximum = std::max(this->maximum, other.maximum);
+        this->sum += other.sum;
+    }
+
+    /** @brief Forget every value. */
+    void
+    reset()
+    {
+        std::fill(this->counts.begin(), this->counts.end(), 0);
+        this->total = 0;
+        this->minimum = std::numeric_limits<int64_t>::max();
+        this->maximum = 0;
+        this->sum = 0.0;
+    }
+
+    /** @brief Return the number of values recorded. */
+    uint64_t
+    count() const
+    {
+        return (this->total);
+    }
+
+    int64_t
+    min() const
+    {
+        return (this->total == 0 ? 0 : this->minimum);
+    }
+
+    int64_t
+    max() const
+    {
+        return (this->maximum);
+    }
+
+    double
+    mean() const
+    {
+        return (this->total == 0 ? 0.0 :
+            this->sum / static_cast<double>(this->total));
+    }
+
+    /**
+     * @brief
+     * Return the value at a percentile: the highest value equivalent to
+     * the smallest recorded value with at least that percentage of the
+     * values at or below it.
+     *
+     * @param[in] percentile
+     * 0 to 100
+     */
+    int64_t
+    valueAtPercentile(
+        double percentile) const
+    {
+        if (this->total == 0)
+            return (0);
+        if (percentile <= 0.0)
+            return (this->min());
+        const double wanted = std::min(percentile, 100.0) / 100.0 *
+            static_cast<double>(this->total);
+        const uint64_t target = std::max<uint64_t>(1,
+            static_cast<uint64_t>(std::ceil(wanted - 1e-9)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < this->counts.size(); i++) {
+            seen += this->counts[i];
+            if (seen >= target)
+                return (std::min(this->maximum,
+                    this->highestEquivalent(this->valueAt(i))));
+        }
+        return (this->maximum);
+    }
+
+    /**
+     * @brief
+     * Write the percentile distribution in the text format of
+     * HdrHistogram's outputPercentileDistribution(), which its plotting
+     * tools read.
+     *
+     * @param[in] out
+     * Stream to write to
+     * @param[in] scale
+     * Divisor of the values written, e.g. 1e6 for ns recorded and ms shown
+     * @param[in] ticksPerHalfDistance
+     * Percentiles reported per halving of the distance to 100%
+     */
+    void
+    writePercentiles(
+        std::ostream &out,
+        double scale = 1.0,
+        int ticksPerHalfDistance = 5) const
+    {
+        out << std::setw(12) << "Value" << " " << std::setw(14) <<
+            "Percentile" << " " << std::setw(10) << "TotalCount" << " " <<
+            std::setw(14) << "1/(1-Percentile)" << "\n\n";
+        out << std::fixed;
+        uint64_t seen = 0;
+        double next = 0.0;
+        for (size_t i = 0; i < this->counts.size() && seen < this->total;
+            i++) {
+            if (this->counts[i] == 0)
+                continue;
+            seen += this->counts[i];
+            const double reached = 100.0 * static_cast<double>(seen) /
+                static_cast<double>(this->total);
+            if (reached < next && seen < this->total)
+                continue;
+            const double value = static_cast<double>(std::min(
+                this->maximum, this->highestEquivalent(this->valueAt(i))));
+            out << std::setw(12) << std::setprecision(3) << value / scale <<
+                " " << std::setw(14) << std::setprecision(12) <<
+                reached / 100.0 << " " << std::setw(10) << seen;
+            if (seen < this->total)
+                out << " " << std::setw(14) << std::setprecision(2) <<
+                    1.0 / (1.0 - reached / 100.0);
+            out << "\n";
+
+            /* Ticks get finer as the percentile approaches 100 */
+            while (next <= reached) {
+                const double half = std::pow(2.0, std::floor(
+                    std::log2(100.0 / (100.0 - std::min(next, 99.9999999)))));
+                next += 100.0 / (half * 2.0 * ticksPerHalfDistance);
+            }
+        }
+        out << std::setprecision(3) << "#[Mean    = " << std::setw(12) <<
+            this->mean() / scale << ", StdDeviation   = " << std::setw(12) <<
+            this->deviation() / scale << "]\n" << "#[Max     = " <<
+            std::setw(12) << static_cast<double>(this->max()) / scale <<
+            ", Total count    = " << std::setw(12) << this->total << "]\n";
+        out << std::defaultfloat;
+    }
+
+private:
+    /* floor(log2(v)) for v > 0 */
+    static int
+    magnitude(
+        int64_t v)
+    {
+        int m = 0;
+        for (int shift = 32; shift > 0; shift >>= 1)
+            if ((v >> shift) != 0) {
+                v >>= shift;
+                m += shift;
+            }
+        return (m);
+    }
+
+    size_t
+    indexOf(
+        int64_t value) const
+    {
+        const int bucket = LatencyHistogram::magnitude(value | this->mask) -
+            this->halfMagnitude;
+        const int64_t sub = value >> bucket;
+        return (static_cast<size_t>(((int64_t(bucket) + 1) <<
+            this->halfMagnitude) + (sub - this->subBuckets / 2)));
+    }
+
+    /* Lowest value counted at an index */
+    int64_t
+    valueAt(
+        size_t index) const
+    {
+        int bucket = static_cast<int>(index >> this->halfMagnitude) - 1;
+        int64_t sub = static_cast<int64_t>(index &
+            static_cast<size_t>(this->subBuckets / 2 - 1)) +
+            this->subBuckets / 2;
+        if (bucket < 0) {
+            sub -= this->subBuckets / 2;
+            bucket = 0;
+        }
+        return (sub << bucket);
+    }
+
+    /* Highest value counted with a value */
+    int64_t
+    highestEquivalent(
+        int64_t value) const
+    {
+        const int bucket = LatencyHistogram::magnitude(value | this->mask) -
+            this->halfMagnitude;
+        const int64_t width = int64_t(1) << bucket;
+        return ((value & ~(width - 1)) + width - 1);
+    }
+
+    double
+    deviation() const
+    {
+        if (this->total == 0)
+            return (0.0);
+        const double m = this->mean();
+        double squares = 0.0;
+        for (size_t i = 0; i < this->counts.size(); i++)
+            if (this->counts[i] != 0) {
+                const int64_t low = this->valueAt(i);
+                const double mid = static_cast<double>(low) + 0.5 *
+                    static_cast<double>(this->highestEquivalent(low) - low);
+                squares += static_cast<double>(this->counts[i]) *
+                    (mid - m) * (mid - m);
+            }
+        return (std::sqrt(squares / static_cast<double>(this->total)));
+    }
+
+    int64_t highest;
+    int halfMagnitude;
+    int64_t subBuckets;
+    int64_t mask;
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    int64_t minimum;
+    int64_t maximum;
+    double sum;
+};
+}
+
+#endif /* FOFRA2018_HISTOGRAM_H_ */
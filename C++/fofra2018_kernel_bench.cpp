@@ -0,0 +1,172 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+/*
+ * Benchmarks the reference search kernels on a synthetic gallery: the
+ * double scan of searchGallery() against the dimension-specialized scan
+ * from selectKernels() (when one exists for D), the float and binary16
+ * storage scans of searchCompactGallery(), and a scan of the float
+ * storage with l1SimilarityCompensated().  Each is reported with its time
+ * per search, matrix bandwidth, the largest difference of a candidate's
+ * score from the double score of the same template, and how often it
+ * agrees with the double scan at rank 1.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_gallery.h"
+#include "fofra2018_kernels.h"
+
+using namespace FOFRA;
+
+namespace {
+
+struct Result {
+    double seconds = 0.0;
+    double maxError = 0.0;
+    size_t rankOneAgreement = 0;
+};
+
+template<typename Search>
+Result
+run(
+    const GalleryView &gallery,
+    const std::vector<Template> &probes,
+    const std::vector<CandidateList> &reference,
+    size_t length,
+    Search search)
+{
+    Result r;
+    std::vector<CandidateList> results(probes.size(), CandidateList(length));
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t p = 0; p < probes.size(); p++)
+        search(probes[p], results[p]);
+    r.seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    /* Lists may order near-ties differently, so match by identity */
+    for (size_t p = 0; p < probes.size(); p++) {
+        r.rankOneAgreement += (results[p][0].identity ==
+            reference[p][0].identity);
+        for (size_t i = 0; i < length; i++) {
+            size_t row;
+            if (!gallery.findIdentity(results[p][i].identity, row))
+                continue;
+            r.maxError = std::max(r.maxError, std::fabs(
+                results[p][i].score - l1Similarity(probes[p].data(),
+                gallery.templateAt(row), gallery.dimension)));
+        }
+    }
+    return (r);
+}
+
+void
+report(
+    const std::string &name,
+    const Result &r,
+    size_t probes,
+    size_t matrixBytes)
+{
+    std::cout << std::left << std::setw(10) << name << std::right
+        << std::setw(12) << std::fixed << std::setprecision(3)
+        << 1e3 * r.seconds / probes << " ms/search"
+        << std::setw(10) << std::setprecision(2)
+        << matrixBytes * probes / r.seconds / 1e9 << " GB/s"
+        << std::setw(14) << std::scientific << std::setprecision(2)
+        << r.maxError << " max |error|"
+        << std::setw(6) << r.rankOneAgreement << "/" << probes
+        << " rank-1 agree\n";
+}
+}
+
+int
+main(
+    int argc,
+    char *argv[])
+{
+    const size_t N = (argc > 1) ? std::stoul(argv[1]) : 100000;
+    const size_t D = (argc > 2) ? std::stoul(argv[2]) : 512;
+    const size_t P = (argc > 3) ? std::stoul(argv[3]) : 20;
+    const size_t L = 20;
+
+    std::mt19937_64 rng(2018);
+    std::normal_distribution<double> normal;
+    std::vector<Template> templates(N, Template(D));
+    std::vector<uint32_t> ids(N);
+    for (size_t i = 0; i < N; i++) {
+        for (auto &v : templates[i])
+            v = normal(rng);
+        ids[i] = static_cast<uint32_t>(i);
+    }
+    std::vector<Template> probes(P);
+    for (size_t p = 0; p < P; p++) {
+        probes[p] = templates[(p * 7919) % N];
+        for (auto &v : probes[p])
+            v += 0.3 * normal(rng);
+    }
+
+    MappedGallery gallery;
+    const ReturnStatus rs = gallery.build(templates, ids);
+    if (rs.code != ReturnCode::Success) {
+        std::cerr << "build: " << rs.code << std::endl;
+        return (EXIT_FAILURE);
+    }
+    templates.clear();
+    CompactGallery<float> single;
+    single.build(gallery.view());
+    CompactGallery<Half> half;
+    half.build(gallery.view());
+
+    std::cout << "N=" << N << " D=" << D << " probes=" << P << "\n";
+    std::vector<CandidateList> reference(P, CandidateList(L));
+    for (size_t p = 0; p < P; p++)
+        searchGallery(gallery.view(), probes[p], reference[p]);
+
+    const Result d = run(gallery.view(), probes, reference, L,
+        [&](const Template &t, CandidateList &c) {
+            searchGallery(gallery.view(), t, c); });
+    report("double", d, P, N * D * sizeof(double));
+    const KernelSet kernels = selectKernels(D);
+    if (kernels.specialized) {
+        const Result k = run(gallery.view(), probes, reference, L,
+            [&](const Template &t, CandidateList &c) {
+                kernels.search(gallery.view(), t, c); });
+        report("fixed-D", k, P, N * D * sizeof(double));
+    }
+    const Result f = run(gallery.view(), probes, reference, L,
+        [&](const Template &t, CandidateList &c) {
+            searchCompactGallery(single, t, c); });
+    report("float", f, P, single.bytes());
+    /* The compensated kernel compares a float probe with float rows */
+    std::vector<float> narrow(D);
+    const Result kahan = run(gallery.view(), probes, reference, L,
+        [&](const Template &t, CandidateList &c) {
+            std::copy(t.begin(), t.end(), narrow.begin());
+            TopCandidates top(std::min(c.size(), N));
+            for (size_t row = 0; row < N; row++)
+                top.offer(l1SimilarityCompensated(narrow.data(),
+                    single.templateAt(row), D), static_cast<uint32_t>(row));
+            fillCandidates(gallery.view(), top, c); });
+    report("kahan", kahan, P, single.bytes());
+    const Result h = run(gallery.view(), probes, reference, L,
+        [&](const Template &t, CandidateList &c) {
+            searchCompactGallery(half, t, c); });
+    report("binary16", h, P, half.bytes());
+    return (EXIT_SUCCESS);
+}
@@ -0,0 +1,473 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_KERNELS_H_
+#define FOFRA2018_KERNELS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_gallery.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * IEEE-754 binary16 value, used only as a storage format.
+ */
+struct Half {
+    uint16_t bits;
+};
+using Half = struct Half;
+
+/** @brief Round a float to the nearest binary16, ties to even. */
+inline Half
+toHalf(
+    float value)
+{
+    /* After F. Giesen, "float_to_half_fast3_rtne" */
+    const uint32_t infinity = UINT32_C(255) << 23;
+    const uint32_t halfOverflow = (UINT32_C(127) + 16) << 23;
+    const uint32_t denormalMagic = (UINT32_C(127 - 15) + (23 - 10) + 1) << 23;
+
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    const uint32_t sign = f & UINT32_C(0x80000000);
+    f ^= sign;
+
+    uint16_t h;
+    if (f >= halfOverflow) {
+        h = (f > infinity) ? 0x7e00 : 0x7c00;
+    } else if (f < (UINT32_C(113) << 23)) {
+        /* Result is subnormal or zero; let the FPU do the rounding */
+        float magic, sum;
+        std::memcpy(&magic, &denormalMagic, sizeof(magic));
+        std::memcpy(&sum, &f, sizeof(sum));
+        sum += magic;
+        uint32_t bits;
+        std::memcpy(&bits, &sum, sizeof(bits));
+        h = static_cast<uint16_t>(bits - denormalMagic);
+    } else {
+        const uint32_t odd = (f >> 13) & 1;
+        f += (static_cast<uint32_t>(15 - 127) << 23) + 0xfff + odd;
+        h = static_cast<uint16_t>(f >> 13);
+    }
+    return (Half{static_cast<uint16_t>(h | (sign >> 16))});
+}
+
+/** @brief Widen a binary16 to float; exact, and free of branches. */
+inline float
+toFloat(
+    Half value)
+{
+    const uint32_t magnitude = static_cast<uint32_t>(value.bits & 0x7fff) << 13;
+    const uint32_t sign = static_cast<uint32_t>(value.bits & 0x8000) << 16;
+    /* Rebias the exponent by scaling; handles subnormals too */
+    const uint32_t scaleBits = (UINT32_C(254) - 15) << 23;
+    float f, scale;
+    std::memcpy(&f, &magnitude, sizeof(f));
+    std::memcpy(&scale, &scaleBits, sizeof(scale));
+    f *= scale;
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    /* Infinity and NaN keep an all-ones exponent */
+    bits |= (magnitude >= (UINT32_C(0x7c00) << 13)) ?
+        (UINT32_C(255) << 23) : 0;
+    bits |= sign;
+    std::memcpy(&f, &bits, sizeof(f));
+    return (f);
+}
+
+/**
+ * @brief
+ * L1 similarity of a double probe and a row of narrow values, widened to
+ * double and summed in eight independent partial sums.
+ *
+ * @details
+ * The partial sums break the dependency between additions, so the loop
+ * vectorizes without -ffast-math; the result differs from the sequential
+ * sum only in the order of the additions.
+ */
+template<typename Storage, typename Widen>
+inline double
+l1SimilarityWiden(
+    const double *probe,
+    const Storage *row,
+    size_t dimension,
+    Widen widen)
+{
+    constexpr size_t Lanes = 8;
+    double partial[Lanes] = {};
+    size_t i = 0;
+    for (; i + Lanes <= dimension; i += Lanes)
+        for (size_t j = 0; j < Lanes; j++)
+            partial[j] += std::fabs(probe[i + j] - widen(row[i + j]));
+    for (; i < dimension; i++)
+        partial[0] += std::fabs(probe[i] - widen(row[i]));
+
+    double distance = 0.0;
+    for (size_t j = 0; j < Lanes; j++)
+        distance += partial[j];
+    return (100.0 / (1.0 + distance));
+}
+
+/**
+ * @brief
+ * l1Similarity() of a double probe and a float gallery row, accumulated
+ * in double.
+ *
+ * @details
+ * Only the storage is narrow.  Each stored value g carries a rounding
+ * error of at most u|g|, u = 2^-24, and the sum adds no drift of its own,
+ * so the distance d differs from the double reference by at most
+ * u * sum|g| (plus reordering error of order 2^-53 d), and the
+ * similarity 100/(1+d) by at most 100 u sum|g| / (1+d)^2.
+ */
+inline double
+l1Similarity(
+    const double *probe,
+    const float *row,
+    size_t dimension)
+{
+    return (l1SimilarityWiden(probe, row, dimension,
+        [](float v) { return (static_cast<double>(v)); }));
+}
+
+/**
+ * @brief
+ * l1Similarity() of a double probe and a binary16 gallery row, accumulated
+ * in double.  As for the float overload, with u = 2^-11 for normal values
+ * (and an absolute error of at most 2^-25 per value below 2^-14).
+ */
+inline double
+l1Similarity(
+    const double *probe,
+    const Half *row,
+    size_t dimension)
+{
+    return (l1SimilarityWiden(probe, row, dimension,
+        [](Half v) { return (static_cast<double>(toFloat(v))); }));
+}
+
+/**
+ * @brief
+ * l1Similarity() of a float probe and a float row, accumulated in float
+ * with Kahan compensation.
+ *
+ * @details
+ * Without compensation a float sum of D terms drifts by up to D u times
+ * the distance; with it the error of the sum is about 2u, independent of
+ * D, while the arithmetic stays single precision.  Must not be compiled
+ * with -ffast-math, which removes the compensation.
+ */
+inline double
+l1SimilarityCompensated(
+    const float *probe,
+    const float *row,
+    size_t dimension)
+{
+    float sum = 0.0f, compensation = 0.0f;
+    for (size_t i = 0; i < dimension; i++) {
+        const float y = std::fabs(probe[i] - row[i]) - compensation;
+        const float t = sum + y;
+        compensation = (t - sum) - y;
+        sum = t;
+    }
+    return (100.0 / (1.0 + static_cast<double>(sum)));
+}
+
+/** @brief Store a double as float. */
+inline void
+narrowValue(
+    double value,
+    float &stored)
+{
+    stored = static_cast<float>(value);
+}
+
+/** @brief Store a double as binary16. */
+inline void
+narrowValue(
+    double value,
+    Half &stored)
+{
+    stored = toHalf(static_cast<float>(value));
+}
+
+/**
+ * @brief
+ * A copy of a gallery's matrix in a narrow storage type, float or Half,
+ * that shares the identities of the gallery it was built from.
+ *
+ * @details
+ * Scans read a half (float) or a quarter (Half) of the bytes of the double
+ * matrix.  The source gallery must outlive this object.
+ */
+template<typename Storage>
+class CompactGallery {
+public:
+    CompactGallery() :
+        source{}
+        {}
+
+    /** @brief Convert the matrix of a gallery. */
+    void
+    build(
+        const GalleryView &gallery)
+    {
+        this->source = gallery;
+        this->values.resize(gallery.count * gallery.dimension);
+        const double *m = gallery.matrix;
+        for (size_t i = 0; i < this->values.size(); i++)
+            narrowValue(m[i], this->values[i]);
+    }
+
+    /** @brief Return the gallery the matrix was built from. */
+    const GalleryView &
+    view() const
+    {
+        return (this->source);
+    }
+
+    /** @brief Return a pointer to the D stored values of row. */
+    const Storage *
+    templateAt(
+        size_t row) const
+    {
+        return (this->values.data() + row * this->source.dimension);
+    }
+
+    /** @brief Return the size in bytes of the stored matrix. */
+    size_t
+    bytes() const
+    {
+        return (this->values.size() * sizeof(Storage));
+    }
+
+private:
+    GalleryView source;
+    std::vector<Storage> values;
+};
+
+/**
+ * @brief
+ * searchGallery() over a narrow copy of the matrix, with double
+ * accumulation.  Scores match searchGallery() within the tolerance
+ * documented for the l1Similarity() overload of the storage type.
+ *
+ * @param[in] gallery
+ * Narrow copy of the gallery to search
+ * @param[in] probe
+ * Probe template of the gallery's dimension
+ * @param[out] candidates
+ * Pre-allocated candidate list, filled best first
+ */
+template<typename Storage>
+inline ReturnStatus
+searchCompactGallery(
+    const CompactGallery<Storage> &gallery,
+    const Template &probe,
+    CandidateList &candidates)
+{
+    const GalleryView &view = gallery.view();
+    if (probe.size() != view.dimension)
+        return (ReturnStatus(ReturnCode::NonCongruentVectors,
+            "probe and gallery differ in dimension"));
+
+    TopCandidates top(std::min(candidates.size(), view.count));
+    for (size_t row = 0; row < view.count; row++)
+        top.offer(l1Similarity(probe.data(), gallery.templateAt(row),
+            view.dimension), static_cast<uint32_t>(row));
+    fillCandidates(view, top, candidates);
+    return (ReturnStatus(ReturnCode::Success));
+}
+
+/*
+ * Compile-time unrolled body of the fixed-dimension kernels: adds
+ * |a[i] - b[i]| for i in [First, First + Count) into partial sum
+ * (i mod Lanes), so every index is a constant and there is no loop.
+ * The range is halved at each level to keep the recursion shallow.
+ */
+template<size_t First, size_t Count, size_t Lanes>
+struct UnrolledL1 {
+    static void
+    add(
+        const double *a,
+        const double *b,
+        double *partial)
+    {
+        UnrolledL1<First, Count / 2, Lanes>::add(a, b, partial);
+        UnrolledL1<First + Count / 2, Count - Count / 2, Lanes>::add(
+            a, b, partial);
+    }
+};
+
+template<size_t First, size_t Lanes>
+struct UnrolledL1<First, 1, Lanes> {
+    static void
+    add(
+        const double *a,
+        const double *b,
+        double *partial)
+    {
+        partial[First % Lanes] += std::fabs(a[First] - b[First]);
+    }
+};
+
+template<size_t First, size_t Lanes>
+struct UnrolledL1<First, 0, Lanes> {
+    static void
+    add(
+        const double *,
+        const double *,
+        double *)
+    {
+    }
+};
+
+/**
+ * @brief
+ * l1Similarity() for templates of exactly Dimension values, unrolled at
+ * compile time, with no tail handling.
+ *
+ * @details
+ * Up to 64 values the kernel is one straight-line block.  Longer
+ * templates run a constant-count loop over blocks of 32, since unrolling
+ * a whole 512 or 1024 value template costs more in instruction cache
+ * than it saves in loop overhead.  Four partial sums break the
+ * dependency between additions, so scores differ from l1Similarity()
+ * only by the rounding of the reordered sum (of order 2^-53 times the
+ * distance).  Templates of any other dimension are compared by
+ * l1Similarity(), so the kernel is safe through KernelSet's generic
+ * signature.  Use one kernel family, from selectKernels(), for both
+ * verification and search so that scores are consistent.
+ */
+template<size_t Dimension>
+inline double
+l1SimilarityFixed(
+    const double *a,
+    const double *b,
+    size_t dimension = Dimension)
+{
+    if (dimension != Dimension)
+        return (l1Similarity(a, b, dimension));
+    constexpr size_t Lanes = 4;
+    constexpr size_t Block = (Dimension <= 64) ? Dimension : 32;
+    constexpr size_t Blocks = Dimension / Block;
+    double partial[Lanes] = {};
+    for (size_t i = 0; i < Blocks; i++)
+        UnrolledL1<0, Block, Lanes>::add(a + i * Block, b + i * Block,
+            partial);
+    UnrolledL1<Blocks * Block, Dimension % Block, Lanes>::add(a, b, partial);
+    return (100.0 / (1.0 + ((partial[0] + partial[1]) +
+        (partial[2] + partial[3]))));
+}
+
+/**
+ * @brief
+ * searchGallery() with the comparator fixed at compile time, so that it
+ * is inlined into the scan.
+ */
+template<double (*Similarity)(const double*, const double*, size_t)>
+inline ReturnStatus
+searchGalleryWith(
+    const GalleryView &gallery,
+    const Template &probe,
+    CandidateList &candidates)
+{
+    if (probe.size() != gallery.dimension)
+        return (ReturnStatus(ReturnCode::NonCongruentVectors,
+            "probe and gallery differ in dimension"));
+
+    TopCandidates top(std::min(candidates.size(), gallery.count));
+    for (size_t row = 0; row < gallery.count; row++)
+        top.offer(Similarity(probe.data(), gallery.templateAt(row),
+            gallery.dimension), static_cast<uint32_t>(row));
+    fillCandidates(gallery, top, candidates);
+    return (ReturnStatus(ReturnCode::Success));
+}
+
+/**
+ * @brief
+ * Verification and search kernels for one template dimension.
+ */
+struct KernelSet {
+    /** @brief Dimension the kernels were selected for */
+    size_t dimension;
+    /** @brief true if the kernels are specialized for the dimension */
+    bool specialized;
+    /** @brief Comparator, as l1Similarity() */
+    double (*similarity)(const double*, const double*, size_t);
+    /** @brief Exhaustive search, as searchGallery() */
+    ReturnStatus (*search)(const GalleryView&, const Template&,
+        CandidateList&);
+};
+using KernelSet = struct KernelSet;
+
+namespace Kernels {
+template<size_t Dimension>
+inline KernelSet
+fixed()
+{
+    return (KernelSet{Dimension, true, l1SimilarityFixed<Dimension>,
+        searchGalleryWith<l1SimilarityFixed<Dimension>>});
+}
+}
+
+/**
+ * @brief
+ * Choose the kernels for a fused template dimension.  Call once, e.g.
+ * from initialize(action = Action::Fuse), when the dimension is known.
+ *
+ * @details
+ * Specialized kernels exist for the dimensions of the R template example
+ * (16, 20 and their concatenation, 36) and for common embedding sizes
+ * (32, 64, 128, 256, 512, 1024).  Any other dimension gets the generic
+ * l1Similarity() and searchGallery().
+ *
+ * @param[in] dimension
+ * Fused template dimension, D
+ */
+inline KernelSet
+selectKernels(
+    size_t dimension)
+{
+    switch (dimension) {
+    case 16:
+        return (Kernels::fixed<16>());
+    case 20:
+        return (Kernels::fixed<20>());
+    case 32:
+        return (Kernels::fixed<32>());
+    case 36:
+        return (Kernels::fixed<36>());
+    case 64:
+        return (Kernels::fixed<64>());
+    case 128:
+        return (Kernels::fixed<128>());
+    case 256:
+        return (Kernels::fixed<256>());
+    case 512:
+        return (Kernels::fixed<512>());
+    case 1024:
+        return (Kernels::fixed<1024>());
+    default:
+        return (KernelSet{dimension, false,
+            static_cast<double (*)(const double*, const double*, size_t)>(
+            l1Similarity), searchGallery});
+    }
+}
+}
+
+#endif /* FOFRA2018_KERNELS_H_ */
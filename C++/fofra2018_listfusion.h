@@ -0,0 +1,696 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_LISTFUSION_H_
+#define FOFRA2018_LISTFUSION_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_gallery.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * Reference candidate list fuser, as in R/fusion_example_score_level.R,
+ * with scratch space that is reused from call to call.
+ *
+ * @details
+ * The identities of the K input lists are mapped once to dense slots
+ * 0..U-1 through an open-addressed table, and every later step works on
+ * the U x K slot matrix.  The table is cleared by bumping a generation
+ * stamp rather than by rewriting it.  One object must not be used by two
+ * threads at once; give each thread its own.
+ */
+class CandidateListFuser {
+public:
+    /** @brief How the K scores of an identity are combined */
+    enum class Rule {
+        /** Weighted sum of scores */
+        Sum = 0,
+        /** Product of scores */
+        Product
+    };
+
+    /** @brief How a list's scores are normalized before combination */
+    enum class Normalization {
+        /** Use scores as they are */
+        None = 0,
+        /** (score - position) / scale, with cached impostor statistics */
+        ZNorm,
+        /**
+         * T-norm on the list's own tail: the mean and standard deviation
+         * of the scores below rank tailRank, which are almost always
+         * impostors.  Falls back to ZNorm when the tail is too short.
+         */
+        TNorm
+    };
+
+    /** @brief Per-list fusion parameters */
+    struct ListModel {
+        /** @brief Weight of the list's scores under Rule::Sum */
+        double weight;
+        /**
+         * @brief Score of an identity that is absent from the list, on
+         * the normalized scale
+         */
+        double missing;
+        /** @brief Normalization of the list's scores */
+        Normalization normalization;
+        /** @brief Cached impostor mean, e.g. from ImpostorStatistics */
+        double position;
+        /** @brief Cached impostor standard deviation */
+        double scale;
+        /** @brief First rank (0-based) of the tail used by TNorm */
+        size_t tailRank;
+
+        ListModel() :
+            ListModel(1.0, 0.0)
+            {}
+
+        ListModel(
+            double weight,
+            double missing,
+            Normalization normalization = Normalization::None,
+            double position = 0.0,
+            double scale = 1.0,
+            size_t tailRank = 0) :
+            weight{weight},
+            missing{missing},
+            normalization{normalization},
+            position{position},
+            scale{scale},
+            tailRank{tailRank}
+            {}
+    };
+
+    /**
+     * @brief
+     * Choice of the fused list length x, L ≤ x ≤ 2L, from the fused
+     * scores.  Every candidate returned costs a downstream re-rank and
+     * adjudication, so a search whose mate stands out returns L
+     * candidates and an ambiguous one returns up to 2L.
+     */
+    struct LengthModel {
+        /** @brief Choose the length; otherwise return maxLength */
+        bool adaptive;
+        /**
+         * @brief Calibrated fused score at or above which the top
+         * candidate is taken as a mate, e.g. the threshold at the target
+         * FPIR
+         */
+        double threshold;
+        /**
+         * @brief Fused score gap that separates candidates: the lead the
+         * top candidate needs over the second to be confident, and the
+         * break past rank L at which an ambiguous list is cut
+         */
+        double gap;
+
+        LengthModel() :
+            LengthModel(false, std::numeric_limits<double>::infinity(),
+            std::numeric_limits<double>::infinity())
+            {}
+
+        LengthModel(
+            bool adaptive,
+            double threshold,
+            double gap) :
+            adaptive{adaptive},
+            threshold{threshold},
+            gap{gap}
+            {}
+    };
+
+    explicit CandidateListFuser(
+        Rule rule = Rule::Sum) :
+        rule{rule},
+        generation{0},
+        shift{64}
+        {}
+
+    /**
+     * @brief
+     * Set the parameters of each input list.  With none set, lists have
+     * weight 1 and absent identities score 0 (Sum) or 1 (Product).
+     */
+    void
+    setListModels(
+        const std::vector<ListModel> &models)
+    {
+        this->models = models;
+    }
+
+    /** @brief Set the choice of fused list length; see LengthModel. */
+    void
+    setLengthModel(
+        const LengthModel &length)
+    {
+        this->length = length;
+    }
+
+    /**
+     * @brief
+     * Fuse K candidate lists into one of at most maxLength candidates,
+     * sorted in decreasing order of fused score.
+     *
+     * @details
+     * Lists are expected in decreasing order of score, as returned by a
+     * search; TNorm relies on it.  An identity listed twice in one list
+     * keeps its higher score.  With an adaptive LengthModel, the list is
+     * cut to between L, the longest input list, and maxLength.
+     *
+     * @param[in] lists
+     * K ≥ 1 candidate lists
+     * @param[in] maxLength
+     * Largest fused list to return, e.g. 2L
+     * @param[out] fused
+     * Fused candidate list
+     */
+    ReturnStatus
+    fuse(
+        const std::vector<const CandidateList*> &lists,
+        size_t maxLength,
+        CandidateList &fused)
+    {
+        const size_t K = lists.size();
+        if (K == 0)
+            return (ReturnStatus(ReturnCode::NumDataError, "no lists"));
+        if (!this->models.empty() && this->models.size() != K)
+            return (ReturnStatus(ReturnCode::NonCongruentVectors,
+                "need one list model per list"));
+
+        /* Map every identity to its dense slot, once */
+        size_t entries = 0, L = 0;
+        for (const auto *l : lists) {
+            entries += l->size();
+            L = std::max(L, l->size());
+        }
+        this->reset(entries);
+        this->entrySlots.resize(entries);
+        size_t e = 0;
+        for (const auto *l : lists)
+            for (const auto &c : *l)
+                this->entrySlots[e++] = this->slotOf(c.identity);
+
+        /* Normalize each list into contiguous scratch */
+        this->normalized.resize(entries);
+        e = 0;
+        for (size_t k = 0; k < K; k++) {
+            const CandidateList &l = *lists[k];
+            for (size_t i = 0; i < l.size(); i++)
+                this->normalized[e + i] = l[i].score;
+            normalize(this->model(k), &this->normalized[e], l.size());
+            e += l.size();
+        }
+
+        /* Fill the U x K slot matrix */
+        const size_t U = this->slotIds.size();
+        this->scores.resize(U * K);
+        for (size_t u = 0; u < U; u++)
+            for (size_t k = 0; k < K; k++)
+                this->scores[u * K + k] = this->model(k).missing;
+        this->seen.assign(U * K, 0);
+        e = 0;
+        for (size_t k = 0; k < K; k++)
+            for (size_t i = 0; i < lists[k]->size(); i++, e++) {
+                const size_t cell = this->entrySlots[e] * K + k;
+                const double score = this->normalized[e];
+                if (!this->seen[cell] || score > this->scores[cell])
+                    this->scores[cell] = score;
+                this->seen[cell] = 1;
+            }
+
+        this->combine(K, maxLength, fused);
+        fused.resize(this->fusedLength(std::min(L, maxLength), fused));
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /** @brief Fuse lists passed by value; see the overload above. */
+    ReturnStatus
+    fuse(
+        const std::vector<CandidateList> &lists,
+        size_t maxLength,
+        CandidateList &fused)
+    {
+        this->listPointers.clear();
+        for (const auto &l : lists)
+            this->listPointers.push_back(&l);
+        return (this->fuse(this->listPointers, maxLength, fused));
+    }
+
+    /**
+     * @brief
+     * Hybrid identification: search the probe against a gallery and fuse
+     * the result with K native candidate lists, in one call.
+     *
+     * @details
+     * The search result is written to this object's scratch and fused
+     * as list K, after the native lists, so list models are indexed
+     * 0..K-1 for the native lists and K for the search.  The search
+     * returns L candidates, L being the longest native list, and the
+     * fused list has at most 2L.
+     *
+     * @param[in] gallery
+     * Gallery of fused templates
+     * @param[in] probe
+     * Fused probe template
+     * @param[in] nativeLists
+     * K ≥ 1 candidate lists from the fused algorithms
+     * @param[out] fused
+     * Fused candidate list
+     */
+    ReturnStatus
+    searchAndFuse(
+        const GalleryView &gallery,
+        const Template &probe,
+        const std::vector<CandidateList> &nativeLists,
+        CandidateList &fused)
+    {
+        size_t L = 0;
+        for (const auto &l : nativeLists)
+            L = std::max(L, l.size());
+        if (nativeLists.empty())
+            return (ReturnStatus(ReturnCode::NumDataError,
+                "no native candidate lists"));
+
+        this->searched.resize(L);
+        const ReturnStatus rs = searchGallery(gallery, probe, this->searched);
+        if (rs.code != ReturnCode::Success)
+            return (rs);
+        this->searched.resize(std::min(L, gallery.count));
+
+        this->listPointers.clear();
+        for (const auto &l : nativeLists)
+            this->listPointers.push_back(&l);
+        this->listPointers.push_back(&this->searched);
+        return (this->fuse(this->listPointers, 2 * L, fused));
+    }
+
+private:
+    struct Bucket {
+        uint32_t identity;
+        uint32_t generation;
+        uint32_t slot;
+    };
+
+    ListModel
+    model(
+        size_t k) const
+    {
+        if (!this->models.empty())
+            return (this->models[k]);
+        return (ListModel(1.0, this->rule == Rule::Product ? 1.0 : 0.0));
+    }
+
+    /*
+     * Normalize n contiguous scores in place.  The T-norm sums are kept in
+     * independent lanes, as in Dense::moments(), so that they vectorize
+     * without reassociation by the compiler; the final pass has no
+     * dependencies between iterations.
+     */
+    static void
+    normalize(
+        const ListModel &m,
+        double *scores,
+        size_t n)
+    {
+        if (m.normalization == Normalization::None)
+            return;
+
+        double position = m.position;
+        double scale = m.scale;
+        if (m.normalization == Normalization::TNorm && n > m.tailRank + 1) {
+            const double *tail = scores + m.tailRank;
+            const size_t t = n - m.tailRank;
+            constexpr size_t Lanes = 8;
+            double sums[Lanes] = {}, squares[Lanes] = {};
+            size_t i = 0;
+            for (; i + Lanes <= t; i += Lanes)
+                for (size_t l = 0; l < Lanes; l++)
+                    sums[l] += tail[i + l];
+            for (; i < t; i++)
+                sums[0] += tail[i];
+            double sum = 0.0;
+            for (size_t l = 0; l < Lanes; l++)
+                sum += sums[l];
+            const double mean = sum / static_cast<double>(t);
+            for (i = 0; i + Lanes <= t; i += Lanes)
+                for (size_t l = 0; l < Lanes; l++)
+                    squares[l] += (tail[i + l] - mean) * (tail[i + l] - mean);
+            for (; i < t; i++)
+                squares[0] += (tail[i] - mean) * (tail[i] - mean);
+            double total = 0.0;
+            for (size_t l = 0; l < Lanes; l++)
+                total += squares[l];
+            const double sd = std::sqrt(total / static_cast<double>(t - 1));
+            if (sd > 0.0) {
+                position = mean;
+                scale = sd;
+            }
+        }
+
+        const double inverse = (scale > 0.0) ? 1.0 / scale : 1.0;
+        for (size_t i = 0; i < n; i++)
+            scores[i] = (scores[i] - position) * inverse;
+    }
+
+    /* Empty the identity table, sized for up to entries identities */
+    void
+    reset(
+        size_t entries)
+    {
+        size_t capacity = 16;
+        while (capacity < 2 * entries)
+            capacity *= 2;
+        if (capacity > this->table.size() || ++this->generation == 0) {
+            this->table.assign(std::max(capacity, this->table.size()),
+                Bucket{0, 0, 0});
+            this->generation = 1;
+            this->shift = 64;
+            for (size_t size = this->table.size(); size > 1; size /= 2)
+                this->shift--;
+        }
+        this->slotIds.clear();
+    }
+
+    /*
+     * Dense slot of an identity, creating it if this call has not seen it.
+     * The bucket is the top bits of a multiplicative hash, which depend on
+     * every bit of the identity, so labels that are multiples of a power
+     * of two still spread over the whole table.
+     */
+    uint32_t
+    slotOf(
+        uint32_t identity)
+    {
+        const size_t mask = this->table.size() - 1;
+        size_t i = static_cast<size_t>(
+            (identity * UINT64_C(0x9E3779B97F4A7C15)) >> this->shift);
+        for (;; i = (i + 1) & mask) {
+            Bucket &b = this->table[i];
+            if (b.generation != this->generation) {
+                b.identity = identity;
+                b.generation = this->generation;
+                b.slot = static_cast<uint32_t>(this->slotIds.size());
+                this->slotIds.push_back(identity);
+                return (b.slot);
+            }
+            if (b.identity == identity)
+                return (b.slot);
+        }
+    }
+
+    /* Combine each slot's K scores and keep the best maxLength */
+    void
+    combine(
+        size_t K,
+        size_t maxLength,
+        CandidateList &fused)
+    {
+        const size_t U = this->slotIds.size();
+        this->weights.resize(K);
+        for (size_t k = 0; k < K; k++)
+            this->weights[k] = this->model(k).weight;
+
+        TopCandidates top(std::min(U, maxLength));
+        for (size_t u = 0; u < U; u++) {
+            const double *s = &this->scores[u * K];
+            double f;
+            if (this->rule == Rule::Product) {
+                f = 1.0;
+                for (size_t k = 0; k < K; k++)
+                    f *= s[k];
+            } else {
+                f = 0.0;
+                for (size_t k = 0; k < K; k++)
+                    f += this->weights[k] * s[k];
+            }
+            top.offer(f, static_cast<uint32_t>(u));
+        }
+
+        top.drain(this->best);
+        fused.resize(this->best.size());
+        for (size_t i = 0; i < this->best.size(); i++)
+            fused[i] = Candidate(this->slotIds[this->best[i].row],
+                this->best[i].score);
+    }
+
+    /*
+     * Length of the fused list to return, at least L.  A top candidate
+     * at or above the threshold with a lead of gap over the second needs
+     * no more than L; otherwise the list runs to the first gap past rank
+     * L, or to its end.
+     */
+    size_t
+    fusedLength(
+        size_t L,
+        const CandidateList &fused) const
+    {
+        const size_t n = fused.size();
+        if (!this->length.adaptive || n <= L)
+            return (n);
+        const double second = (n > 1) ? fused[1].score :
+            -std::numeric_limits<double>::infinity();
+        if (fused[0].score >= this->length.threshold &&
+            fused[0].score - second >= this->length.gap)
+            return (std::max<size_t>(L, 1));
+        for (size_t i = std::max<size_t>(L, 1); i < n; i++)
+            if (fused[i - 1].score - fused[i].score >= this->length.gap)
+                return (i);
+        return (n);
+    }
+
+    Rule rule;
+    std::vector<ListModel> models;
+    LengthModel length;
+    std::vector<Bucket> table;
+    uint32_t generation;
+    /* 64 - log2 of the table size */
+    unsigned int shift;
+    std::vector<uint32_t> slotIds;
+    std::vector<uint32_t> entrySlots;
+    std::vector<double> normalized;
+    std::vector<double> scores;
+    std::vector<uint8_t> seen;
+    std::vector<double> weights;
+    std::vector<const CandidateList*> listPointers;
+    std::vector<TopCandidates::Entry> best;
+    CandidateList searched;
+};
+
+/**
+ * @brief
+ * Running impostor score statistics for Z- and T-norm, mergeable across
+ * threads and processes.
+ */
+struct ImpostorStatistics {
+    /** @brief Number of scores seen */
+    uint64_t count;
+    /** @brief Mean of the scores */
+    double mean;
+    /** @brief Sum of squared deviations from the mean */
+    double m2;
+
+    ImpostorStatistics() :
+        count{0},
+        mean{0.0},
+        m2{0.0}
+        {}
+
+    /** @brief Add n scores. */
+    void
+    add(
+        const double *scores,
+        size_t n)
+    {
+        if (n == 0)
+            return;
+        ImpostorStatistics batch;
+        double sum = 0.0;
+        for (size_t i = 0; i < n; i++)
+            sum += scores[i];
+        batch.count = n;
+        batch.mean = sum / static_cast<double>(n);
+        for (size_t i = 0; i < n; i++)
+            batch.m2 += (scores[i] - batch.mean) * (scores[i] - batch.mean);
+        this->merge(batch);
+    }
+
+    /** @brief Combine with statistics of other scores (Chan et al.). */
+    void
+    merge(
+        const ImpostorStatistics &other)
+    {
+        if (other.count == 0)
+            return;
+        const double n = static_cast<double>(this->count + other.count);
+        const double delta = other.mean - this->mean;
+        this->m2 += other.m2 + delta * delta *
+            static_cast<double>(this->count) *
+            static_cast<double>(other.count) / n;
+        this->mean += delta * static_cast<double>(other.count) / n;
+        this->count += other.count;
+    }
+
+    /** @brief Sample standard deviation of the scores. */
+    double
+    sd() const
+    {
+        return (this->count > 1 ?
+            std::sqrt(this->m2 / static_cast<double>(this->count - 1)) : 0.0);
+    }
+};
+using ImpostorStatistics = struct ImpostorStatistics;
+
+/**
+ * @brief
+ * Estimate impostor statistics of a gallery's comparator by scoring
+ * random pairs of rows with different identities.
+ *
+ * @details
+ * Run this once when the gallery is built and cache the result in the
+ * search list's ListModel, so that normalizing a search result costs no
+ * cohort searches at query time.
+ *
+ * @param[in] gallery
+ * Gallery of fused templates
+ * @param[in] pairs
+ * Number of impostor pairs to score
+ * @param[in] seed
+ * Seed of the pair sampler
+ * @param[in] compare
+ * Comparator with the signature of l1Similarity(), the one search
+ * scores with
+ * @param[out] statistics
+ * Impostor score statistics
+ */
+template<typename Comparator>
+inline ReturnStatus
+sampleImpostorStatistics(
+    const GalleryView &gallery,
+    size_t pairs,
+    uint64_t seed,
+    Comparator compare,
+    ImpostorStatistics &statistics)
+{
+    statistics = ImpostorStatistics();
+    if (gallery.count < 2)
+        return (ReturnStatus(ReturnCode::NumDataError,
+            "need two gallery entries"));
+
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<size_t> pick(0, gallery.count - 1);
+    std::vector<double> scores;
+    scores.reserve(pairs);
+    for (size_t attempts = 0; scores.size() < pairs &&
+        attempts < 4 * pairs; attempts++) {
+        const size_t a = pick(rng), b = pick(rng);
+        if (gallery.ids[a] == gallery.ids[b])
+            continue;
+        scores.push_back(compare(gallery.templateAt(a),
+            gallery.templateAt(b), gallery.dimension));
+    }
+    statistics.add(scores.data(), scores.size());
+    return (ReturnStatus(ReturnCode::Success));
+}
+
+/**
+ * @brief
+ * Read per-algorithm impostor statistics in the format written by
+ * prepare_and_write_verification_fuser() in
+ * R/fusion_example_score_level.R: a header line, then one
+ * "Algorithm position scale" line per algorithm, in list order.
+ *
+ * @param[in] filename
+ * Model file, e.g. <directory>/z_norm.txt
+ * @param[in] normalization
+ * Normalization to apply to every list
+ * @param[in] tailRank
+ * First rank of the tail, for Normalization::TNorm
+ * @param[out] models
+ * One ListModel per algorithm, weight 1 and missing 0
+ */
+inline ReturnStatus
+readListModels(
+    const std::string &filename,
+    CandidateListFuser::Normalization normalization,
+    size_t tailRank,
+    std::vector<CandidateListFuser::ListModel> &models)
+{
+    std::ifstream in(filename);
+    if (!in)
+        return (ReturnStatus(ReturnCode::ConfigError, filename));
+
+    models.clear();
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        std::istringstream fields(line);
+        std::string algorithm;
+        double position, scale;
+        if (!(fields >> algorithm >> position >> scale))
+            return (ReturnStatus(ReturnCode::ConfigError,
+                filename + ": cannot parse \"" + line + "\""));
+        models.push_back(CandidateListFuser::ListModel(1.0, 0.0,
+            normalization, position, scale, tailRank));
+    }
+    return (ReturnStatus(ReturnCode::Success));
+}
+
+/**
+ * @brief
+ * Read an adaptive fused list length model: a header line, then one
+ * "threshold gap" line on the fused score scale.
+ *
+ * @param[in] filename
+ * Model file, e.g. <directory>/list_length.txt
+ * @param[out] length
+ * Adaptive length model
+ */
+inline ReturnStatus
+readLengthModel(
+    const std::string &filename,
+    CandidateListFuser::LengthModel &length)
+{
+    std::ifstream in(filename);
+    if (!in)
+        return (ReturnStatus(ReturnCode::ConfigError, filename));
+
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        std::istringstream fields(line);
+        double threshold, gap;
+        if (!(fields >> threshold >> gap) || !(gap >= 0.0))
+            return (ReturnStatus(ReturnCode::ConfigError,
+                filename + ": cannot parse \"" + line + "\""));
+        length = CandidateListFuser::LengthModel(true, threshold, gap);
+        return (ReturnStatus(ReturnCode::Success));
+    }
+    return (ReturnStatus(ReturnCode::ConfigError,
+        filename + ": no threshold"));
+}
+}
+
+#endif /* FOFRA2018_LISTFUSION_H_ */
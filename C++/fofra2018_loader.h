@@ -0,0 +1,294 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_LOADER_H_
+#define FOFRA2018_LOADER_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_threads.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * One component of a fusion model (e.g. a projection matrix, a codebook,
+ * a table of likelihood ratios) that is loaded at most once.
+ *
+ * @details
+ * ensure() loads the component on first call, from whichever thread gets
+ * there first; concurrent callers wait for that load and share its
+ * result, including a failure.
+ */
+class ModelComponent {
+public:
+    /** @brief When a component is loaded */
+    enum class Residency {
+        /** In initialize(), before the implementation reports ready */
+        Hot = 0,
+        /** On first use */
+        Lazy
+    };
+
+    ModelComponent(
+        const std::string &name,
+        Residency residency) :
+        label{name},
+        residency{residency},
+        done{false},
+        status{ReturnCode::Success},
+        elapsed{0.0}
+        {}
+
+    virtual ~ModelComponent() {}
+
+    ModelComponent(const ModelComponent&) = delete;
+    ModelComponent &operator=(const ModelComponent&) = delete;
+
+    /** @brief Return the component's name. */
+    const std::string &
+    name() const
+    {
+        return (this->label);
+    }
+
+    /** @brief Return when the component is loaded. */
+    Residency
+    when() const
+    {
+        return (this->residency);
+    }
+
+    /** @brief Return true once a load has finished, successfully or not. */
+    bool
+    loaded() const
+    {
+        return (this->done.load(std::memory_order_acquire));
+    }
+
+    /** @brief Return the time the load took, in seconds. */
+    double
+    seconds() const
+    {
+        return (this->loaded() ? this->elapsed : 0.0);
+    }
+
+    /** @brief Load the component unless it is loaded; return the result. */
+    ReturnStatus
+    ensure()
+    {
+        if (!this->loaded())
+            std::call_once(this->once, [this]() {
+                const auto start = std::chrono::steady_clock::now();
+                this->status = this->load();
+                this->elapsed = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+                this->done.store(true, std::memory_order_release);
+            });
+        return (this->status);
+    }
+
+protected:
+    /** @brief Read the component; called once. */
+    virtual ReturnStatus
+    load() = 0;
+
+private:
+    std::string label;
+    Residency residency;
+    std::once_flag once;
+    std::atomic<bool> done;
+    ReturnStatus status;
+    double elapsed;
+};
+
+/**
+ * @brief
+ * A model component holding a value of type T, filled by a loader
+ * function, e.g. ProjectionModel::read().
+ */
+template<typename T>
+class LoadedComponent : public ModelComponent {
+public:
+    LoadedComponent(
+        const std::string &name,
+        Residency residency,
+        std::function<ReturnStatus(T&)> loader) :
+        ModelComponent(name, residency),
+        loader(std::move(loader)),
+        value{}
+        {}
+
+    /**
+     * @brief
+     * Return the loaded value, loading it first if necessary.
+     *
+     * @param[out] component
+     * Points to the value on success
+     */
+    ReturnStatus
+    get(
+        const T *&component)
+    {
+        const ReturnStatus rs = this->ensure();
+        component = (rs.code == ReturnCode::Success) ? &this->value :
+            nullptr;
+        return (rs);
+    }
+
+protected:
+    ReturnStatus
+    load()
+    {
+        const ReturnStatus rs = this->loader(this->value);
+        /* The loader is not needed again; drop what it captured */
+        this->loader = nullptr;
+        return (rs);
+    }
+
+private:
+    std::function<ReturnStatus(T&)> loader;
+    T value;
+};
+
+/**
+ * @brief
+ * The components of a fusion model, for initialize() to load hot
+ * components in parallel and leave the rest to load on first use.
+ *
+ * @details
+ * An implementation registers its components with add() in initialize()
+ * and calls loadHot(), which returns once every hot component is in
+ * place and stops the pool's threads.  Lazy components load on the first
+ * get().
+ *
+ * A lazy component first used after fork() is loaded by each child into
+ * its own pages.  When the NIST application forks after initialize() (see
+ * ScoreFuserInterface), call loadAll() before returning from initialize()
+ * instead, so that every component is shared by the children.
+ */
+class ModelLoader {
+public:
+    /**
+     * @brief
+     * Register a component.
+     *
+     * @param[in] name
+     * Name of the component, for reports
+     * @param[in] residency
+     * When to load the component
+     * @param[in] loader
+     * Function filling the value from, e.g., the model directory
+     *
+     * @return
+     * The component, whose get() returns the value
+     */
+    template<typename T>
+    std::shared_ptr<LoadedComponent<T>>
+    add(
+        const std::string &name,
+        ModelComponent::Residency residency,
+        std::function<ReturnStatus(T&)> loader)
+    {
+        std::shared_ptr<LoadedComponent<T>> component =
+            std::make_shared<LoadedComponent<T>>(name, residency,
+            std::move(loader));
+        this->components.push_back(component);
+        return (component);
+    }
+
+    /**
+     * @brief
+     * Load every hot component in parallel and wait for them.
+     *
+     * @param[in] pool
+     * Threads to load on; stopped on return
+     *
+     * @return
+     * Success, or the first failure in registration order, naming the
+     * component in info
+     */
+    ReturnStatus
+    loadHot(
+        WorkerPool &pool)
+    {
+        return (this->loadWhere(pool, true));
+    }
+
+    /** @brief Load every component in parallel, as before fork(). */
+    ReturnStatus
+    loadAll(
+        WorkerPool &pool)
+    {
+        return (this->loadWhere(pool, false));
+    }
+
+    /**
+     * @brief
+     * Return true when every hot component has loaded successfully, so
+     * the implementation can serve requests.
+     */
+    bool
+    ready() const
+    {
+        for (const auto &c : this->components)
+            if (c->when() == ModelComponent::Residency::Hot &&
+                (!c->loaded() || c->ensure().code != ReturnCode::Success))
+                return (false);
+        return (true);
+    }
+
+    /** @brief Return the registered components, in registration order. */
+    const std::vector<std::shared_ptr<ModelComponent>> &
+    list() const
+    {
+        return (this->components);
+    }
+
+private:
+    ReturnStatus
+    loadWhere(
+        WorkerPool &pool,
+        bool hotOnly)
+    {
+        std::vector<ModelComponent*> selected;
+        for (const auto &c : this->components)
+            if (!hotOnly || c->when() == ModelComponent::Residency::Hot)
+                selected.push_back(c.get());
+
+        /* Largest components are unknown; one per task balances well */
+        pool.parallelFor(selected.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                selected[i]->ensure();
+        });
+        pool.stop();
+
+        for (const auto c : selected) {
+            ReturnStatus rs = c->ensure();
+            if (rs.code != ReturnCode::Success) {
+                rs.info = c->name() + (rs.info.empty() ? "" : ": " + rs.info);
+                return (rs);
+            }
+        }
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    std::vector<std::shared_ptr<ModelComponent>> components;
+};
+}
+
+#endif /* FOFRA2018_LOADER_H_ */
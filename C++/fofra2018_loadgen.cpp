@@ -0,0 +1,538 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+/*
+ * Open-loop load generator for a ScoreFuserInterface or
+ * TemplateFuserInterface implementation.  Link with the library that
+ * implements the interfaces' getImplementation().
+ *
+ * Requests arrive on a schedule fixed in advance (constant or Poisson
+ * arrivals at the requested rate) and do not wait for earlier responses.
+ * Each latency is measured from the request's intended send time, not
+ * from when a thread got around to sending it, so time spent queued
+ * behind slow requests is counted rather than omitted; service time
+ * (from actual send) is reported alongside to show the difference.
+ * --sweep runs a series of rates and prints throughput against tail
+ * latency.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_histogram.h"
+
+using namespace FOFRA;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum class Operation {
+    FuseScores,
+    FuseLists,
+    FuseTemplates,
+    Verify,
+    Search
+};
+
+struct Options {
+    Operation operation = Operation::Search;
+    std::string configDir;
+    std::vector<double> rates;
+    double seconds = 10.0;
+    double warmup = 1.0;
+    bool poisson = true;
+    size_t threads = 0;
+    bool reentrant = false;
+    size_t inputs = 1024;
+    size_t components = 2;
+    size_t dimension = 256;
+    size_t galleryCount = 10000;
+    std::string gallery;
+    size_t candidates = 20;
+    uint64_t seed = 2018;
+    std::string hgrm;
+};
+
+/* Output buffers of one thread, reused across requests */
+struct Scratch {
+    double score;
+    Template fused;
+    CandidateList candidates;
+};
+
+/* Issues request i (modulo the prepared inputs) */
+using Request = std::function<ReturnStatus(size_t, Scratch&)>;
+
+struct Result {
+    double rate;
+    /* Requests scheduled in the measured window, per second */
+    double offered;
+    double achieved;
+    uint64_t errors;
+    LatencyHistogram latency;
+    LatencyHistogram service;
+};
+
+void
+usage(
+    const char *argv0)
+{
+    std::cerr << "Usage: " << argv0 << " <operation> <config dir> [options]\n"
+        "  operation: fuse-scores | fuse-lists | fuse-templates | verify |\n"
+        "             search\n"
+        "  --rate <r>                    requests per second (100)\n"
+        "  --sweep <from>:<to>:<steps>   run each of steps rates in turn\n"
+        "  --duration <s>                measured seconds per rate (10)\n"
+        "  --warmup <s>                  unmeasured seconds per rate (1)\n"
+        "  --arrivals poisson|constant   inter-arrival times (poisson)\n"
+        "  --threads <n>                 sending threads (default: 4 per CPU)\n"
+        "  --reentrant                   implementation is thread-safe\n"
+        "  --components <K>              scores, lists or templates fused (2)\n"
+        "  --dimension <D>               template dimension (256)\n"
+        "  --gallery-size <N>            synthetic gallery for search (10000)\n"
+        "  --gallery <location>          attachGallery() instead\n"
+        "  --candidates <L>              candidate list length (20)\n"
+        "  --inputs <n>                  distinct requests, cycled (1024)\n"
+        "  --seed <n>                    inputs and arrivals (2018)\n"
+        "  --hgrm <file>                 write latency percentiles of the\n"
+        "                                last rate in HdrHistogram format\n";
+}
+
+bool
+parseOptions(
+    int argc,
+    char *argv[],
+    Options &options)
+{
+    if (argc < 3)
+        return (false);
+    const std::string op = argv[1];
+    if (op == "fuse-scores")
+        options.operation = Operation::FuseScores;
+    else if (op == "fuse-lists")
+        options.operation = Operation::FuseLists;
+    else if (op == "fuse-templates")
+        options.operation = Operation::FuseTemplates;
+    else if (op == "verify")
+        options.operation = Operation::Verify;
+    else if (op == "search")
+        options.operation = Operation::Search;
+    else
+        return (false);
+    options.configDir = argv[2];
+
+    for (int i = 3; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--reentrant") {
+            options.reentrant = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return (false);
+        const std::string value = argv[++i];
+        if (arg == "--rate")
+            options.rates.assign(1, std::stod(value));
+        else if (arg == "--sweep") {
+            const size_t a = value.find(':'), b = value.rfind(':');
+            if (a == std::string::npos || a == b)
+                return (false);
+            const double from = std::stod(value.substr(0, a));
+            const double to = std::stod(value.substr(a + 1, b - a - 1));
+            const size_t steps = std::max<size_t>(1,
+                std::stoul(value.substr(b + 1)));
+            options.rates.clear();
+            for (size_t s = 0; s < steps; s++)
+                options.rates.push_back(steps == 1 ? from :
+                    from + (to - from) * static_cast<double>(s) /
+                    static_cast<double>(steps - 1));
+        } else if (arg == "--duration")
+            options.seconds = std::stod(value);
+        else if (arg == "--warmup")
+            options.warmup = std::stod(value);
+        else if (arg == "--arrivals") {
+            if (value != "poisson" && value != "constant")
+                return (false);
+            options.poisson = (value == "poisson");
+        } else if (arg == "--threads")
+            options.threads = std::stoul(value);
+        else if (arg == "--components")
+            options.components = std::stoul(value);
+        else if (arg == "--dimension")
+            options.dimension = std::stoul(value);
+        else if (arg == "--gallery-size")
+            options.galleryCount = std::stoul(value);
+        else if (arg == "--gallery")
+            options.gallery = value;
+        else if (arg == "--candidates")
+            options.candidates = std::stoul(value);
+        else if (arg == "--inputs")
+            options.inputs = std::max<size_t>(1, std::stoul(value));
+        else if (arg == "--seed")
+            options.seed = std::stoull(value);
+        else if (arg == "--hgrm")
+            options.hgrm = value;
+        else
+            return (false);
+    }
+    if (options.rates.empty())
+        options.rates.assign(1, 100.0);
+    for (const auto r : options.rates)
+        if (!(r > 0.0))
+            return (false);
+    if (options.threads == 0)
+        options.threads = 4 * std::max(1u,
+            std::thread::hardware_concurrency());
+    return (options.components >= 2 && options.dimension > 0 &&
+        options.seconds > 0.0 && options.warmup >= 0.0);
+}
+
+bool
+check(
+    const std::string &what,
+    const ReturnStatus &rs)
+{
+    if (rs.code == ReturnCode::Success)
+        return (true);
+    std::cerr << what << ": " << rs.code;
+    if (!rs.info.empty())
+        std::cerr << " (" << rs.info << ")";
+    std::cerr << std::endl;
+    return (false);
+}
+
+Template
+randomTemplate(
+    size_t dimension,
+    std::mt19937_64 &rng)
+{
+    std::normal_distribution<double> normal;
+    Template t(dimension);
+    for (auto &v : t)
+        v = normal(rng);
+    return (t);
+}
+
+/*
+ * Initialize the implementation, prepare inputs and return the function
+ * issuing a request.  Inputs are generated up front so that generating
+ * them is not timed.
+ */
+bool
+prepare(
+    const Options &options,
+    Request &request)
+{
+    std::mt19937_64 rng(options.seed);
+    std::uniform_real_distribution<double> uniform;
+    const size_t n = options.inputs, K = options.components;
+    std::shared_ptr<std::mutex> serial;
+    if (!options.reentrant)
+        serial = std::make_shared<std::mutex>();
+
+    /* Wrap a call so that, unless reentrant, calls are serialized */
+    const auto serialized = [serial](const Request &call) -> Request {
+        if (!serial)
+            return (call);
+        return ([serial, call](size_t i, Scratch &s) {
+            std::lock_guard<std::mutex> lock(*serial);
+            return (call(i, s)); });
+    };
+
+    switch (options.operation) {
+    case Operation::FuseScores:
+    case Operation::FuseLists: {
+        const bool lists = (options.operation == Operation::FuseLists);
+        std::shared_ptr<ScoreFuserInterface> impl =
+            ScoreFuserInterface::getImplementation();
+        if (!check("initialize " + options.configDir, impl->initialize(
+            options.configDir, lists ?
+            ScoreFuserInterface::Type::Identification :
+            ScoreFuserInterface::Type::Verification)))
+            return (false);
+        if (!lists) {
+            auto inputs = std::make_shared<std::vector<ScoreSet>>(n,
+                ScoreSet(K));
+            for (auto &s : *inputs)
+                for (auto &v : s)
+                    v = uniform(rng);
+            request = serialized([impl, inputs](size_t i, Scratch &s) {
+                return (impl->fuseVerificationScores(
+                    (*inputs)[i % inputs->size()], s.score)); });
+            return (true);
+        }
+        /* K lists of L candidates with descending scores */
+        std::uniform_int_distribution<uint32_t> identity(0,
+            static_cast<uint32_t>(std::max<size_t>(1,
+            options.galleryCount) - 1));
+        auto inputs = std::make_shared<std::vector<std::vector<
+            CandidateList>>>(n, std::vector<CandidateList>(K,
+            CandidateList(options.candidates)));
+        for (auto &set : *inputs)
+            for (auto &list : set) {
+                double score = 1.0;
+                for (auto &c : list) {
+                    score *= uniform(rng);
+                    c = Candidate(identity(rng), score);
+                }
+            }
+        request = serialized([impl, inputs](size_t i, Scratch &s) {
+            s.candidates.clear();
+            return (impl->fuseCandidateLists(
+                (*inputs)[i % inputs->size()], s.candidates)); });
+        return (true);
+    }
+    case Operation::FuseTemplates:
+    case Operation::Verify:
+    case Operation::Search: {
+        const TemplateFuserInterface::Action action =
+            (options.operation == Operation::FuseTemplates) ?
+            TemplateFuserInterface::Action::Fuse :
+            (options.operation == Operation::Verify) ?
+            TemplateFuserInterface::Action::Verify :
+            TemplateFuserInterface::Action::Identify;
+        std::shared_ptr<TemplateFuserInterface> impl =
+            TemplateFuserInterface::getImplementation();
+        if (!check("initialize " + options.configDir,
+            impl->initialize(options.configDir, action)))
+            return (false);
+
+        if (options.operation == Operation::FuseTemplates) {
+            auto inputs = std::make_shared<std::vector<std::vector<
+                Template>>>(n);
+            for (auto &set : *inputs)
+                for (size_t k = 0; k < K; k++)
+                    set.push_back(randomTemplate(options.dimension, rng));
+            request = serialized([impl, inputs](size_t i, Scratch &s) {
+                return (impl->fuseTemplates((*inputs)[i % inputs->size()],
+                    s.fused)); });
+            return (true);
+        }
+        if (options.operation == Operation::Verify) {
+            auto inputs = std::make_shared<std::vector<Template>>();
+            for (size_t i = 0; i < 2 * n; i++)
+                inputs->push_back(randomTemplate(options.dimension, rng));
+            request = serialized([impl, inputs](size_t i, Scratch &s) {
+                const size_t j = 2 * (i % (inputs->size() / 2));
+                return (impl->verify((*inputs)[j], (*inputs)[j + 1],
+                    s.score)); });
+            return (true);
+        }
+
+        /* Probes are gallery templates plus noise, as in kernel_bench */
+        auto probes = std::make_shared<std::vector<Template>>();
+        if (!options.gallery.empty()) {
+            if (!check("attachGallery " + options.gallery,
+                impl->attachGallery(options.gallery)))
+                return (false);
+            for (size_t i = 0; i < n; i++)
+                probes->push_back(randomTemplate(options.dimension, rng));
+        } else {
+            std::vector<Template> templates;
+            std::vector<uint32_t> ids;
+            for (size_t i = 0; i < options.galleryCount; i++) {
+                templates.push_back(randomTemplate(options.dimension, rng));
+                ids.push_back(static_cast<uint32_t>(i));
+            }
+            std::normal_distribution<double> normal;
+            for (size_t i = 0; i < n && !templates.empty(); i++) {
+                Template p = templates[(i * 7919) % templates.size()];
+                for (auto &v : p)
+                    v += 0.3 * normal(rng);
+                probes->push_back(p);
+            }
+            if (!check("createGallery",
+                impl->createGallery(templates, ids)))
+                return (false);
+            if (probes->empty())
+                probes->push_back(randomTemplate(options.dimension, rng));
+        }
+        const size_t L = options.candidates;
+        request = serialized([impl, probes, L](size_t i, Scratch &s) {
+            s.candidates.resize(L);
+            return (impl->search((*probes)[i % probes->size()],
+                s.candidates)); });
+        return (true);
+    }
+    }
+    return (false);
+}
+
+/* Intended send times, in ns from the start of the run */
+std::vector<int64_t>
+schedule(
+    double rate,
+    double seconds,
+    bool poisson,
+    uint64_t seed)
+{
+    std::vector<int64_t> times;
+    std::mt19937_64 rng(seed);
+    std::exponential_distribution<double> gap(rate);
+    double t = 0.0;
+    for (;;) {
+        t += poisson ? gap(rng) : 1.0 / rate;
+        if (t >= seconds)
+            break;
+        times.push_back(static_cast<int64_t>(t * 1e9));
+    }
+    return (times);
+}
+
+/*
+ * Issue requests at their intended times.  Each thread takes the next
+ * request in the schedule and sleeps until it is due; if every thread is
+ * busy, the request goes out late and its latency includes the wait.
+ */
+Result
+run(
+    const Options &options,
+    const Request &request,
+    double rate,
+    uint64_t seed)
+{
+    const std::vector<int64_t> times = schedule(rate,
+        options.warmup + options.seconds, options.poisson, seed);
+    const int64_t measuredFrom = static_cast<int64_t>(options.warmup * 1e9);
+
+    std::atomic<size_t> next{0};
+    std::atomic<uint64_t> errors{0};
+    std::vector<LatencyHistogram> latency(options.threads);
+    std::vector<LatencyHistogram> service(options.threads);
+    std::vector<int64_t> lastEnd(options.threads, 0);
+    const Clock::time_point start = Clock::now() +
+        std::chrono::milliseconds(10);
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < options.threads; t++)
+        threads.emplace_back([&, t]() {
+            Scratch scratch;
+            for (;;) {
+                const size_t i = next.fetch_add(1);
+                if (i >= times.size())
+                    break;
+                const Clock::time_point intended = start +
+                    std::chrono::nanoseconds(times[i]);
+                std::this_thread::sleep_until(intended);
+                const Clock::time_point sent = Clock::now();
+                const ReturnStatus rs = request(i, scratch);
+                const Clock::time_point done = Clock::now();
+                if (times[i] < measuredFrom)
+                    continue;
+                if (rs.code != ReturnCode::Success)
+                    errors++;
+                latency[t].record(std::chrono::duration_cast<
+                    std::chrono::nanoseconds>(done - intended).count());
+                service[t].record(std::chrono::duration_cast<
+                    std::chrono::nanoseconds>(done - sent).count());
+                lastEnd[t] = std::max(lastEnd[t], static_cast<int64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    done - start).count()));
+            }
+        });
+    for (auto &t : threads)
+        t.join();
+
+    const size_t measured = static_cast<size_t>(times.end() -
+        std::lower_bound(times.begin(), times.end(), measuredFrom));
+    Result result{rate, static_cast<double>(measured) / options.seconds,
+        0.0, errors.load(), LatencyHistogram(),
+        LatencyHistogram()};
+    for (size_t t = 0; t < options.threads; t++) {
+        result.latency.add(latency[t]);
+        result.service.add(service[t]);
+    }
+    /* Completions over the measured window, stretched if the tail ran late */
+    const int64_t end = *std::max_element(lastEnd.begin(), lastEnd.end());
+    const double window = std::max(options.seconds,
+        static_cast<double>(end - measuredFrom) / 1e9);
+    result.achieved = static_cast<double>(result.latency.count()) / window;
+    return (result);
+}
+
+void
+header()
+{
+    std::cout << std::setw(10) << "rate/s" << std::setw(10) << "done/s" <<
+        std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms" <<
+        std::setw(10) << "p99 ms" << std::setw(10) << "p99.9 ms" <<
+        std::setw(10) << "max ms" << std::setw(12) << "svc p99 ms" <<
+        std::setw(8) << "errors" << "\n";
+}
+
+void
+report(
+    const Result &r)
+{
+    const auto ms = [](int64_t ns) { return (static_cast<double>(ns) / 1e6); };
+    std::cout << std::fixed << std::setprecision(1) << std::setw(10) <<
+        r.rate << std::setw(10) << r.achieved << std::setprecision(3) <<
+        std::setw(10) << ms(r.latency.valueAtPercentile(50)) <<
+        std::setw(10) << ms(r.latency.valueAtPercentile(90)) <<
+        std::setw(10) << ms(r.latency.valueAtPercentile(99)) <<
+        std::setw(10) << ms(r.latency.valueAtPercentile(99.9)) <<
+        std::setw(10) << ms(r.latency.max()) <<
+        std::setw(12) << ms(r.service.valueAtPercentile(99)) <<
+        std::setw(8) << r.errors;
+    /* Falling short of the offered rate means the queue grew all run */
+    if (r.achieved < 0.95 * r.offered)
+        std::cout << "  saturated";
+    std::cout << std::endl;
+}
+}
+
+int
+main(
+    int argc,
+    char *argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return (EXIT_FAILURE);
+    }
+
+    Request request;
+    if (!prepare(options, request))
+        return (EXIT_FAILURE);
+
+    std::cout << options.threads << " threads, " << (options.poisson ?
+        "Poisson" : "constant") << " arrivals, " << options.seconds <<
+        " s per rate after " << options.warmup << " s warmup\n";
+    header();
+    Result last{0.0, 0.0, 0.0, 0, LatencyHistogram(), LatencyHistogram()};
+    for (size_t i = 0; i < options.rates.size(); i++) {
+        last = run(options, request, options.rates[i], options.seed + i);
+        report(last);
+    }
+
+    if (!options.hgrm.empty()) {
+        std::ofstream out(options.hgrm);
+        last.latency.writePercentiles(out, 1e6);
+        if (!out) {
+            std::cerr << options.hgrm << ": write failed" << std::endl;
+            return (EXIT_FAILURE);
+        }
+    }
+    return (EXIT_SUCCESS);
+}
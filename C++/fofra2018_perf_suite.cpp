@@ -0,0 +1,538 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+/*
+ * Performance regression suite for a ScoreFuserInterface and
+ * TemplateFuserInterface implementation.  Link with the library that
+ * implements the interfaces' getImplementation().
+ *
+ * Every workload is generated from a fixed seed, so two runs of the suite
+ * time the same calls on the same inputs.  "record" times each workload
+ * over several repetitions and writes the times to a baseline file;
+ * "compare" times them again and, for each workload, bootstraps a
+ * confidence interval for the ratio of median times against the
+ * baseline.  A workload whose whole interval lies above 1 + tolerance is
+ * a regression, and the exit status is non-zero so that a build can be
+ * gated on it.  Baselines are only comparable on the same machine.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "fofra2018.h"
+
+using namespace FOFRA;
+
+namespace {
+
+/* Version of the baseline file format */
+constexpr uint32_t BaselineVersion = 1;
+
+struct Options {
+    bool compare = false;
+    std::string configDir;
+    std::string baseline;
+    std::string output;
+    size_t repeats = 10;
+    std::vector<std::string> scales{"small", "medium"};
+    std::string only;
+    double tolerance = 0.05;
+    double level = 0.95;
+};
+
+/* One timed workload: repeated calls on fixed inputs */
+struct Workload {
+    /* Method and scale, e.g. "search/medium" */
+    std::string name;
+    /* Calls per repetition */
+    size_t calls;
+    /* Untimed preparation, if any, e.g. a gallery to search */
+    std::function<ReturnStatus()> setup;
+    std::function<ReturnStatus()> run;
+};
+
+/* Seconds per call of each repetition */
+using Timings = std::map<std::string, std::vector<double>>;
+
+struct Scale {
+    std::string name;
+    /* Score sets, lists, template sets or pairs per repetition */
+    size_t batch;
+    /* Gallery size and template dimension */
+    size_t gallery;
+    size_t dimension;
+};
+
+const std::vector<Scale> Scales{
+    {"small", 1000, 1000, 128},
+    {"medium", 10000, 10000, 256},
+    {"large", 100000, 100000, 256}
+};
+
+void
+usage(
+    const char *argv0)
+{
+    std::cerr << "Usage: " << argv0 << " record <config dir> <baseline> "
+        "[options]\n"
+        "       " << argv0 << " compare <config dir> <baseline> "
+        "[options]\n"
+        "  --repeats <n>        timed repetitions per workload (10)\n"
+        "  --scales <list>      comma-separated: small,medium,large\n"
+        "                       (small,medium)\n"
+        "  --only <prefix>      workloads whose name starts with prefix\n"
+        "  --tolerance <f>      slowdown ignored, as a fraction (0.05)\n"
+        "  --level <p>          confidence level (0.95)\n"
+        "  --output <file>      compare: also write the new timings\n";
+}
+
+bool
+parseOptions(
+    int argc,
+    char *argv[],
+    Options &options)
+{
+    if (argc < 4)
+        return (false);
+    const std::string mode = argv[1];
+    if (mode != "record" && mode != "compare")
+        return (false);
+    options.compare = (mode == "compare");
+    options.configDir = argv[2];
+    options.baseline = argv[3];
+    for (int i = 4; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc)
+            return (false);
+        const std::string value = argv[++i];
+        if (arg == "--repeats")
+            options.repeats = std::stoul(value);
+        else if (arg == "--scales") {
+            options.scales.clear();
+            std::istringstream in(value);
+            for (std::string s; std::getline(in, s, ','); )
+                options.scales.push_back(s);
+        } else if (arg == "--only")
+            options.only = value;
+        else if (arg == "--tolerance")
+            options.tolerance = std::stod(value);
+        else if (arg == "--level")
+            options.level = std::stod(value);
+        else if (arg == "--output")
+            options.output = value;
+        else
+            return (false);
+    }
+    for (const auto &s : options.scales)
+        if (std::none_of(Scales.begin(), Scales.end(),
+            [&](const Scale &known) { return (known.name == s); }))
+            return (false);
+    return (options.repeats >= 2 && options.tolerance >= 0.0 &&
+        options.level > 0.0 && options.level < 1.0);
+}
+
+bool
+check(
+    const std::string &what,
+    const ReturnStatus &rs)
+{
+    if (rs.code == ReturnCode::Success)
+        return (true);
+    std::cerr << what << ": " << rs.code;
+    if (!rs.info.empty())
+        std::cerr << " (" << rs.info << ")";
+    std::cerr << std::endl;
+    return (false);
+}
+
+Template
+randomTemplate(
+    size_t dimension,
+    std::mt19937_64 &rng)
+{
+    std::normal_distribution<double> normal;
+    Template t(dimension);
+    for (auto &v : t)
+        v = normal(rng);
+    return (t);
+}
+
+/* Initialized implementations, one per type or action */
+struct Implementations {
+    std::shared_ptr<ScoreFuserInterface> scoreVerification;
+    std::shared_ptr<ScoreFuserInterface> scoreIdentification;
+    std::shared_ptr<TemplateFuserInterface> fuse;
+    std::shared_ptr<TemplateFuserInterface> verify;
+    std::shared_ptr<TemplateFuserInterface> identify;
+};
+
+bool
+initialize(
+    const std::string &dir,
+    Implementations &impl)
+{
+    impl.scoreVerification = ScoreFuserInterface::getImplementation();
+    impl.scoreIdentification = ScoreFuserInterface::getImplementation();
+    impl.fuse = TemplateFuserInterface::getImplementation();
+    impl.verify = TemplateFuserInterface::getImplementation();
+    impl.identify = TemplateFuserInterface::getImplementation();
+    return (check("initialize score verification",
+        impl.scoreVerification->initialize(dir,
+        ScoreFuserInterface::Type::Verification)) &&
+        check("initialize score identification",
+        impl.scoreIdentification->initialize(dir,
+        ScoreFuserInterface::Type::Identification)) &&
+        check("initialize fuse", impl.fuse->initialize(dir,
+        TemplateFuserInterface::Action::Fuse)) &&
+        check("initialize verify", impl.verify->initialize(dir,
+        TemplateFuserInterface::Action::Verify)) &&
+        check("initialize identify", impl.identify->initialize(dir,
+        TemplateFuserInterface::Action::Identify)));
+}
+
+/*
+ * The workloads of one scale.  Inputs are generated here, from a seed
+ * fixed per workload, and captured by the workloads; only the calls are
+ * timed.
+ */
+std::vector<Workload>
+workloads(
+    const Scale &scale,
+    const Implementations &impl)
+{
+    std::vector<Workload> list;
+    const size_t K = 2, L = 20;
+    const std::string suffix = "/" + scale.name;
+    std::uniform_real_distribution<double> uniform;
+
+    {
+        std::mt19937_64 rng(2018);
+        auto sets = std::make_shared<std::vector<ScoreSet>>(scale.batch,
+            ScoreSet(K));
+        for (auto &s : *sets)
+            for (auto &v : s)
+                v = uniform(rng);
+        auto fuser = impl.scoreVerification;
+        list.push_back(Workload{"fuseVerificationScores" + suffix,
+            sets->size(), nullptr, [fuser, sets]() {
+                double fused;
+                for (const auto &s : *sets) {
+                    const ReturnStatus rs = fuser->fuseVerificationScores(
+                        s, fused);
+                    if (rs.code != ReturnCode::Success)
+                        return (rs);
+                }
+                return (ReturnStatus(ReturnCode::Success)); }});
+    }
+    {
+        std::mt19937_64 rng(2019);
+        std::uniform_int_distribution<uint32_t> identity(0,
+            static_cast<uint32_t>(scale.gallery - 1));
+        const size_t n = std::max<size_t>(1, scale.batch / 10);
+        auto lists = std::make_shared<std::vector<std::vector<
+            CandidateList>>>(n, std::vector<CandidateList>(K,
+            CandidateList(L)));
+        for (auto &set : *lists)
+            for (auto &l : set) {
+                double score = 1.0;
+                for (auto &c : l) {
+                    score *= uniform(rng);
+                    c = Candidate(identity(rng), score);
+                }
+            }
+        auto fuser = impl.scoreIdentification;
+        list.push_back(Workload{"fuseCandidateLists" + suffix, n,
+            nullptr, [fuser, lists]() {
+                CandidateList fused;
+                for (const auto &set : *lists) {
+                    fused.clear();
+                    const ReturnStatus rs = fuser->fuseCandidateLists(set,
+                        fused);
+                    if (rs.code != ReturnCode::Success)
+                        return (rs);
+                }
+                return (ReturnStatus(ReturnCode::Success)); }});
+    }
+    {
+        std::mt19937_64 rng(2020);
+        const size_t n = std::max<size_t>(1, scale.batch / 10);
+        auto sets = std::make_shared<std::vector<std::vector<Template>>>(n);
+        for (auto &set : *sets)
+            for (size_t k = 0; k < K; k++)
+                set.push_back(randomTemplate(scale.dimension, rng));
+        auto fuser = impl.fuse;
+        list.push_back(Workload{"fuseTemplates" + suffix, n,
+            nullptr, [fuser, sets]() {
+                Template fused;
+                for (const auto &set : *sets) {
+                    const ReturnStatus rs = fuser->fuseTemplates(set, fused);
+                    if (rs.code != ReturnCode::Success)
+                        return (rs);
+                }
+                return (ReturnStatus(ReturnCode::Success)); }});
+    }
+    {
+        std::mt19937_64 rng(2021);
+        const size_t n = std::max<size_t>(1, scale.batch / 10);
+        auto pairs = std::make_shared<std::vector<Template>>();
+        for (size_t i = 0; i < 2 * n; i++)
+            pairs->push_back(randomTemplate(scale.dimension, rng));
+        auto verifier = impl.verify;
+        list.push_back(Workload{"verify" + suffix, n, nullptr,
+            [verifier, pairs]() {
+                double score;
+                for (size_t i = 0; i + 1 < pairs->size(); i += 2) {
+                    const ReturnStatus rs = verifier->verify((*pairs)[i],
+                        (*pairs)[i + 1], score);
+                    if (rs.code != ReturnCode::Success)
+                        return (rs);
+                }
+                return (ReturnStatus(ReturnCode::Success)); }});
+    }
+    {
+        std::mt19937_64 rng(2022);
+        auto templates = std::make_shared<std::vector<Template>>();
+        auto ids = std::make_shared<std::vector<uint32_t>>();
+        for (size_t i = 0; i < scale.gallery; i++) {
+            templates->push_back(randomTemplate(scale.dimension, rng));
+            ids->push_back(static_cast<uint32_t>(i));
+        }
+        /* Probes are gallery templates plus noise, as in kernel_bench */
+        std::normal_distribution<double> normal;
+        auto probes = std::make_shared<std::vector<Template>>(20);
+        for (size_t p = 0; p < probes->size(); p++) {
+            (*probes)[p] = (*templates)[(p * 7919) % templates->size()];
+            for (auto &v : (*probes)[p])
+                v += 0.3 * normal(rng);
+        }
+        auto identifier = impl.identify;
+        const std::function<ReturnStatus()> build =
+            [identifier, templates, ids]() {
+                return (identifier->createGallery(*templates, *ids)); };
+        list.push_back(Workload{"createGallery" + suffix, 1, nullptr,
+            build});
+        list.push_back(Workload{"search" + suffix, probes->size(), build,
+            [identifier, probes, L]() {
+                CandidateList candidates;
+                for (const auto &p : *probes) {
+                    candidates.assign(L, Candidate());
+                    const ReturnStatus rs = identifier->search(p,
+                        candidates);
+                    if (rs.code != ReturnCode::Success)
+                        return (rs);
+                }
+                return (ReturnStatus(ReturnCode::Success)); }});
+    }
+    return (list);
+}
+
+/* Time repetitions of a workload after setup and one untimed run */
+bool
+measure(
+    const Workload &workload,
+    size_t repeats,
+    std::vector<double> &seconds)
+{
+    if (workload.setup && !check(workload.name, workload.setup()))
+        return (false);
+    if (!check(workload.name, workload.run()))
+        return (false);
+    seconds.clear();
+    for (size_t r = 0; r < repeats; r++) {
+        const auto start = std::chrono::steady_clock::now();
+        const ReturnStatus rs = workload.run();
+        const double elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        if (!check(workload.name, rs))
+            return (false);
+        seconds.push_back(elapsed / static_cast<double>(workload.calls));
+    }
+    return (true);
+}
+
+bool
+writeTimings(
+    const std::string &path,
+    const Timings &timings)
+{
+    std::ofstream out(path);
+    out << "FOFRA2018 performance baseline\nversion " << BaselineVersion <<
+        "\n" << std::setprecision(9);
+    for (const auto &t : timings) {
+        out << t.first << " " << t.second.size();
+        for (const auto s : t.second)
+            out << " " << s;
+        out << "\n";
+    }
+    out.close();
+    return (!out.fail());
+}
+
+ReturnStatus
+readTimings(
+    const std::string &path,
+    Timings &timings)
+{
+    std::ifstream in(path);
+    if (!in)
+        return (ReturnStatus(ReturnCode::InputLocationError, path));
+    std::string title, word;
+    uint32_t version = 0;
+    std::getline(in, title);
+    in >> word >> version;
+    if (title != "FOFRA2018 performance baseline" || word != "version")
+        return (ReturnStatus(ReturnCode::ParseError, path +
+            ": not a baseline file"));
+    if (version != BaselineVersion)
+        return (ReturnStatus(ReturnCode::ParseError, path +
+            ": baseline version " + std::to_string(version) +
+            ", expected " + std::to_string(BaselineVersion)));
+    timings.clear();
+    std::string name;
+    size_t n;
+    while (in >> name >> n) {
+        std::vector<double> &seconds = timings[name];
+        seconds.resize(n);
+        for (auto &s : seconds)
+            if (!(in >> s))
+                return (ReturnStatus(ReturnCode::ParseError, path + ": " +
+                    name));
+    }
+    if (!in.eof())
+        return (ReturnStatus(ReturnCode::ParseError, path));
+    return (ReturnStatus(ReturnCode::Success));
+}
+
+double
+median(
+    std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    const size_t n = v.size();
+    return (n % 2 == 1 ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]));
+}
+
+/*
+ * Percentile bootstrap interval for median(current) / median(baseline),
+ * resampling each set of repetitions independently.  Medians are used
+ * because timings are skewed by the occasional interrupted repetition.
+ */
+void
+ratioInterval(
+    const std::vector<double> &baseline,
+    const std::vector<double> &current,
+    double level,
+    double &lower,
+    double &upper)
+{
+    const size_t B = 2000;
+    std::mt19937_64 rng(2018);
+    std::vector<double> ratios(B), a(baseline.size()), b(current.size());
+    std::uniform_int_distribution<size_t> pickA(0, baseline.size() - 1);
+    std::uniform_int_distribution<size_t> pickB(0, current.size() - 1);
+    for (auto &r : ratios) {
+        for (auto &x : a)
+            x = baseline[pickA(rng)];
+        for (auto &x : b)
+            x = current[pickB(rng)];
+        r = median(b) / median(a);
+    }
+    std::sort(ratios.begin(), ratios.end());
+    const double tail = 0.5 * (1.0 - level);
+    lower = ratios[static_cast<size_t>(tail * (B - 1))];
+    upper = ratios[static_cast<size_t>((1.0 - tail) * (B - 1) + 0.5)];
+}
+}
+
+int
+main(
+    int argc,
+    char *argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return (EXIT_FAILURE);
+    }
+
+    Timings baseline;
+    if (options.compare && !check("read baseline",
+        readTimings(options.baseline, baseline)))
+        return (EXIT_FAILURE);
+
+    Implementations impl;
+    if (!initialize(options.configDir, impl))
+        return (EXIT_FAILURE);
+
+    Timings timings;
+    size_t regressions = 0;
+    std::cout << std::left << std::setw(40) << "workload" << std::right <<
+        std::setw(14) << "median us" << (options.compare ?
+        "   ratio  interval" : "") << "\n";
+    for (const auto &scale : Scales) {
+        if (std::find(options.scales.begin(), options.scales.end(),
+            scale.name) == options.scales.end())
+            continue;
+        for (const auto &w : workloads(scale, impl)) {
+            if (w.name.compare(0, options.only.size(), options.only) != 0)
+                continue;
+            std::vector<double> &seconds = timings[w.name];
+            if (!measure(w, options.repeats, seconds))
+                return (EXIT_FAILURE);
+
+            std::cout << std::left << std::setw(40) << w.name <<
+                std::right << std::fixed << std::setprecision(3) <<
+                std::setw(14) << 1e6 * median(seconds);
+            const auto base = baseline.find(w.name);
+            if (options.compare && base == baseline.end())
+                std::cout << "   not in baseline";
+            else if (options.compare) {
+                double lower, upper;
+                ratioInterval(base->second, seconds, options.level, lower,
+                    upper);
+                std::cout << std::setw(8) << std::setprecision(3) <<
+                    median(seconds) / median(base->second) << "  [" <<
+                    lower << ", " << upper << "]";
+                if (lower > 1.0 + options.tolerance) {
+                    std::cout << "  REGRESSION";
+                    regressions++;
+                } else if (upper < 1.0 - options.tolerance)
+                    std::cout << "  faster";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    const std::string output = options.compare ? options.output :
+        options.baseline;
+    if (!output.empty() && !writeTimings(output, timings)) {
+        std::cerr << output << ": write failed" << std::endl;
+        return (EXIT_FAILURE);
+    }
+    if (regressions != 0) {
+        std::cout << std::defaultfloat << regressions << " workload(s) "
+            "slower than the baseline beyond " << 100 * options.tolerance <<
+            "% at " <<
+            100 * options.level << "% confidence" << std::endl;
+        return (EXIT_FAILURE);
+    }
+    return (EXIT_SUCCESS);
+}
@@ -0,0 +1,427 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_PROGRESSIVE_H_
+#define FOFRA2018_PROGRESSIVE_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "fofra2018.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * Coarse-to-fine verification of templates whose dimensions are in
+ * decreasing order of importance, such as the output of ProjectionModel.
+ *
+ * @details
+ * The L1 distance of a prefix of the templates is compared with
+ * calibrated bounds after each stage: at or below accept, the pair is
+ * accepted; otherwise, at or above reject, it is rejected; in between,
+ * the next stage is compared.  Only pairs in the uncertain band pay for
+ * the whole template.  The bounds are calibrated for one similarity
+ * threshold, so that FMR and FNMR at that threshold stay within a
+ * tolerance of those of the full templates.  The model is stored in
+ * ProgressiveModel::FileName in an Action::Verify model directory, in
+ * host byte order.
+ */
+struct ProgressiveModel {
+    /** @brief One prefix and its bounds, on the L1 distance */
+    struct Stage {
+        /** @brief Dimensions compared by the end of the stage */
+        uint64_t dimensions;
+        /** @brief Accept if the prefix distance is at most this */
+        double accept;
+        /** @brief Reject if the prefix distance is at least this */
+        double reject;
+        /** @brief Median fraction of the full distance in the prefix */
+        double share;
+    };
+
+    /** @brief Similarity threshold the bounds are calibrated for */
+    double threshold;
+    /** @brief Stages in increasing order of dimensions */
+    std::vector<Stage> stages;
+
+    static constexpr const char *FileName = "progressive.bin";
+    static constexpr const char *Magic = "FOFRAPRG";
+    static constexpr uint32_t Version = 1;
+
+    ProgressiveModel() :
+        threshold{0.0}
+        {}
+
+    /**
+     * @brief
+     * Write the model to FileName in a model directory, replacing any
+     * previous model atomically.
+     */
+    ReturnStatus
+    write(
+        const std::string &directory) const
+    {
+        const std::string path = directory + "/" + FileName;
+        const std::string temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            const uint32_t version = Version;
+            const uint32_t reserved = 0;
+            const uint64_t n = this->stages.size();
+            out.write(Magic, 8);
+            put(out, &version, 1);
+            put(out, &reserved, 1);
+            put(out, &this->threshold, 1);
+            put(out, &n, 1);
+            put(out, this->stages.data(), n);
+            if (!out.flush())
+                return (ReturnStatus(ReturnCode::VendorError,
+                    temporary + ": write failed"));
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0)
+            return (ReturnStatus(ReturnCode::VendorError,
+                path + ": " + std::strerror(errno)));
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /** @brief Read the model from FileName in a model directory. */
+    ReturnStatus
+    read(
+        const std::string &directory)
+    {
+        const std::string path = directory + "/" + FileName;
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return (ReturnStatus(ReturnCode::ConfigError, path));
+
+        char magic[8];
+        uint32_t version, reserved;
+        uint64_t n;
+        in.read(magic, sizeof(magic));
+        if (!get(in, &version, 1) || !get(in, &reserved, 1) ||
+            !get(in, &this->threshold, 1) || !get(in, &n, 1) ||
+            std::memcmp(magic, Magic, sizeof(magic)) != 0 ||
+            version != Version || !(this->threshold > 0.0) || n > 64)
+            return (ReturnStatus(ReturnCode::ConfigError,
+                path + ": not a progressive verification model"));
+
+        this->stages.resize(n);
+        if (!get(in, this->stages.data(), n))
+            return (ReturnStatus(ReturnCode::ConfigError,
+                path + ": truncated"));
+        for (size_t j = 1; j < n; j++)
+            if (this->stages[j].dimensions <= this->stages[j - 1].dimensions)
+                return (ReturnStatus(ReturnCode::ConfigError,
+                    path + ": stages out of order"));
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+private:
+    template<typename T>
+    static void
+    put(
+        std::ostream &out,
+        const T *values,
+        size_t n)
+    {
+        out.write(reinterpret_cast<const char*>(values),
+            static_cast<std::streamsize>(n * sizeof(T)));
+    }
+
+    template<typename T>
+    static bool
+    get(
+        std::istream &in,
+        T *values,
+        size_t n)
+    {
+        return (static_cast<bool>(in.read(reinterpret_cast<char*>(values),
+            static_cast<std::streamsize>(n * sizeof(T)))));
+    }
+};
+using ProgressiveModel = struct ProgressiveModel;
+
+namespace Progressive {
+
+/* L1 distance of values [first, last), in independent lanes */
+inline double
+l1Distance(
+    const double *a,
+    const double *b,
+    size_t first,
+    size_t last)
+{
+    constexpr size_t Lanes = 8;
+    double partial[Lanes] = {};
+    const size_t n = last - first;
+    a += first;
+    b += first;
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+        for (size_t j = 0; j < Lanes; j++)
+            partial[j] += std::fabs(a[i + j] - b[i + j]);
+    for (; i < n; i++)
+        partial[0] += std::fabs(a[i] - b[i]);
+
+    double distance = 0.0;
+    for (size_t j = 0; j < Lanes; j++)
+        distance += partial[j];
+    return (distance);
+}
+
+/* The L1 distance at which l1Similarity() equals threshold */
+inline double
+thresholdDistance(
+    double threshold)
+{
+    return (100.0 / threshold - 1.0);
+}
+}
+
+/**
+ * @brief
+ * Compare two fused templates as l1Similarity(), stopping early when a
+ * prefix decides the comparison.
+ *
+ * @details
+ * A comparison decided early returns the similarity of the prefix
+ * distance scaled up by the stage's share, kept on the side of the
+ * model's threshold that was decided, so that thresholding the score at
+ * model.threshold gives the early decision.  Otherwise the score is
+ * l1Similarity() of the full templates, up to the order of the additions.
+ *
+ * @param[in] model
+ * Stages and bounds
+ * @param[in] enroll, authentication
+ * Fused templates of the same dimension
+ * @param[out] score
+ * Similarity score
+ * @param[out] compared
+ * Number of dimensions compared, if not nullptr
+ */
+inline ReturnStatus
+verifyProgressive(
+    const ProgressiveModel &model,
+    const Template &enroll,
+    const Template &authentication,
+    double &score,
+    size_t *compared = nullptr)
+{
+    const size_t D = enroll.size();
+    if (authentication.size() != D)
+        return (ReturnStatus(ReturnCode::NonCongruentVectors,
+            "templates differ in dimension"));
+
+    const double *a = enroll.data(), *b = authentication.data();
+    double distance = 0.0;
+    size_t done = 0;
+    for (const auto &stage : model.stages) {
+        if (stage.dimensions >= D)
+            break;
+        const size_t end = static_cast<size_t>(stage.dimensions);
+        distance += Progressive::l1Distance(a, b, done, end);
+        done = end;
+        const bool accept = (distance <= stage.accept);
+        if (accept || distance >= stage.reject) {
+            const double estimate = 100.0 / (1.0 + distance / stage.share);
+            score = accept ? std::max(estimate, model.threshold) :
+                std::min(estimate, std::nextafter(model.threshold, 0.0));
+            if (compared != nullptr)
+                *compared = done;
+            return (ReturnStatus(ReturnCode::Success));
+        }
+    }
+    distance += Progressive::l1Distance(a, b, done, D);
+    score = 100.0 / (1.0 + distance);
+    if (compared != nullptr)
+        *compared = D;
+    return (ReturnStatus(ReturnCode::Success));
+}
+
+/**
+ * @brief
+ * Calibrate a ProgressiveModel on labelled development pairs of fused
+ * templates.
+ *
+ * @details
+ * The bounds bound the error rates at threshold, not the number of
+ * decisions changed.  Early accepts of non-mates that the full templates
+ * reject add false matches, and early rejects of mates that they accept
+ * add false non-matches.  Over all stages together, on the training
+ * pairs, each adds at most tolerance times the full templates' own false
+ * matches and false non-matches, so that FMR and FNMR at threshold are at
+ * most (1 + tolerance) times those of the full templates.  The budget is
+ * shared out evenly over the stages, each stage spending what earlier
+ * stages left, and only on the pairs earlier stages did not decide.
+ * Bounds never reach past the prefix distances of the training pairs.
+ * The pairs should be representative of those to be verified, with
+ * enough false matches at threshold for the budget to be meaningful.
+ *
+ * @param[in] enroll, authentication
+ * P fused templates each; enroll[i] is compared with authentication[i]
+ * @param[in] genuine
+ * true where enroll[i] and authentication[i] are mates
+ * @param[in] threshold
+ * Similarity threshold of the decision, > 0
+ * @param[in] prefixes
+ * Dimensions compared by the end of each stage, increasing
+ * @param[in] tolerance
+ * Largest relative increase in FMR and in FNMR at threshold, ≥ 0
+ * @param[out] model
+ * Progressive verification model
+ */
+inline ReturnStatus
+trainProgressive(
+    const std::vector<Template> &enroll,
+    const std::vector<Template> &authentication,
+    const std::vector<bool> &genuine,
+    double threshold,
+    const std::vector<size_t> &prefixes,
+    double tolerance,
+    ProgressiveModel &model)
+{
+    const size_t P = enroll.size();
+    if (authentication.size() != P || genuine.size() != P)
+        return (ReturnStatus(ReturnCode::NonCongruentVectors,
+            "need one authentication template and label per pair"));
+    if (P == 0 || !(threshold > 0.0) || !(tolerance >= 0.0))
+        return (ReturnStatus(ReturnCode::NumDataError,
+            "need pairs, threshold > 0 and tolerance >= 0"));
+    for (size_t j = 0; j < prefixes.size(); j++)
+        if (prefixes[j] == 0 || (j > 0 && prefixes[j] <= prefixes[j - 1]))
+            return (ReturnStatus(ReturnCode::NumDataError,
+                "prefixes must increase"));
+    for (size_t i = 0; i < P; i++)
+        if (enroll[i].size() != authentication[i].size() ||
+            enroll[i].size() < (prefixes.empty() ? 0 : prefixes.back()))
+            return (ReturnStatus(ReturnCode::NonCongruentVectors,
+                "templates shorter than the longest prefix"));
+
+    /* Prefix distances of each pair, stage-major, and full distances */
+    const size_t S = prefixes.size();
+    std::vector<double> partial(S * P), full(P);
+    for (size_t i = 0; i < P; i++) {
+        const double *a = enroll[i].data(), *b = authentication[i].data();
+        double distance = 0.0;
+        size_t done = 0;
+        for (size_t j = 0; j < S; j++) {
+            distance += Progressive::l1Distance(a, b, done, prefixes[j]);
+            done = prefixes[j];
+            partial[j * P + i] = distance;
+        }
+        full[i] = distance + Progressive::l1Distance(a, b, done,
+            enroll[i].size());
+    }
+
+    /* Errors of the full templates set the budgets */
+    const double limit = Progressive::thresholdDistance(threshold);
+    double falseMatches = 0.0, falseNonMatches = 0.0;
+    for (size_t i = 0; i < P; i++) {
+        if (!genuine[i] && full[i] <= limit)
+            falseMatches += 1.0;
+        if (genuine[i] && full[i] > limit)
+            falseNonMatches += 1.0;
+    }
+    const double matchBudget = std::floor(tolerance * falseMatches);
+    const double nonMatchBudget = std::floor(tolerance * falseNonMatches);
+
+    const double infinity = std::numeric_limits<double>::infinity();
+    const double exact = std::nextafter(limit, infinity);
+    model = ProgressiveModel();
+    model.threshold = threshold;
+    std::vector<uint8_t> undecided(P, 1);
+    std::vector<double> wrongAccept, wrongReject, shares;
+    size_t matchSpent = 0, nonMatchSpent = 0;
+    for (size_t j = 0; j < S; j++) {
+        /* Only pairs no earlier stage decided can change decision */
+        wrongAccept.clear();
+        wrongReject.clear();
+        shares.clear();
+        for (size_t i = 0; i < P; i++) {
+            const double d = partial[j * P + i];
+            if (full[i] > 0.0)
+                shares.push_back(d / full[i]);
+            if (!undecided[i])
+                continue;
+            if (!genuine[i] && full[i] > limit)
+                wrongAccept.push_back(d);
+            if (genuine[i] && full[i] <= limit)
+                wrongReject.push_back(d);
+        }
+        const double fraction = static_cast<double>(j + 1) /
+            static_cast<double>(S);
+        const size_t matchAllowed = static_cast<size_t>(
+            std::floor(matchBudget * fraction)) - matchSpent;
+        const size_t nonMatchAllowed = static_cast<size_t>(
+            std::floor(nonMatchBudget * fraction)) - nonMatchSpent;
+
+        ProgressiveModel::Stage stage;
+        stage.dimensions = prefixes[j];
+
+        /* Below the (m+1)-th lowest prefix of a would-be false match */
+        stage.accept = -infinity;
+        if (!wrongAccept.empty()) {
+            std::sort(wrongAccept.begin(), wrongAccept.end());
+            stage.accept = (matchAllowed < wrongAccept.size()) ?
+                std::nextafter(wrongAccept[matchAllowed], -infinity) :
+                wrongAccept.back();
+            stage.accept = std::min(stage.accept, limit);
+        }
+
+        /* Above the (m+1)-th highest prefix of a would-be false non-match */
+        stage.reject = exact;
+        if (!wrongReject.empty()) {
+            std::sort(wrongReject.begin(), wrongReject.end(),
+                std::greater<double>());
+            stage.reject = (nonMatchAllowed < wrongReject.size()) ?
+                std::nextafter(wrongReject[nonMatchAllowed], infinity) :
+                wrongReject.back();
+            stage.reject = std::min(stage.reject, exact);
+        }
+
+        /* Decide as verifyProgressive() would, and charge the budgets */
+        for (size_t i = 0; i < P; i++) {
+            if (!undecided[i])
+                continue;
+            const double d = partial[j * P + i];
+            const bool accept = (d <= stage.accept);
+            if (!accept && d < stage.reject)
+                continue;
+            undecided[i] = 0;
+            if (accept && !genuine[i] && full[i] > limit)
+                matchSpent++;
+            if (!accept && genuine[i] && full[i] <= limit)
+                nonMatchSpent++;
+        }
+
+        stage.share = 1.0;
+        if (!shares.empty()) {
+            std::nth_element(shares.begin(), shares.begin() +
+                shares.size() / 2, shares.end());
+            stage.share = std::max(shares[shares.size() / 2],
+                std::numeric_limits<double>::min());
+        }
+        model.stages.push_back(stage);
+    }
+    return (ReturnStatus(ReturnCode::Success));
+}
+}
+
+#endif /* FOFRA2018_PROGRESSIVE_H_ */
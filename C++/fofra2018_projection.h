@@ -0,0 +1,579 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_PROJECTION_H_
+#define FOFRA2018_PROJECTION_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_threads.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * Template-level fusion by linear projection: the K input templates are
+ * concatenated, centred and projected onto principal components,
+ * optionally whitened.
+ *
+ * @details
+ * Output dimensions are in decreasing order of training variance.  The
+ * model is stored in ProjectionModel::FileName in an Action::Fuse model
+ * directory, in host byte order.
+ */
+struct ProjectionModel {
+    /** @brief Dimension of each of the K input templates */
+    std::vector<uint64_t> inputDimensions;
+    /** @brief Mean of the D = sum(inputDimensions) concatenated values */
+    std::vector<double> mean;
+    /** @brief Training variance along each of the k components */
+    std::vector<double> variances;
+    /** @brief k x D row-major projection, scaled if whitened */
+    std::vector<double> components;
+    /** @brief true if each component is scaled to unit variance */
+    bool whitened;
+
+    static constexpr const char *FileName = "projection.bin";
+    static constexpr const char *Magic = "FOFRAPRJ";
+    static constexpr uint32_t Version = 1;
+
+    ProjectionModel() :
+        whitened{false}
+        {}
+
+    /** @brief Return the concatenated input dimension, D. */
+    size_t
+    inputDimension() const
+    {
+        return (this->mean.size());
+    }
+
+    /** @brief Return the fused template dimension, k. */
+    size_t
+    outputDimension() const
+    {
+        return (this->variances.size());
+    }
+
+    /**
+     * @brief
+     * Fuse K templates, as TemplateFuserInterface::fuseTemplates().
+     *
+     * @param[in] inputTemplates
+     * K templates of the model's input dimensions, in model order
+     * @param[out] fusedTemplate
+     * Projected template of outputDimension() values
+     */
+    ReturnStatus
+    project(
+        const std::vector<Template> &inputTemplates,
+        Template &fusedTemplate) const
+    {
+        if (inputTemplates.size() != this->inputDimensions.size())
+            return (ReturnStatus(ReturnCode::NumDataError,
+                "unexpected number of input templates"));
+        std::vector<double> centred;
+        centred.reserve(this->inputDimension());
+        for (size_t k = 0; k < inputTemplates.size(); k++) {
+            if (inputTemplates[k].size() != this->inputDimensions[k])
+                return (ReturnStatus(ReturnCode::NonCongruentVectors,
+                    "input template has unexpected dimension"));
+            for (const auto v : inputTemplates[k])
+                centred.push_back(v - this->mean[centred.size()]);
+        }
+
+        const size_t D = this->inputDimension();
+        fusedTemplate.assign(this->outputDimension(), 0.0);
+        for (size_t j = 0; j < fusedTemplate.size(); j++) {
+            const double *c = &this->components[j * D];
+            double sum = 0.0;
+            for (size_t i = 0; i < D; i++)
+                sum += c[i] * centred[i];
+            fusedTemplate[j] = sum;
+        }
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /**
+     * @brief
+     * Write the model to FileName in a model directory, replacing any
+     * previous model atomically.
+     */
+    ReturnStatus
+    write(
+        const std::string &directory) const
+    {
+        const std::string path = directory + "/" + FileName;
+        const std::string temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            const uint32_t version = Version;
+            const uint32_t whiten = this->whitened ? 1 : 0;
+            const uint64_t K = this->inputDimensions.size();
+            const uint64_t D = this->inputDimension();
+            const uint64_t k = this->outputDimension();
+            out.write(Magic, 8);
+            put(out, &version, 1);
+            put(out, &whiten, 1);
+            put(out, &K, 1);
+            put(out, &D, 1);
+            put(out, &k, 1);
+            put(out, this->inputDimensions.data(), K);
+            put(out, this->mean.data(), D);
+            put(out, this->variances.data(), k);
+            put(out, this->components.data(), k * D);
+            if (!out.flush())
+                return (ReturnStatus(ReturnCode::VendorError,
+                    temporary + ": write failed"));
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0)
+            return (ReturnStatus(ReturnCode::VendorError,
+                path + ": " + std::strerror(errno)));
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /** @brief Read the model from FileName in a model directory. */
+    ReturnStatus
+    read(
+        const std::string &directory)
+    {
+        const std::string path = directory + "/" + FileName;
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return (ReturnStatus(ReturnCode::ConfigError, path));
+
+        char magic[8];
+        uint32_t version, whiten;
+        uint64_t K, D, k;
+        in.read(magic, sizeof(magic));
+        if (!get(in, &version, 1) || !get(in, &whiten, 1) ||
+            !get(in, &K, 1) || !get(in, &D, 1) || !get(in, &k, 1) ||
+            std::memcmp(magic, Magic, sizeof(magic)) != 0 ||
+            version != Version || k > D || D > (UINT64_C(1) << 24) ||
+            K > D)
+            return (ReturnStatus(ReturnCode::ConfigError,
+                path + ": not a projection model"));
+
+        this->inputDimensions.resize(K);
+        this->mean.resize(D);
+        this->variances.resize(k);
+        this->components.resize(k * D);
+        this->whitened = (whiten != 0);
+        if (!get(in, this->inputDimensions.data(), K) ||
+            !get(in, this->mean.data(), D) ||
+            !get(in, this->variances.data(), k) ||
+            !get(in, this->components.data(), k * D) ||
+            std::accumulate(this->inputDimensions.begin(),
+            this->inputDimensions.end(), UINT64_C(0)) != D)
+            return (ReturnStatus(ReturnCode::ConfigError,
+                path + ": truncated or inconsistent"));
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+private:
+    template<typename T>
+    static void
+    put(
+        std::ostream &out,
+        const T *values,
+        size_t n)
+    {
+        out.write(reinterpret_cast<const char*>(values),
+            static_cast<std::streamsize>(n * sizeof(T)));
+    }
+
+    template<typename T>
+    static bool
+    get(
+        std::istream &in,
+        T *values,
+        size_t n)
+    {
+        return (static_cast<bool>(in.read(reinterpret_cast<char*>(values),
+            static_cast<std::streamsize>(n * sizeof(T)))));
+    }
+};
+using ProjectionModel = struct ProjectionModel;
+
+/**
+ * @brief
+ * Training rows for trainProjection(), read in blocks so the data need
+ * not fit in memory.  read() is called concurrently from several threads.
+ */
+class RowSource {
+public:
+    virtual ~RowSource() {}
+
+    /** @brief Return the number of rows, N. */
+    virtual size_t
+    rows() const = 0;
+
+    /** @brief Return the length of each row, D. */
+    virtual size_t
+    dimension() const = 0;
+
+    /** @brief Copy count rows from first into out, row-major. */
+    virtual void
+    read(
+        size_t first,
+        size_t count,
+        double *out) const = 0;
+};
+
+/** @brief Parameters of trainProjection() */
+struct ProjectionTraining {
+    /** @brief Number of components to keep, k */
+    size_t components;
+    /** @brief Extra random directions for accuracy, p */
+    size_t oversample;
+    /** @brief Power iterations, q ≥ 1, for slowly decaying spectra */
+    size_t powerIterations;
+    /** @brief Scale components to unit training variance */
+    bool whiten;
+    /** @brief Rows per block read from the source */
+    size_t blockRows;
+    /** @brief Seed of the random test matrix */
+    uint64_t seed;
+
+    ProjectionTraining() :
+        components{0},
+        oversample{10},
+        powerIterations{2},
+        whiten{false},
+        blockRows{4096},
+        seed{2018}
+        {}
+};
+using ProjectionTraining = struct ProjectionTraining;
+
+namespace Projection {
+
+/*
+ * One pass over the source: each of the pool's threads takes a contiguous
+ * stripe of rows, reads it in blocks and calls block(stripe, rows, count)
+ * with centred rows (when mean is non-empty).  Callers keep one
+ * accumulator per stripe and reduce them afterwards.
+ */
+inline void
+streamPass(
+    const RowSource &source,
+    size_t blockRows,
+    const std::vector<double> &mean,
+    WorkerPool &pool,
+    const std::function<void(size_t, const double*, size_t)> &block)
+{
+    const size_t N = source.rows(), D = source.dimension();
+    const size_t stripes = pool.size();
+    pool.parallelFor(stripes, 1, [&](size_t begin, size_t end) {
+        std::vector<double> rows(blockRows * D);
+        for (size_t s = begin; s < end; s++) {
+            const size_t first = N * s / stripes, last = N * (s + 1) / stripes;
+            for (size_t r = first; r < last; r += blockRows) {
+                const size_t count = std::min(blockRows, last - r);
+                source.read(r, count, rows.data());
+                if (!mean.empty())
+                    for (size_t i = 0; i < count; i++)
+                        for (size_t j = 0; j < D; j++)
+                            rows[i * D + j] -= mean[j];
+                block(s, rows.data(), count);
+            }
+        }
+    });
+}
+
+/* W = X Q for a block: X is n x D, Q is D x l, W is n x l */
+inline void
+multiply(
+    const double *X,
+    size_t n,
+    size_t D,
+    const std::vector<double> &Q,
+    size_t l,
+    std::vector<double> &W)
+{
+    W.assign(n * l, 0.0);
+    for (size_t r = 0; r < n; r++) {
+        double *w = &W[r * l];
+        for (size_t i = 0; i < D; i++) {
+            const double x = X[r * D + i];
+            const double *q = &Q[i * l];
+            for (size_t j = 0; j < l; j++)
+                w[j] += x * q[j];
+        }
+    }
+}
+
+/*
+ * Orthonormalize the l columns of the D x l row-major matrix A in place
+ * by modified Gram-Schmidt, applied twice for stability.  A column that
+ * vanishes is replaced by a random one.
+ */
+inline void
+orthonormalize(
+    std::vector<double> &A,
+    size_t D,
+    size_t l,
+    std::mt19937_64 &rng)
+{
+    std::normal_distribution<double> normal;
+    for (size_t j = 0; j < l; j++) {
+        for (int attempt = 0; ; attempt++) {
+            double before = 0.0;
+            for (size_t i = 0; i < D; i++)
+                before += A[i * l + j] * A[i * l + j];
+            for (int pass = 0; pass < 2; pass++)
+                for (size_t p = 0; p < j; p++) {
+                    double dot = 0.0;
+                    for (size_t i = 0; i < D; i++)
+                        dot += A[i * l + p] * A[i * l + j];
+                    for (size_t i = 0; i < D; i++)
+                        A[i * l + j] -= dot * A[i * l + p];
+                }
+            double norm = 0.0;
+            for (size_t i = 0; i < D; i++)
+                norm += A[i * l + j] * A[i * l + j];
+            if (norm > 1e-20 * before && norm > 0.0) {
+                norm = 1.0 / std::sqrt(norm);
+                for (size_t i = 0; i < D; i++)
+                    A[i * l + j] *= norm;
+                break;
+            }
+            for (size_t i = 0; i < D; i++)
+                A[i * l + j] = normal(rng);
+        }
+    }
+}
+
+/*
+ * Eigen-decompose the symmetric l x l matrix B by cyclic Jacobi rotations.
+ * On return B's diagonal holds the eigenvalues and the columns of V the
+ * eigenvectors.
+ */
+inline void
+symmetricEigen(
+    std::vector<double> &B,
+    size_t l,
+    std::vector<double> &V)
+{
+    V.assign(l * l, 0.0);
+    for (size_t i = 0; i < l; i++)
+        V[i * l + i] = 1.0;
+
+    for (int sweep = 0; sweep < 100; sweep++) {
+        double off = 0.0, total = 0.0;
+        for (size_t p = 0; p < l; p++)
+            for (size_t q = 0; q < l; q++) {
+                total += B[p * l + q] * B[p * l + q];
+                if (p != q)
+                    off += B[p * l + q] * B[p * l + q];
+            }
+        if (off <= 1e-30 * total)
+            return;
+
+        for (size_t p = 0; p + 1 < l; p++)
+            for (size_t q = p + 1; q < l; q++) {
+                const double bpq = B[p * l + q];
+                if (bpq == 0.0)
+                    continue;
+                const double theta = (B[q * l + q] - B[p * l + p]) /
+                    (2.0 * bpq);
+                const double t = (theta >= 0.0 ? 1.0 : -1.0) /
+                    (std::fabs(theta) + std::sqrt(theta * theta + 1.0));
+                const double c = 1.0 / std::sqrt(t * t + 1.0), s = t * c;
+                for (size_t k = 0; k < l; k++) {
+                    const double bkp = B[k * l + p], bkq = B[k * l + q];
+                    B[k * l + p] = c * bkp - s * bkq;
+                    B[k * l + q] = s * bkp + c * bkq;
+                }
+                for (size_t k = 0; k < l; k++) {
+                    const double bpk = B[p * l + k], bqk = B[q * l + k];
+                    B[p * l + k] = c * bpk - s * bqk;
+                    B[q * l + k] = s * bpk + c * bqk;
+                }
+                for (size_t k = 0; k < l; k++) {
+                    const double vkp = V[k * l + p], vkq = V[k * l + q];
+                    V[k * l + p] = c * vkp - s * vkq;
+                    V[k * l + q] = s * vkp + c * vkq;
+                }
+            }
+    }
+}
+}
+
+/**
+ * @brief
+ * Fit a ProjectionModel by randomized PCA (Halko, Martinsson and Tropp)
+ * over training rows that need not fit in memory.
+ *
+ * @details
+ * The rows are streamed 2 + q times: once for the mean, q times to
+ * compute C Q for the centred covariance C and an orthonormal basis Q of
+ * k + p directions, and once for the Rayleigh quotient Q' C Q, whose
+ * eigenvectors give the components.  No pass stores anything the size of
+ * the data; each thread keeps a D x (k + p) accumulator.  The cost of a
+ * pass is about 4 N D (k + p) flops, spread over the pool.
+ *
+ * @param[in] source
+ * N training rows, each the concatenation of K templates
+ * @param[in] inputDimensions
+ * Dimension of each of the K templates, summing to D
+ * @param[in] parameters
+ * Training parameters
+ * @param[in] pool
+ * Threads to train on
+ * @param[out] model
+ * Fitted projection
+ */
+inline ReturnStatus
+trainProjection(
+    const RowSource &source,
+    const std::vector<uint64_t> &inputDimensions,
+    const ProjectionTraining &parameters,
+    WorkerPool &pool,
+    ProjectionModel &model)
+{
+    const size_t N = source.rows(), D = source.dimension();
+    const size_t k = parameters.components;
+    if (std::accumulate(inputDimensions.begin(), inputDimensions.end(),
+        UINT64_C(0)) != D)
+        return (ReturnStatus(ReturnCode::NonCongruentVectors,
+            "input dimensions do not sum to the row length"));
+    if (k == 0 || k > D || N < 2)
+        return (ReturnStatus(ReturnCode::NumDataError,
+            "need 0 < components <= D and at least two rows"));
+    if (parameters.powerIterations == 0 || parameters.blockRows == 0)
+        return (ReturnStatus(ReturnCode::ConfigError,
+            "need at least one power iteration and one row per block"));
+
+    const size_t l = std::min(D, k + parameters.oversample);
+    const size_t stripes = pool.size();
+    const std::vector<double> none;
+
+    /* Pass 1: mean */
+    std::vector<std::vector<double>> sums(stripes,
+        std::vector<double>(D, 0.0));
+    Projection::streamPass(source, parameters.blockRows, none, pool,
+        [&](size_t s, const double *rows, size_t n) {
+            for (size_t r = 0; r < n; r++)
+                for (size_t i = 0; i < D; i++)
+                    sums[s][i] += rows[r * D + i];
+        });
+    std::vector<double> mean(D, 0.0);
+    for (const auto &partial : sums)
+        for (size_t i = 0; i < D; i++)
+            mean[i] += partial[i];
+    for (auto &m : mean)
+        m /= static_cast<double>(N);
+
+    /* Passes 2..q+1: Q <- orth(C Q), from a Gaussian start */
+    std::mt19937_64 rng(parameters.seed);
+    std::normal_distribution<double> normal;
+    std::vector<double> Q(D * l);
+    for (auto &q : Q)
+        q = normal(rng);
+    Projection::orthonormalize(Q, D, l, rng);
+
+    std::vector<std::vector<double>> partial(stripes);
+    for (size_t iteration = 0; iteration < parameters.powerIterations;
+        iteration++) {
+        for (auto &z : partial)
+            z.assign(D * l, 0.0);
+        Projection::streamPass(source, parameters.blockRows, mean, pool,
+            [&](size_t s, const double *rows, size_t n) {
+                std::vector<double> W;
+                Projection::multiply(rows, n, D, Q, l, W);
+                std::vector<double> &Z = partial[s];
+                for (size_t r = 0; r < n; r++)
+                    for (size_t i = 0; i < D; i++) {
+                        const double x = rows[r * D + i];
+                        double *z = &Z[i * l];
+                        const double *w = &W[r * l];
+                        for (size_t j = 0; j < l; j++)
+                            z[j] += x * w[j];
+                    }
+            });
+        std::fill(Q.begin(), Q.end(), 0.0);
+        for (const auto &z : partial)
+            for (size_t i = 0; i < D * l; i++)
+                Q[i] += z[i];
+        Projection::orthonormalize(Q, D, l, rng);
+    }
+
+    /* Last pass: B = Q' C Q = sum over rows of (x Q)'(x Q) */
+    for (auto &b : partial)
+        b.assign(l * l, 0.0);
+    Projection::streamPass(source, parameters.blockRows, mean, pool,
+        [&](size_t s, const double *rows, size_t n) {
+            std::vector<double> W;
+            Projection::multiply(rows, n, D, Q, l, W);
+            std::vector<double> &G = partial[s];
+            for (size_t r = 0; r < n; r++) {
+                const double *w = &W[r * l];
+                for (size_t a = 0; a < l; a++)
+                    for (size_t b = 0; b < l; b++)
+                        G[a * l + b] += w[a] * w[b];
+            }
+        });
+    std::vector<double> B(l * l, 0.0);
+    for (const auto &g : partial)
+        for (size_t i = 0; i < l * l; i++)
+            B[i] += g[i];
+
+    std::vector<double> V;
+    Projection::symmetricEigen(B, l, V);
+    std::vector<size_t> order(l);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return (B[a * l + a] > B[b * l + b]); });
+
+    model.inputDimensions = inputDimensions;
+    model.mean = mean;
+    model.whitened = parameters.whiten;
+    model.variances.assign(k, 0.0);
+    model.components.assign(k * D, 0.0);
+    for (size_t c = 0; c < k; c++) {
+        const size_t e = order[c];
+        const double variance = std::max(0.0,
+            B[e * l + e] / static_cast<double>(N - 1));
+        model.variances[c] = variance;
+
+        /* Component = Q v_e, signed so its largest entry is positive */
+        double *u = &model.components[c * D];
+        for (size_t i = 0; i < D; i++) {
+            double sum = 0.0;
+            for (size_t j = 0; j < l; j++)
+                sum += Q[i * l + j] * V[j * l + e];
+            u[i] = sum;
+        }
+        const double *largest = std::max_element(u, u + D,
+            [](double a, double b) { return (std::fabs(a) < std::fabs(b)); });
+        const double sign = (*largest < 0.0) ? -1.0 : 1.0;
+        const double scale = parameters.whiten ?
+            sign / std::sqrt(variance + 1e-12) : sign;
+        for (size_t i = 0; i < D; i++)
+            u[i] *= scale;
+    }
+    return (ReturnStatus(ReturnCode::Success));
+}
+}
+
+#endif /* FOFRA2018_PROJECTION_H_ */
@@ -0,0 +1,452 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_PROTOCOL_H_
+#define FOFRA2018_PROTOCOL_H_
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fofra2018.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * Binary protocol spoken by fofra2018_fusion_server over a Unix domain
+ * socket.
+ *
+ * @details
+ * Every message is a frame: a 12-byte header followed by a payload.  All
+ * integers are unsigned little-endian and all scores and template values
+ * are IEEE-754 binary64, little-endian.
+ *
+ *     u32 length      bytes that follow this field (8 + payload)
+ *     u32 requestId   chosen by the client, echoed in the response
+ *     u16 opcode      one of Opcode, echoed in the response
+ *     u16 status      0 in requests; a ReturnCode in responses
+ *
+ * A client may send any number of requests without waiting.  Responses
+ * are sent as requests complete, which need not be the order they were
+ * sent in; clients match them by requestId.  A response whose status is
+ * not ReturnCode::Success carries a string (u32 n, n bytes) instead of
+ * the payload below.
+ *
+ * Each request is a batch of B items and maps onto the batch functions of
+ * the interfaces.  Payloads are built from these elements:
+ *
+ *     scores     u32 K, K f64
+ *     template   u32 D, D f64
+ *     list       u32 L, L x (u32 identity, f64 score)
+ */
+namespace Protocol {
+
+/** @brief Request types, with their request and response payloads */
+enum class Opcode : uint16_t {
+    /**
+     * ScoreFuserInterface::fuseVerificationScoreBatch()
+     * Request: u32 B, B scores.  Response: u32 B, B f64.
+     */
+    FuseVerificationScores = 1,
+    /**
+     * ScoreFuserInterface::fuseCandidateListBatch()
+     * Request: u32 B, B x (u32 K, K list).  Response: u32 B, B list.
+     */
+    FuseCandidateLists = 2,
+    /**
+     * TemplateFuserInterface::fuseTemplateBatch()
+     * Request: u32 B, B x (u32 K, K template).  Response: u32 B, B template.
+     */
+    FuseTemplates = 3,
+    /**
+     * TemplateFuserInterface::verifyBatch()
+     * Request: u32 B, B x (template enroll, template authentication).
+     * Response: u32 B, B f64.
+     */
+    Verify = 4,
+    /**
+     * TemplateFuserInterface::searchBatch()
+     * Request: u32 B, u32 L candidates per probe, B template.
+     * Response: u32 B, B list.
+     */
+    Search = 5,
+    /**
+     * Gallery replication, from a follower to a leader (see
+     * ReplicationLeader).  Request: u64 LSN the follower has applied, or
+     * UINT64_MAX until it has received a whole gallery, which the leader
+     * then streams.  No response; the leader streams Replicate frames,
+     * with requestId 0, until the connection closes.
+     */
+    Subscribe = 6,
+    /**
+     * Gallery replication, from a leader to a follower.  Payload: u32
+     * ReplicationFrame, then
+     *   Reset:  u64 LSN of the gallery that follows
+     *   Rows:   u32 B, B x (u32 identity, template)
+     *   Sealed: nothing; the rows since Reset are the gallery at its LSN
+     *   Batch:  u64 LSN of the first mutation, u32 B,
+     *           B x (u32 GalleryMutation::Type, u32 identity, template)
+     */
+    Replicate = 7
+};
+
+/** @brief Kinds of Opcode::Replicate frame */
+enum class ReplicationFrame : uint32_t {
+    Reset = 0,
+    Rows = 1,
+    Sealed = 2,
+    Batch = 3
+};
+
+/** @brief Size of the frame header in bytes */
+constexpr size_t FrameHeaderBytes = 12;
+
+/** @brief Decoded frame header */
+struct FrameHeader {
+    /** @brief Payload size in bytes (length field less 8) */
+    uint32_t payloadBytes;
+    /** @brief Client-chosen request identifier */
+    uint32_t requestId;
+    /** @brief Request type */
+    uint16_t opcode;
+    /** @brief 0 in requests, a ReturnCode in responses */
+    uint16_t status;
+};
+using FrameHeader = struct FrameHeader;
+
+/**
+ * @brief
+ * Builds one frame in a byte buffer.
+ *
+ * @details
+ * The constructor writes a placeholder header; finish() fills in the
+ * length once the payload is complete.
+ */
+class Encoder {
+public:
+    Encoder(
+        std::vector<uint8_t> &frame,
+        uint32_t requestId,
+        Opcode opcode,
+        ReturnCode status = ReturnCode::Success) :
+        frame(frame)
+    {
+        this->frame.clear();
+        this->u32(0);
+        this->u32(requestId);
+        this->u16(static_cast<uint16_t>(opcode));
+        this->u16(static_cast<uint16_t>(status));
+    }
+
+    void
+    u16(
+        uint16_t v)
+    {
+        this->frame.push_back(static_cast<uint8_t>(v));
+        this->frame.push_back(static_cast<uint8_t>(v >> 8));
+    }
+
+    void
+    u32(
+        uint32_t v)
+    {
+        for (int shift = 0; shift < 32; shift += 8)
+            this->frame.push_back(static_cast<uint8_t>(v >> shift));
+    }
+
+    void
+    u64(
+        uint64_t v)
+    {
+        for (int shift = 0; shift < 64; shift += 8)
+            this->frame.push_back(static_cast<uint8_t>(v >> shift));
+    }
+
+    void
+    f64(
+        double v)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        for (int shift = 0; shift < 64; shift += 8)
+            this->frame.push_back(static_cast<uint8_t>(bits >> shift));
+    }
+
+    /** @brief Append a count and that many f64 (scores or a template). */
+    void
+    values(
+        const std::vector<double> &v)
+    {
+        this->u32(static_cast<uint32_t>(v.size()));
+        for (const auto d : v)
+            this->f64(d);
+    }
+
+    void
+    list(
+        const CandidateList &candidates)
+    {
+        this->u32(static_cast<uint32_t>(candidates.size()));
+        for (const auto &c : candidates) {
+            this->u32(c.identity);
+            this->f64(c.score);
+        }
+    }
+
+    void
+    string(
+        const std::string &s)
+    {
+        this->u32(static_cast<uint32_t>(s.size()));
+        this->frame.insert(this->frame.end(), s.begin(), s.end());
+    }
+
+    /** @brief Fill in the length field; the frame is ready to send. */
+    void
+    finish()
+    {
+        const uint32_t length = static_cast<uint32_t>(
+            this->frame.size() - sizeof(uint32_t));
+        for (int i = 0; i < 4; i++)
+            this->frame[i] = static_cast<uint8_t>(length >> (8 * i));
+    }
+
+private:
+    std::vector<uint8_t> &frame;
+};
+
+/**
+ * @brief
+ * Bounds-checked reader of a frame payload.  Every getter returns false,
+ * and reads nothing, if the payload is too short.
+ */
+class Decoder {
+public:
+    Decoder(
+        const uint8_t *data,
+        size_t size) :
+        data{data},
+        remaining{size}
+        {}
+
+    bool
+    u16(
+        uint16_t &v)
+    {
+        if (this->remaining < 2)
+            return (false);
+        v = static_cast<uint16_t>(this->data[0] | (this->data[1] << 8));
+        this->skip(2);
+        return (true);
+    }
+
+    bool
+    u32(
+        uint32_t &v)
+    {
+        if (this->remaining < 4)
+            return (false);
+        v = 0;
+        for (int i = 0; i < 4; i++)
+            v |= static_cast<uint32_t>(this->data[i]) << (8 * i);
+        this->skip(4);
+        return (true);
+    }
+
+    bool
+    u64(
+        uint64_t &v)
+    {
+        if (this->remaining < 8)
+            return (false);
+        v = 0;
+        for (int i = 0; i < 8; i++)
+            v |= static_cast<uint64_t>(this->data[i]) << (8 * i);
+        this->skip(8);
+        return (true);
+    }
+
+    bool
+    f64(
+        double &v)
+    {
+        if (this->remaining < 8)
+            return (false);
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; i++)
+            bits |= static_cast<uint64_t>(this->data[i]) << (8 * i);
+        std::memcpy(&v, &bits, sizeof(v));
+        this->skip(8);
+        return (true);
+    }
+
+    /**
+     * @brief
+     * Read an element count, rejecting counts whose elements, at
+     * minBytes each, could not fit in the rest of the payload.
+     */
+    bool
+    count(
+        uint32_t &n,
+        size_t minBytes)
+    {
+        return (this->u32(n) && (minBytes == 0 ||
+            n <= this->remaining / minBytes));
+    }
+
+    /** @brief Read a count and that many f64 (scores or a template). */
+    bool
+    values(
+        std::vector<double> &v)
+    {
+        uint32_t n;
+        if (!this->count(n, 8))
+            return (false);
+        v.resize(n);
+        for (auto &d : v)
+            this->f64(d);
+        return (true);
+    }
+
+    bool
+    list(
+        CandidateList &candidates)
+    {
+        uint32_t n;
+        if (!this->count(n, 12))
+            return (false);
+        candidates.resize(n);
+        for (auto &c : candidates) {
+            this->u32(c.identity);
+            this->f64(c.score);
+        }
+        return (true);
+    }
+
+    bool
+    string(
+        std::string &s)
+    {
+        uint32_t n;
+        if (!this->count(n, 1))
+            return (false);
+        s.assign(reinterpret_cast<const char*>(this->data), n);
+        this->skip(n);
+        return (true);
+    }
+
+    /** @brief Return true once the whole payload has been read. */
+    bool
+    done() const
+    {
+        return (this->remaining == 0);
+    }
+
+private:
+    void
+    skip(
+        size_t n)
+    {
+        this->data += n;
+        this->remaining -= n;
+    }
+
+    const uint8_t *data;
+    size_t remaining;
+};
+
+/**
+ * @brief
+ * Read one frame from a blocking socket.
+ *
+ * @param[in] fd
+ * Connected socket
+ * @param[in] maxPayloadBytes
+ * Largest payload to accept; larger frames fail the read
+ * @param[out] header
+ * Decoded frame header
+ * @param[out] payload
+ * Frame payload
+ *
+ * @return
+ * false on end of stream, error, or an oversized or malformed frame
+ */
+inline bool
+readFrame(
+    int fd,
+    size_t maxPayloadBytes,
+    FrameHeader &header,
+    std::vector<uint8_t> &payload)
+{
+    auto readAll = [fd](uint8_t *buf, size_t n) {
+        while (n > 0) {
+            const ssize_t rv = read(fd, buf, n);
+            if (rv < 0 && errno == EINTR)
+                continue;
+            if (rv <= 0)
+                return (false);
+            buf += rv;
+            n -= static_cast<size_t>(rv);
+        }
+        return (true);
+    };
+
+    uint8_t raw[FrameHeaderBytes];
+    if (!readAll(raw, sizeof(raw)))
+        return (false);
+    Decoder d(raw, sizeof(raw));
+    uint32_t length;
+    d.u32(length);
+    d.u32(header.requestId);
+    d.u16(header.opcode);
+    d.u16(header.status);
+    if (length < FrameHeaderBytes - sizeof(uint32_t) ||
+        length - (FrameHeaderBytes - sizeof(uint32_t)) > maxPayloadBytes)
+        return (false);
+    header.payloadBytes = length -
+        static_cast<uint32_t>(FrameHeaderBytes - sizeof(uint32_t));
+    payload.resize(header.payloadBytes);
+    return (readAll(payload.data(), payload.size()));
+}
+
+/**
+ * @brief
+ * Write one frame, built by an Encoder, to a blocking socket.
+ *
+ * @return
+ * false if the peer has gone or the write failed
+ */
+inline bool
+writeFrame(
+    int fd,
+    const std::vector<uint8_t> &frame)
+{
+    size_t sent = 0;
+    while (sent < frame.size()) {
+        const ssize_t rv = send(fd, frame.data() + sent, frame.size() - sent,
+            MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return (false);
+        sent += static_cast<size_t>(rv);
+    }
+    return (true);
+}
+}
+}
+
+#endif /* FOFRA2018_PROTOCOL_H_ */
@@ -0,0 +1,637 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_REPLICATION_H_
+#define FOFRA2018_REPLICATION_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fofra2018.h"
+#include "fofra2018_protocol.h"
+#include "fofra2018_snapshot.h"
+#include "fofra2018_wal.h"
+
+namespace FOFRA {
+
+namespace Replication {
+
+/* Templates per Rows frame when streaming a whole gallery */
+constexpr size_t RowsPerFrame = 1024;
+
+/*
+ * Subscribe LSN of a follower that has not received a whole gallery.  LSN
+ * 0 does not serve: a leader whose gallery came from createGallery() has
+ * templates at LSN 0.
+ */
+constexpr uint64_t NoState = UINT64_MAX;
+
+inline std::shared_ptr<const std::vector<uint8_t>>
+encodeBatch(
+    uint64_t first,
+    const std::vector<GalleryMutation> &mutations)
+{
+    std::shared_ptr<std::vector<uint8_t>> frame =
+        std::make_shared<std::vector<uint8_t>>();
+    Protocol::Encoder out(*frame, 0, Protocol::Opcode::Replicate);
+    out.u32(static_cast<uint32_t>(Protocol::ReplicationFrame::Batch));
+    out.u64(first);
+    out.u32(static_cast<uint32_t>(mutations.size()));
+    for (const auto &m : mutations) {
+        out.u32(static_cast<uint32_t>(m.type));
+        out.u32(m.identity);
+        out.values(m.values);
+    }
+    out.finish();
+    return (frame);
+}
+
+inline bool
+unixAddress(
+    const std::string &path,
+    sockaddr_un &addr)
+{
+    addr = sockaddr_un();
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        return (false);
+    path.copy(addr.sun_path, path.size());
+    return (true);
+}
+}
+
+/**
+ * @brief
+ * Serves the mutation stream of a DurableGallery to follower processes
+ * over a Unix domain socket, in the framing of fofra2018_protocol.h.
+ *
+ * @details
+ * A follower sends Opcode::Subscribe with the LSN it has applied, or
+ * Replication::NoState before it has received a whole gallery.  If the
+ * batches after that LSN are still among the recent batches the leader
+ * keeps, they are sent; otherwise, and always for NoState, the current
+ * gallery is streamed whole (Reset, Rows..., Sealed).  Every batch published afterwards follows, in
+ * log order.  Each follower has a sending thread and a bounded queue; a
+ * follower that falls behind by more than the bound is disconnected and
+ * catches up when it subscribes again.
+ */
+class ReplicationLeader {
+public:
+    /**
+     * @param[in] durable
+     * Gallery whose batches to serve; every change must go through it
+     * @param[in] retainedBatches
+     * Recent batches kept to resume followers without a full transfer
+     * @param[in] maxQueuedBytes
+     * Largest backlog of one follower before it is disconnected
+     */
+    explicit ReplicationLeader(
+        DurableGallery &durable,
+        size_t retainedBatches = 4096,
+        size_t maxQueuedBytes = size_t(256) << 20) :
+        durable(durable),
+        retainedBatches{retainedBatches},
+        maxQueuedBytes{maxQueuedBytes},
+        listener{-1},
+        stopping{false}
+        {}
+
+    ~ReplicationLeader()
+    {
+        this->stop();
+    }
+
+    ReplicationLeader(const ReplicationLeader&) = delete;
+    ReplicationLeader &operator=(const ReplicationLeader&) = delete;
+
+    /** @brief Listen for followers on a socket path. */
+    ReturnStatus
+    start(
+        const std::string &socketPath)
+    {
+        sockaddr_un addr;
+        if (!Replication::unixAddress(socketPath, addr))
+            return (ReturnStatus(ReturnCode::InputLocationError,
+                socketPath + ": socket path too long"));
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(socketPath.c_str());
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr),
+            sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+            const std::string reason = std::strerror(errno);
+            if (fd >= 0)
+                close(fd);
+            return (ReturnStatus(ReturnCode::InputLocationError,
+                socketPath + ": " + reason));
+        }
+        this->listener = fd;
+        this->path = socketPath;
+        this->durable.observe([this](uint64_t first,
+            const std::vector<GalleryMutation> &mutations) {
+                this->published(first, mutations); });
+        this->acceptor = std::thread(&ReplicationLeader::acceptLoop, this);
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /** @brief Disconnect every follower and stop listening. */
+    void
+    stop()
+    {
+        if (this->listener < 0)
+            return;
+        this->durable.observe(nullptr);
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+            for (const auto &f : this->followers)
+                if (!f->closed) {
+                    f->closed = true;
+                    shutdown(f->fd, SHUT_RDWR);
+                }
+        }
+        this->wake.notify_all();
+        shutdown(this->listener, SHUT_RDWR);
+        this->acceptor.join();
+        close(this->listener);
+        unlink(this->path.c_str());
+        this->listener = -1;
+        for (const auto &f : this->followers)
+            f->thread.join();
+        this->followers.clear();
+    }
+
+    /** @brief Return the number of connected followers. */
+    size_t
+    followerCount()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        size_t n = 0;
+        for (const auto &f : this->followers)
+            n += f->closed ? 0 : 1;
+        return (n);
+    }
+
+private:
+    /* A whole gallery to stream, or one encoded frame */
+    struct Item {
+        std::shared_ptr<const GallerySnapshot> snapshot;
+        uint64_t lsn;
+        std::shared_ptr<const std::vector<uint8_t>> frame;
+    };
+
+    struct Follower {
+        int fd;
+        std::deque<Item> queue;
+        size_t queuedBytes;
+        /* Set once catchUp() has queued what precedes new batches */
+        bool subscribed;
+        bool closed;
+        std::thread thread;
+    };
+
+    struct Retained {
+        uint64_t first;
+        uint64_t last;
+        std::shared_ptr<const std::vector<uint8_t>> frame;
+    };
+
+    /* Called by DurableGallery, in log order */
+    void
+    published(
+        uint64_t first,
+        const std::vector<GalleryMutation> &mutations)
+    {
+        const auto frame = Replication::encodeBatch(first, mutations);
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->recent.push_back(Retained{first,
+            first + mutations.size() - 1, frame});
+        while (this->recent.size() > this->retainedBatches)
+            this->recent.pop_front();
+        for (const auto &f : this->followers)
+            if (f->subscribed)
+                this->enqueue(*f, Item{nullptr, 0, frame});
+        this->wake.notify_all();
+    }
+
+    /* Called with the mutex held */
+    void
+    enqueue(
+        Follower &f,
+        const Item &item)
+    {
+        if (f.closed)
+            return;
+        const size_t bytes = item.frame ? item.frame->size() : 0;
+        if (f.queuedBytes + bytes > this->maxQueuedBytes) {
+            f.closed = true;
+            shutdown(f.fd, SHUT_RDWR);
+            return;
+        }
+        f.queue.push_back(item);
+        f.queuedBytes += bytes;
+    }
+
+    void
+    acceptLoop()
+    {
+        for (;;) {
+            const int fd = accept4(this->listener, nullptr, nullptr,
+                SOCK_CLOEXEC);
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (this->stopping) {
+                if (fd >= 0)
+                    close(fd);
+                return;
+            }
+            if (fd < 0)
+                continue;
+
+            /* Reap followers that have gone */
+            for (auto it = this->followers.begin();
+                it != this->followers.end(); ) {
+                if ((*it)->closed && (*it)->fd < 0) {
+                    (*it)->thread.join();
+                    it = this->followers.erase(it);
+                } else
+                    ++it;
+            }
+            std::shared_ptr<Follower> f = std::make_shared<Follower>();
+            f->fd = fd;
+            f->queuedBytes = 0;
+            f->subscribed = false;
+            f->closed = false;
+            this->followers.push_back(f);
+            f->thread = std::thread(&ReplicationLeader::serve, this, f);
+        }
+    }
+
+    void
+    serve(
+        std::shared_ptr<Follower> f)
+    {
+        Protocol::FrameHeader header;
+        std::vector<uint8_t> payload;
+        uint64_t from = 0;
+        bool subscribed = false;
+        if (Protocol::readFrame(f->fd, 64, header, payload) &&
+            header.opcode == static_cast<uint16_t>(
+            Protocol::Opcode::Subscribe)) {
+            Protocol::Decoder in(payload.data(), payload.size());
+            subscribed = in.u64(from) && in.done();
+        }
+        if (subscribed) {
+            this->durable.consistent([&](
+                const std::shared_ptr<const GallerySnapshot> &snapshot,
+                uint64_t lsn) {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    this->catchUp(*f, snapshot, lsn, from);
+                });
+        } else {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            f->closed = true;
+        }
+        this->wake.notify_all();
+
+        for (;;) {
+            Item item;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                while (!f->closed && f->queue.empty())
+                    this->wake.wait(lock);
+                if (f->closed)
+                    break;
+                item = f->queue.front();
+                f->queue.pop_front();
+                f->queuedBytes -= item.frame ? item.frame->size() : 0;
+            }
+            const bool sent = item.snapshot ?
+                this->sendGallery(f->fd, *item.snapshot, item.lsn) :
+                Protocol::writeFrame(f->fd, *item.frame);
+            if (!sent)
+                break;
+        }
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        f->closed = true;
+        close(f->fd);
+        f->fd = -1;
+    }
+
+    /*
+     * Queue what a follower at LSN from needs; mutex held.  NoState is
+     * never lsn nor below it, so such a follower gets the whole gallery.
+     */
+    void
+    catchUp(
+        Follower &f,
+        const std::shared_ptr<const GallerySnapshot> &snapshot,
+        uint64_t lsn,
+        uint64_t from)
+    {
+        f.subscribed = true;
+        if (from == lsn)
+            return;
+        if (from < lsn && !this->recent.empty() &&
+            this->recent.front().first <= from + 1 &&
+            this->recent.back().last == lsn) {
+            bool aligned = false;
+            for (const auto &r : this->recent) {
+                if (r.first == from + 1)
+                    aligned = true;
+                if (aligned)
+                    this->enqueue(f, Item{nullptr, 0, r.frame});
+            }
+            if (aligned)
+                return;
+            f.queue.clear();
+            f.queuedBytes = 0;
+        }
+        this->enqueue(f, Item{snapshot, lsn, nullptr});
+    }
+
+    bool
+    sendGallery(
+        int fd,
+        const GallerySnapshot &snapshot,
+        uint64_t lsn)
+    {
+        std::vector<uint8_t> frame;
+        {
+            Protocol::Encoder out(frame, 0, Protocol::Opcode::Replicate);
+            out.u32(static_cast<uint32_t>(
+                Protocol::ReplicationFrame::Reset));
+            out.u64(lsn);
+            out.finish();
+        }
+        if (!Protocol::writeFrame(fd, frame))
+            return (false);
+
+        std::vector<std::pair<const double*, uint32_t>> rows;
+        const auto flush = [&]() {
+            Protocol::Encoder out(frame, 0, Protocol::Opcode::Replicate);
+            out.u32(static_cast<uint32_t>(
+                Protocol::ReplicationFrame::Rows));
+            out.u32(static_cast<uint32_t>(rows.size()));
+            for (const auto &r : rows) {
+                out.u32(r.second);
+                out.u32(static_cast<uint32_t>(snapshot.dimension()));
+                for (size_t i = 0; i < snapshot.dimension(); i++)
+                    out.f64(r.first[i]);
+            }
+            out.finish();
+            rows.clear();
+            return (Protocol::writeFrame(fd, frame));
+        };
+        for (const auto &b : snapshot.blocks())
+            for (size_t r = 0; r < b->rows(); r++) {
+                rows.emplace_back(&b->matrix[r * b->dimension], b->ids[r]);
+                if (rows.size() == Replication::RowsPerFrame && !flush())
+                    return (false);
+            }
+        if (!rows.empty() && !flush())
+            return (false);
+
+        Protocol::Encoder out(frame, 0, Protocol::Opcode::Replicate);
+        out.u32(static_cast<uint32_t>(Protocol::ReplicationFrame::Sealed));
+        out.finish();
+        return (Protocol::writeFrame(fd, frame));
+    }
+
+    DurableGallery &durable;
+    size_t retainedBatches;
+    size_t maxQueuedBytes;
+    int listener;
+    std::string path;
+    std::thread acceptor;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+    std::deque<Retained> recent;
+    std::list<std::shared_ptr<Follower>> followers;
+};
+
+/**
+ * @brief
+ * Keeps a VersionedGallery current from a ReplicationLeader's stream, so
+ * this process can serve search() without building its own gallery.
+ *
+ * @details
+ * A thread connects, subscribes with the LSN applied so far (or
+ * Replication::NoState until a whole gallery has arrived) and applies
+ * what arrives: a whole gallery is published as one version when it is
+ * sealed, and each batch as one version, so searches always see a
+ * gallery the leader published.  After a disconnection, it reconnects
+ * and resumes.  Nothing else may change the gallery.
+ */
+class ReplicationFollower {
+public:
+    explicit ReplicationFollower(
+        VersionedGallery &gallery) :
+        gallery(gallery),
+        applied{0},
+        seeded{false},
+        fd{-1},
+        stopping{false}
+        {}
+
+    ~ReplicationFollower()
+    {
+        this->stop();
+    }
+
+    ReplicationFollower(const ReplicationFollower&) = delete;
+    ReplicationFollower &operator=(const ReplicationFollower&) = delete;
+
+    /** @brief Start following the leader at a socket path. */
+    void
+    start(
+        const std::string &socketPath)
+    {
+        this->path = socketPath;
+        this->stopping = false;
+        this->thread = std::thread(&ReplicationFollower::run, this);
+    }
+
+    /** @brief Stop following; the gallery keeps its last version. */
+    void
+    stop()
+    {
+        if (!this->thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+            if (this->fd >= 0)
+                shutdown(this->fd, SHUT_RDWR);
+        }
+        this->wake.notify_all();
+        this->thread.join();
+    }
+
+    /** @brief Return the LSN of the last mutation applied. */
+    uint64_t
+    lsn() const
+    {
+        return (this->applied.load());
+    }
+
+private:
+    void
+    run()
+    {
+        auto backoff = std::chrono::milliseconds(50);
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                if (this->stopping)
+                    return;
+                this->fd = this->connectLeader();
+            }
+            if (this->fd >= 0) {
+                backoff = std::chrono::milliseconds(50);
+                this->follow();
+                std::lock_guard<std::mutex> lock(this->mutex);
+                close(this->fd);
+                this->fd = -1;
+            }
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->wake.wait_for(lock, backoff,
+                [this]() { return (this->stopping); });
+            backoff = std::min<std::chrono::milliseconds>(backoff * 2,
+                std::chrono::milliseconds(2000));
+        }
+    }
+
+    int
+    connectLeader() const
+    {
+        sockaddr_un addr;
+        if (!Replication::unixAddress(this->path, addr))
+            return (-1);
+        const int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (s >= 0 && connect(s, reinterpret_cast<sockaddr*>(&addr),
+            sizeof(addr)) == 0)
+            return (s);
+        if (s >= 0)
+            close(s);
+        return (-1);
+    }
+
+    /* Subscribe and apply frames until the connection ends */
+    void
+    follow()
+    {
+        std::vector<uint8_t> frame;
+        Protocol::Encoder out(frame, 0, Protocol::Opcode::Subscribe);
+        out.u64(this->seeded ? this->applied.load() : Replication::NoState);
+        out.finish();
+        if (!Protocol::writeFrame(this->fd, frame))
+            return;
+
+        Protocol::FrameHeader header;
+        std::vector<uint8_t> payload;
+        std::unique_ptr<SnapshotBuilder> incoming;
+        uint64_t incomingLsn = 0;
+        while (Protocol::readFrame(this->fd, size_t(1) << 30, header,
+            payload)) {
+            Protocol::Decoder in(payload.data(), payload.size());
+            uint32_t kind;
+            if (header.opcode != static_cast<uint16_t>(
+                Protocol::Opcode::Replicate) || !in.u32(kind))
+                return;
+            uint64_t version;
+            switch (static_cast<Protocol::ReplicationFrame>(kind)) {
+            case Protocol::ReplicationFrame::Reset:
+                if (!in.u64(incomingLsn) || !in.done())
+                    return;
+                incoming.reset(new SnapshotBuilder(
+                    this->gallery.beginEmpty()));
+                break;
+            case Protocol::ReplicationFrame::Rows: {
+                uint32_t n;
+                if (!incoming || !in.count(n, 8))
+                    return;
+                Template values;
+                for (uint32_t i = 0; i < n; i++) {
+                    uint32_t identity;
+                    if (!in.u32(identity) || !in.values(values) ||
+                        incoming->enroll(values, identity).code !=
+                        ReturnCode::Success)
+                        return;
+                }
+                if (!in.done())
+                    return;
+                break;
+            }
+            case Protocol::ReplicationFrame::Sealed:
+                if (!incoming || !in.done() || this->gallery.publish(
+                    *incoming, version).code != ReturnCode::Success)
+                    return;
+                incoming.reset();
+                this->applied = incomingLsn;
+                this->seeded = true;
+                break;
+            case Protocol::ReplicationFrame::Batch: {
+                uint64_t first;
+                uint32_t n;
+                if (incoming || !this->seeded || !in.u64(first) ||
+                    !in.count(n, 12) || first != this->applied.load() + 1)
+                    return;
+                std::vector<GalleryMutation> mutations(n);
+                for (auto &m : mutations) {
+                    uint32_t type;
+                    if (!in.u32(type) || !in.u32(m.identity) ||
+                        !in.values(m.values) || type < 1 || type > 3)
+                        return;
+                    m.type = static_cast<GalleryMutation::Type>(type);
+                }
+                SnapshotBuilder batch = this->gallery.begin();
+                if (!in.done() || applyMutations(mutations, batch).code !=
+                    ReturnCode::Success || this->gallery.publish(batch,
+                    version).code != ReturnCode::Success)
+                    return;
+                this->applied = first + n - 1;
+                break;
+            }
+            default:
+                return;
+            }
+        }
+    }
+
+    VersionedGallery &gallery;
+    std::atomic<uint64_t> applied;
+    /* Set once a whole gallery has been applied; used by the thread only */
+    bool seeded;
+    std::string path;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    int fd;
+    bool stopping;
+};
+}
+
+#endif /* FOFRA2018_REPLICATION_H_ */
@@ -0,0 +1,187 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+/*
+ * Checks that ReplicationFollowers reproduce a ReplicationLeader's
+ * gallery when the leader's base gallery was loaded, as from
+ * createGallery(), rather than logged, so that it holds templates at LSN
+ * 0.  The leader loads a synthetic gallery and checkpoints it; one
+ * follower subscribes before an enrollment is logged and one after.
+ * Both must hold the leader's gallery, template for template, and its
+ * LSN.  Uses a temporary directory and socket under /tmp.
+ */
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_gallery.h"
+#include "fofra2018_replication.h"
+#include "fofra2018_snapshot.h"
+#include "fofra2018_wal.h"
+
+using namespace FOFRA;
+
+namespace {
+
+/* true if b holds every template of a under the same identity */
+bool
+sameGallery(
+    const GallerySnapshot &a,
+    const GallerySnapshot &b)
+{
+    if (a.count() != b.count() || a.dimension() != b.dimension())
+        return (false);
+    for (const auto &block : a.blocks())
+        for (size_t r = 0; r < block->rows(); r++) {
+            const double *values;
+            if (!b.findIdentity(block->ids[r], values) ||
+                std::memcmp(values, &block->matrix[r * block->dimension],
+                block->dimension * sizeof(double)) != 0)
+                return (false);
+        }
+    return (true);
+}
+
+/* Wait up to ten seconds for a follower to reach the leader */
+bool
+converges(
+    const std::string &name,
+    const VersionedGallery &leader,
+    uint64_t lsn,
+    const ReplicationFollower &follower,
+    const VersionedGallery &replica)
+{
+    const auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::seconds(10);
+    bool same = false;
+    while (!same && std::chrono::steady_clock::now() < deadline) {
+        same = follower.lsn() == lsn &&
+            sameGallery(*leader.current(), *replica.current());
+        if (!same)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::cout << name << ": " << replica.current()->count() <<
+        " templates at LSN " << follower.lsn() << ", leader " <<
+        leader.current()->count() << " at LSN " << lsn <<
+        (same ? "" : "  DIVERGED") << std::endl;
+    return (same);
+}
+
+/* Remove a directory and the files in it */
+void
+removeDirectory(
+    const std::string &directory)
+{
+    DIR *d = opendir(directory.c_str());
+    if (d == nullptr)
+        return;
+    for (struct dirent *e = readdir(d); e != nullptr; e = readdir(d))
+        if (std::strcmp(e->d_name, ".") != 0 &&
+            std::strcmp(e->d_name, "..") != 0)
+            unlink((directory + "/" + e->d_name).c_str());
+    closedir(d);
+    rmdir(directory.c_str());
+}
+}
+
+int
+main(
+    int argc,
+    char *argv[])
+{
+    const size_t N = (argc > 1) ? std::stoul(argv[1]) : 100;
+    const size_t D = (argc > 2) ? std::stoul(argv[2]) : 64;
+
+    std::mt19937_64 rng(2018);
+    std::normal_distribution<double> normal;
+    std::vector<Template> templates(N, Template(D));
+    std::vector<uint32_t> ids(N);
+    for (size_t i = 0; i < N; i++) {
+        for (auto &v : templates[i])
+            v = normal(rng);
+        ids[i] = static_cast<uint32_t>(i);
+    }
+
+    char scratch[] = "/tmp/fofra_replication.XXXXXX";
+    if (mkdtemp(scratch) == nullptr) {
+        std::cerr << "mkdtemp: " << std::strerror(errno) << std::endl;
+        return (EXIT_FAILURE);
+    }
+    const std::string directory = scratch;
+    const std::string logDirectory = directory + "/log";
+    const std::string socketPath = directory + "/leader.sock";
+
+    /* The base gallery holds N templates at LSN 0 */
+    MappedGallery base;
+    VersionedGallery leaderGallery;
+    DurableGallery durable(leaderGallery);
+    uint64_t version;
+    ReturnStatus rs = base.build(templates, ids);
+    if (rs.code == ReturnCode::Success)
+        rs = leaderGallery.load(base.view(), version);
+    if (rs.code == ReturnCode::Success)
+        rs = durable.open(logDirectory);
+    if (rs.code == ReturnCode::Success)
+        rs = durable.checkpoint();
+    ReplicationLeader leader(durable);
+    if (rs.code == ReturnCode::Success)
+        rs = leader.start(socketPath);
+    if (rs.code != ReturnCode::Success) {
+        std::cerr << rs.code << " (" << rs.info << ")" << std::endl;
+        removeDirectory(logDirectory);
+        removeDirectory(directory);
+        return (EXIT_FAILURE);
+    }
+
+    bool passed = true;
+    VersionedGallery early, late;
+    ReplicationFollower earlyFollower(early), lateFollower(late);
+    earlyFollower.start(socketPath);
+    passed &= converges("follower before enrollment", leaderGallery, 0,
+        earlyFollower, early);
+
+    Template enrolled(D);
+    for (auto &v : enrolled)
+        v = normal(rng);
+    rs = durable.apply({GalleryMutation{GalleryMutation::Type::Enroll,
+        static_cast<uint32_t>(N), enrolled}}, version);
+    if (rs.code != ReturnCode::Success) {
+        std::cerr << "apply: " << rs.code << " (" << rs.info << ")" <<
+            std::endl;
+        passed = false;
+    }
+    passed &= converges("follower before enrollment", leaderGallery, 1,
+        earlyFollower, early);
+    lateFollower.start(socketPath);
+    passed &= converges("follower after enrollment", leaderGallery, 1,
+        lateFollower, late);
+
+    earlyFollower.stop();
+    lateFollower.stop();
+    leader.stop();
+    removeDirectory(logDirectory);
+    removeDirectory(directory);
+    std::cout << (passed ? "PASS" : "FAIL") << std::endl;
+    return (passed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
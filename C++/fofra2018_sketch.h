@@ -0,0 +1,412 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_SKETCH_H_
+#define FOFRA2018_SKETCH_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fofra2018.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * Constant-memory quantile sketch of a score stream: a merging t-digest
+ * whose scale function keeps one tail exact.
+ *
+ * @details
+ * Scores are grouped into centroids (mean, weight) in sorted order.  A
+ * centroid may hold at most a fraction accuracy of the mass beyond it on
+ * the kept tail, so the estimate of P(score >= t) (or P(score < t) for
+ * Tail::Lower) has a relative error of about accuracy/2, and the last
+ * 1/accuracy scores are kept individually.  That is what FMR calibration
+ * needs: FMR 1e-5 over 1e8 impostors is as precise as FMR 1e-2.  The
+ * sketch holds about log(n accuracy) / accuracy centroids.
+ *
+ * Sketches built by different threads or processes merge exactly as if
+ * one sketch had seen all the scores, up to the same error.  One object
+ * must not be used by two threads at once; see ShardedScoreDigest.
+ */
+class ScoreDigest {
+public:
+    /** @brief Which tail of the distribution is kept precise */
+    enum class Tail {
+        /** High scores, for impostor scores and FMR */
+        Upper = 0,
+        /** Low scores, for genuine scores and FNMR */
+        Lower
+    };
+
+    /** @brief A group of scores with their mean */
+    struct Centroid {
+        double mean;
+        double weight;
+    };
+
+    /**
+     * @param[in] tail
+     * Tail to keep precise
+     * @param[in] accuracy
+     * Largest fraction of the remaining tail mass one centroid may hold
+     */
+    ScoreDigest(
+        Tail tail = Tail::Upper,
+        double accuracy = 0.01) :
+        tail{tail},
+        accuracy{std::min(0.5, std::max(1e-4, accuracy))},
+        bufferLimit{static_cast<size_t>(8.0 / this->accuracy)},
+        total{0.0},
+        low{std::numeric_limits<double>::infinity()},
+        high{-std::numeric_limits<double>::infinity()}
+    {
+        this->buffer.reserve(this->bufferLimit);
+    }
+
+    /** @brief Add a score, with a weight for pre-aggregated data. */
+    void
+    add(
+        double score,
+        double weight = 1.0)
+    {
+        if (std::isnan(score) || !(weight > 0.0))
+            return;
+        this->buffer.push_back(Centroid{score, weight});
+        this->low = std::min(this->low, score);
+        this->high = std::max(this->high, score);
+        if (this->buffer.size() >= this->bufferLimit)
+            this->compress();
+    }
+
+    /** @brief Add n scores. */
+    void
+    add(
+        const double *scores,
+        size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+            this->add(scores[i]);
+    }
+
+    /**
+     * @brief
+     * Add every score seen by another sketch.  The lowest and highest
+     * scores are those of the two streams, not the means of the end
+     * centroids, so the tails interpolate as for one stream.
+     */
+    void
+    merge(
+        const ScoreDigest &other)
+    {
+        for (const auto &c : other.centroids)
+            this->add(c.mean, c.weight);
+        for (const auto &c : other.buffer)
+            this->add(c.mean, c.weight);
+        this->low = std::min(this->low, other.low);
+        this->high = std::max(this->high, other.high);
+    }
+
+    /** @brief Return the number (total weight) of scores seen. */
+    double
+    count() const
+    {
+        double n = this->total;
+        for (const auto &c : this->buffer)
+            n += c.weight;
+        return (n);
+    }
+
+    /**
+     * @brief
+     * Return the estimated fraction of scores at or above threshold,
+     * i.e., the FMR at threshold when the scores are impostors.
+     */
+    double
+    fractionAbove(
+        double threshold)
+    {
+        this->compress();
+        return (this->total > 0.0 ?
+            1.0 - this->rankBelow(threshold) / this->total : 0.0);
+    }
+
+    /**
+     * @brief
+     * Return the estimated q-quantile, 0 <= q <= 1, by interpolating
+     * between centroid midpoints.
+     */
+    double
+    quantile(
+        double q)
+    {
+        this->compress();
+        if (this->centroids.empty())
+            return (std::numeric_limits<double>::quiet_NaN());
+        const double rank = std::min(1.0, std::max(0.0, q)) * this->total;
+
+        /* Centroid i covers ranks around its midpoint */
+        double before = 0.0, previousMid = 0.0, previousMean = this->low;
+        for (const auto &c : this->centroids) {
+            const double mid = before + c.weight / 2.0;
+            if (rank < mid) {
+                if (c.weight == 1.0 && rank >= before)
+                    return (c.mean);
+                const double f = (rank - previousMid) / (mid - previousMid);
+                return (previousMean + f * (c.mean - previousMean));
+            }
+            before += c.weight;
+            previousMid = mid;
+            previousMean = c.mean;
+        }
+        if (this->centroids.back().weight == 1.0)
+            return (this->centroids.back().mean);
+        const double f = (rank - previousMid) / (this->total - previousMid);
+        return (previousMean + f * (this->high - previousMean));
+    }
+
+    /**
+     * @brief
+     * Return the threshold at which a target FMR is reached: the
+     * (1 - fmr)-quantile of impostor scores, as compute_det() in
+     * R/fusion_example_score_level.R computes from all the scores.
+     */
+    double
+    thresholdForFMR(
+        double fmr)
+    {
+        return (this->quantile(1.0 - fmr));
+    }
+
+    /**
+     * @brief
+     * Serialize the sketch, in host byte order, for merging in another
+     * process with deserialize() and merge().
+     */
+    void
+    serialize(
+        std::vector<uint8_t> &bytes)
+    {
+        this->compress();
+        const uint64_t header[2] = {
+            static_cast<uint64_t>(this->tail),
+            static_cast<uint64_t>(this->centroids.size())};
+        const double limits[3] = {this->accuracy, this->low, this->high};
+        bytes.resize(sizeof(header) + sizeof(limits) +
+            this->centroids.size() * sizeof(Centroid));
+        uint8_t *p = bytes.data();
+        std::memcpy(p, header, sizeof(header));
+        std::memcpy(p + sizeof(header), limits, sizeof(limits));
+        if (!this->centroids.empty())
+            std::memcpy(p + sizeof(header) + sizeof(limits),
+                this->centroids.data(),
+                this->centroids.size() * sizeof(Centroid));
+    }
+
+    /** @brief Replace the sketch by one written by serialize(). */
+    ReturnStatus
+    deserialize(
+        const uint8_t *bytes,
+        size_t size)
+    {
+        uint64_t header[2];
+        double limits[3];
+        if (size < sizeof(header) + sizeof(limits))
+            return (ReturnStatus(ReturnCode::ParseError, "short sketch"));
+        std::memcpy(header, bytes, sizeof(header));
+        std::memcpy(limits, bytes + sizeof(header), sizeof(limits));
+        if (header[0] > static_cast<uint64_t>(Tail::Lower) ||
+            header[1] != (size - sizeof(header) - sizeof(limits)) /
+            sizeof(Centroid) || (size - sizeof(header) - sizeof(limits)) %
+            sizeof(Centroid) != 0)
+            return (ReturnStatus(ReturnCode::ParseError, "bad sketch"));
+
+        ScoreDigest digest(static_cast<Tail>(header[0]), limits[0]);
+        digest.centroids.resize(header[1]);
+        if (header[1] != 0)
+            std::memcpy(digest.centroids.data(),
+                bytes + sizeof(header) + sizeof(limits),
+                header[1] * sizeof(Centroid));
+        for (const auto &c : digest.centroids)
+            digest.total += c.weight;
+        digest.low = limits[1];
+        digest.high = limits[2];
+        *this = std::move(digest);
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /** @brief Return the centroids, in increasing order of mean. */
+    const std::vector<Centroid>&
+    summary()
+    {
+        this->compress();
+        return (this->centroids);
+    }
+
+private:
+    /* Number of scores strictly below threshold, interpolated */
+    double
+    rankBelow(
+        double threshold) const
+    {
+        if (this->centroids.empty() || threshold <= this->low)
+            return (0.0);
+        if (threshold > this->high)
+            return (this->total);
+
+        double before = 0.0, previousMid = 0.0, previousMean = this->low;
+        for (const auto &c : this->centroids) {
+            const double mid = before + c.weight / 2.0;
+            if (threshold <= c.mean) {
+                if (c.weight == 1.0 && threshold == c.mean)
+                    return (before);
+                if (c.mean == previousMean)
+                    return (previousMid);
+                const double f = (threshold - previousMean) /
+                    (c.mean - previousMean);
+                return (previousMid + f * (mid - previousMid));
+            }
+            before += c.weight;
+            previousMid = mid;
+            previousMean = c.mean;
+        }
+        const double f = (threshold - previousMean) /
+            (this->high - previousMean);
+        return (previousMid + f * (this->total - previousMid));
+    }
+
+    /* Largest total weight at or below which the next centroid may end */
+    double
+    limitAfter(
+        double weightBefore) const
+    {
+        const double q = weightBefore / this->total;
+        if (this->tail == Tail::Upper)
+            return (weightBefore + std::max(1.0,
+                this->accuracy * (1.0 - q) * this->total));
+        /* Mirror image: the centroid's weight is bounded by the lower
+         * tail mass it leaves behind */
+        return (weightBefore + std::max(1.0,
+            this->accuracy * q * this->total / (1.0 - this->accuracy)));
+    }
+
+    /* Fold the buffer into the centroids in one sorted sweep */
+    void
+    compress()
+    {
+        if (this->buffer.empty())
+            return;
+        this->buffer.insert(this->buffer.end(), this->centroids.begin(),
+            this->centroids.end());
+        std::sort(this->buffer.begin(), this->buffer.end(),
+            [](const Centroid &a, const Centroid &b) {
+                return (a.mean < b.mean); });
+        this->total = 0.0;
+        for (const auto &c : this->buffer)
+            this->total += c.weight;
+
+        this->centroids.clear();
+        Centroid current = this->buffer.front();
+        double before = 0.0, limit = this->limitAfter(0.0);
+        for (size_t i = 1; i < this->buffer.size(); i++) {
+            const Centroid &next = this->buffer[i];
+            if (before + current.weight + next.weight <= limit) {
+                current.weight += next.weight;
+                current.mean += (next.mean - current.mean) * next.weight /
+                    current.weight;
+                continue;
+            }
+            this->centroids.push_back(current);
+            before += current.weight;
+            limit = this->limitAfter(before);
+            current = next;
+        }
+        this->centroids.push_back(current);
+        this->buffer.clear();
+    }
+
+    Tail tail;
+    double accuracy;
+    size_t bufferLimit;
+    double total;
+    double low;
+    double high;
+    std::vector<Centroid> centroids;
+    std::vector<Centroid> buffer;
+};
+
+/**
+ * @brief
+ * ScoreDigest that many threads may add to at once, e.g. every search
+ * thread of a service recording its impostor scores.
+ *
+ * @details
+ * Each thread adds to one of several independently locked shards chosen
+ * by its thread id, so adds rarely contend; snapshot() merges the shards.
+ */
+class ShardedScoreDigest {
+public:
+    ShardedScoreDigest(
+        ScoreDigest::Tail tail = ScoreDigest::Tail::Upper,
+        double accuracy = 0.01,
+        size_t shards = 0) :
+        tail{tail},
+        accuracy{accuracy},
+        shards(shards != 0 ? shards :
+            std::max<size_t>(1, std::thread::hardware_concurrency()))
+    {
+        for (auto &shard : this->shards)
+            shard.digest = ScoreDigest(tail, accuracy);
+    }
+
+    /** @brief Add n scores from the calling thread. */
+    void
+    add(
+        const double *scores,
+        size_t n)
+    {
+        Shard &shard = this->shards[std::hash<std::thread::id>()(
+            std::this_thread::get_id()) % this->shards.size()];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.digest.add(scores, n);
+    }
+
+    /** @brief Return a sketch of every score added so far. */
+    ScoreDigest
+    snapshot()
+    {
+        ScoreDigest merged(this->tail, this->accuracy);
+        for (auto &shard : this->shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            merged.merge(shard.digest);
+        }
+        return (merged);
+    }
+
+private:
+    struct Shard {
+        std::mutex mutex;
+        ScoreDigest digest;
+    };
+
+    ScoreDigest::Tail tail;
+    double accuracy;
+    std::vector<Shard> shards;
+};
+}
+
+#endif /* FOFRA2018_SKETCH_H_ */
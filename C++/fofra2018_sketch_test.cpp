@@ -0,0 +1,110 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+/*
+ * Checks that ScoreDigest sketches merged from shards agree with one
+ * sketch of the whole stream.  Synthetic impostor scores are split over
+ * several sketches, some merged directly and some through serialize() and
+ * deserialize(); the merged sketch must report the same lowest and
+ * highest scores as the single-stream sketch, and thresholds at a range
+ * of FMRs that agree to within the sketch's accuracy.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_sketch.h"
+
+using namespace FOFRA;
+
+namespace {
+
+bool
+check(
+    const std::string &what,
+    double single,
+    double merged,
+    double tolerance)
+{
+    const bool ok = std::fabs(single - merged) <= tolerance;
+    std::cout << what << ": single " << single << ", merged " << merged <<
+        (ok ? "" : "  MISMATCH") << "\n";
+    return (ok);
+}
+}
+
+int
+main(
+    int argc,
+    char *argv[])
+{
+    const size_t N = (argc > 1) ? std::stoul(argv[1]) : 1000000;
+    const size_t S = (argc > 2) ? std::stoul(argv[2]) : 8;
+    const double accuracy = 0.01;
+
+    std::mt19937_64 rng(2018);
+    std::normal_distribution<double> normal;
+    ScoreDigest single(ScoreDigest::Tail::Upper, accuracy);
+    std::vector<ScoreDigest> shards(S,
+        ScoreDigest(ScoreDigest::Tail::Upper, accuracy));
+    std::vector<double> scores(N);
+    for (size_t i = 0; i < N; i++) {
+        scores[i] = normal(rng);
+        single.add(scores[i]);
+        shards[i % S].add(scores[i]);
+    }
+
+    /* Every other shard travels as bytes, as from another process */
+    ScoreDigest merged(ScoreDigest::Tail::Upper, accuracy);
+    for (size_t s = 0; s < S; s++) {
+        if (s % 2 == 0) {
+            merged.merge(shards[s]);
+            continue;
+        }
+        std::vector<uint8_t> bytes;
+        shards[s].serialize(bytes);
+        ScoreDigest copy;
+        const ReturnStatus rs = copy.deserialize(bytes.data(), bytes.size());
+        if (rs.code != ReturnCode::Success) {
+            std::cerr << "deserialize: " << rs.code << " (" << rs.info <<
+                ")\n";
+            return (EXIT_FAILURE);
+        }
+        merged.merge(copy);
+    }
+
+    bool passed = check("count", single.count(), merged.count(), 0.0);
+    passed &= check("lowest", single.quantile(0.0), merged.quantile(0.0),
+        0.0);
+    passed &= check("highest", single.quantile(1.0), merged.quantile(1.0),
+        0.0);
+
+    /* Thresholds agree to within the relative error of the tail mass */
+    std::sort(scores.begin(), scores.end());
+    for (double fmr = 1e-1; fmr * N >= 1.0 / accuracy; fmr /= 10.0) {
+        const double a = single.thresholdForFMR(fmr);
+        const double b = merged.thresholdForFMR(fmr);
+        const size_t slack = static_cast<size_t>(accuracy * fmr * N) + 1;
+        const size_t rank = N - static_cast<size_t>(fmr * N);
+        const double spread = scores[std::min(N - 1, rank + slack)] -
+            scores[rank - slack];
+        passed &= check("threshold at FMR " + std::to_string(fmr), a, b,
+            spread);
+    }
+    std::cout << (passed ? "PASS" : "FAIL") << std::endl;
+    return (passed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,591 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_SNAPSHOT_H_
+#define FOFRA2018_SNAPSHOT_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_gallery.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * A block of gallery rows: templates, identity labels and an identity
+ * index sorted by identity, never modified once in a published snapshot.
+ */
+struct GalleryBlock {
+    /** @brief rows x D row-major matrix of templates */
+    std::vector<double> matrix;
+    /** @brief Identity label of each row */
+    std::vector<uint32_t> ids;
+    /** @brief Rows of the block sorted by identity */
+    std::vector<IdentityIndexEntry> index;
+    /** @brief Dimension of each template, D */
+    size_t dimension;
+
+    explicit GalleryBlock(
+        size_t dimension = 0) :
+        dimension{dimension}
+        {}
+
+    /** @brief Return the number of rows. */
+    size_t
+    rows() const
+    {
+        return (this->ids.size());
+    }
+
+    /** @brief Return a view of the block, as of a flat gallery. */
+    GalleryView
+    view() const
+    {
+        GalleryView v;
+        v.matrix = this->matrix.data();
+        v.ids = this->ids.data();
+        v.index = this->index.data();
+        v.count = this->ids.size();
+        v.dimension = this->dimension;
+        return (v);
+    }
+};
+using GalleryBlock = struct GalleryBlock;
+
+/**
+ * @brief
+ * One immutable version of a gallery: a list of shared blocks.
+ *
+ * @details
+ * Consecutive versions share every block that a batch of mutations did
+ * not touch, so a version costs one pointer per block plus the blocks it
+ * changed.  A search holds a snapshot for its whole duration and so sees
+ * one version, whatever is published meanwhile.
+ */
+class GallerySnapshot {
+public:
+    GallerySnapshot(
+        uint64_t version,
+        size_t dimension,
+        std::vector<std::shared_ptr<const GalleryBlock>> blocks) :
+        number{version},
+        width{dimension},
+        parts(std::move(blocks)),
+        offsets(1, 0)
+    {
+        for (const auto &b : this->parts)
+            this->offsets.push_back(this->offsets.back() + b->rows());
+    }
+
+    /** @brief Return the version number. */
+    uint64_t
+    version() const
+    {
+        return (this->number);
+    }
+
+    /** @brief Return the number of templates. */
+    size_t
+    count() const
+    {
+        return (this->offsets.back());
+    }
+
+    /** @brief Return the dimension of each template. */
+    size_t
+    dimension() const
+    {
+        return (this->width);
+    }
+
+    /** @brief Return the blocks, in row order. */
+    const std::vector<std::shared_ptr<const GalleryBlock>> &
+    blocks() const
+    {
+        return (this->parts);
+    }
+
+    /**
+     * @brief
+     * Find the template of an identity.
+     *
+     * @param[in] identity
+     * Gallery identity label
+     * @param[out] values
+     * The identity's first template, set only when it is enrolled
+     */
+    bool
+    findIdentity(
+        uint32_t identity,
+        const double *&values) const
+    {
+        for (const auto &b : this->parts) {
+            size_t row;
+            const GalleryView v = b->view();
+            if (v.findIdentity(identity, row)) {
+                values = v.templateAt(row);
+                return (true);
+            }
+        }
+        return (false);
+    }
+
+    /**
+     * @brief
+     * Exhaustive search of this version, as searchGallery().  Ties rank
+     * the earlier row first.
+     *
+     * @param[in] probe
+     * Probe template of the snapshot's dimension
+     * @param[in] compare
+     * Comparator with the signature of l1Similarity(), e.g. the verify
+     * metric
+     * @param[out] candidates
+     * Pre-allocated candidate list, filled best first
+     */
+    template<typename Comparator>
+    ReturnStatus
+    search(
+        const Template &probe,
+        Comparator compare,
+        CandidateList &candidates) const
+    {
+        if (probe.size() != this->width)
+            return (ReturnStatus(ReturnCode::NonCongruentVectors,
+                "probe and gallery differ in dimension"));
+
+        TopCandidates top(std::min(candidates.size(), this->count()));
+        for (size_t b = 0; b < this->parts.size(); b++) {
+            const GalleryView v = this->parts[b]->view();
+            for (size_t row = 0; row < v.count; row++)
+                top.offer(compare(probe.data(), v.templateAt(row),
+                    this->width),
+                    static_cast<uint32_t>(this->offsets[b] + row));
+        }
+        std::vector<TopCandidates::Entry> best;
+        top.drain(best);
+        for (size_t i = 0; i < candidates.size(); i++)
+            candidates[i] = (i < best.size()) ? Candidate(
+                this->identityAt(best[i].row), best[i].score) : Candidate();
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /** @brief Return the identity label of a row of this version. */
+    uint32_t
+    identityAt(
+        size_t row) const
+    {
+        const size_t b = static_cast<size_t>(std::upper_bound(
+            this->offsets.begin(), this->offsets.end(), row) -
+            this->offsets.begin()) - 1;
+        return (this->parts[b]->ids[row - this->offsets[b]]);
+    }
+
+private:
+    uint64_t number;
+    size_t width;
+    std::vector<std::shared_ptr<const GalleryBlock>> parts;
+    std::vector<size_t> offsets;
+};
+
+/**
+ * @brief
+ * A batch of gallery mutations over a base snapshot, to be published as
+ * the next version by VersionedGallery::publish().
+ *
+ * @details
+ * Blocks are copied on first write: a block shared with the base is
+ * copied once, and later mutations of the batch modify the copy in
+ * place.  New templates fill the last block up to the block size before
+ * a new block is started.  A builder is used by one thread.
+ */
+class SnapshotBuilder {
+public:
+    SnapshotBuilder(
+        std::shared_ptr<const GallerySnapshot> base,
+        size_t blockRows) :
+        base{base->version()},
+        width{base->dimension()},
+        blockRows{std::max<size_t>(1, blockRows)},
+        parts(base->blocks()),
+        owned(parts.size())
+        {}
+
+    /** @brief Return the version the batch applies to. */
+    uint64_t
+    baseVersion() const
+    {
+        return (this->base);
+    }
+
+    /** @brief Add a template for an identity. */
+    ReturnStatus
+    enroll(
+        const double *values,
+        size_t dimension,
+        uint32_t identity)
+    {
+        if (this->width == 0)
+            this->width = dimension;
+        if (dimension != this->width)
+            return (ReturnStatus(ReturnCode::NonCongruentVectors,
+                "template and gallery differ in dimension"));
+        if (this->parts.empty() ||
+            this->parts.back()->rows() >= this->blockRows) {
+            this->parts.push_back(nullptr);
+            this->owned.push_back(std::make_shared<GalleryBlock>(
+                this->width));
+            this->parts.back() = this->owned.back();
+        }
+        GalleryBlock &block = this->writable(this->parts.size() - 1);
+        const IdentityIndexEntry entry{identity,
+            static_cast<uint32_t>(block.rows())};
+        block.matrix.insert(block.matrix.end(), values, values + dimension);
+        block.ids.push_back(identity);
+        block.index.insert(std::upper_bound(block.index.begin(),
+            block.index.end(), entry, [](const IdentityIndexEntry &a,
+            const IdentityIndexEntry &b) { return (a.identity < b.identity);
+            }), entry);
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /** @brief Add a template for an identity. */
+    ReturnStatus
+    enroll(
+        const Template &values,
+        uint32_t identity)
+    {
+        return (this->enroll(values.data(), values.size(), identity));
+    }
+
+    /**
+     * @brief
+     * Remove every template of an identity.
+     *
+     * @param[in] identity
+     * Gallery identity label
+     * @param[out] removed
+     * Number of templates removed
+     */
+    void
+    remove(
+        uint32_t identity,
+        size_t &removed)
+    {
+        removed = 0;
+        for (size_t b = 0; b < this->parts.size(); b++) {
+            size_t row;
+            if (!this->parts[b]->view().findIdentity(identity, row))
+                continue;
+            GalleryBlock &block = this->writable(b);
+            size_t kept = 0;
+            for (size_t r = 0; r < block.rows(); r++) {
+                if (block.ids[r] == identity) {
+                    removed++;
+                    continue;
+                }
+                if (kept != r) {
+                    std::copy(block.matrix.begin() + r * this->width,
+                        block.matrix.begin() + (r + 1) * this->width,
+                        block.matrix.begin() + kept * this->width);
+                    block.ids[kept] = block.ids[r];
+                }
+                kept++;
+            }
+            block.ids.resize(kept);
+            block.matrix.resize(kept * this->width);
+            reindex(block);
+        }
+
+        /* Drop emptied blocks */
+        size_t out = 0;
+        for (size_t b = 0; b < this->parts.size(); b++)
+            if (this->parts[b]->rows() != 0) {
+                this->parts[out] = this->parts[b];
+                this->owned[out] = this->owned[b];
+                out++;
+            }
+        this->parts.resize(out);
+        this->owned.resize(out);
+    }
+
+    /** @brief Replace every template of an identity with one template. */
+    ReturnStatus
+    update(
+        const Template &values,
+        uint32_t identity)
+    {
+        size_t removed;
+        this->remove(identity, removed);
+        return (this->enroll(values, identity));
+    }
+
+    /** @brief Return the number of templates after the batch. */
+    size_t
+    count() const
+    {
+        size_t n = 0;
+        for (const auto &b : this->parts)
+            n += b->rows();
+        return (n);
+    }
+
+    /** @brief Seal the batch as the given version. */
+    std::shared_ptr<const GallerySnapshot>
+    seal(
+        uint64_t version)
+    {
+        this->owned.assign(this->parts.size(), nullptr);
+        return (std::make_shared<const GallerySnapshot>(version, this->width,
+            this->parts));
+    }
+
+private:
+    GalleryBlock &
+    writable(
+        size_t b)
+    {
+        if (!this->owned[b]) {
+            this->owned[b] = std::make_shared<GalleryBlock>(*this->parts[b]);
+            this->parts[b] = this->owned[b];
+        }
+        return (*this->owned[b]);
+    }
+
+    static void
+    reindex(
+        GalleryBlock &block)
+    {
+        block.index.resize(block.rows());
+        for (size_t r = 0; r < block.rows(); r++)
+            block.index[r] = IdentityIndexEntry{block.ids[r],
+                static_cast<uint32_t>(r)};
+        std::stable_sort(block.index.begin(), block.index.end(),
+            [](const IdentityIndexEntry &a, const IdentityIndexEntry &b) {
+                return (a.identity < b.identity); });
+    }
+
+    uint64_t base;
+    size_t width;
+    size_t blockRows;
+    std::vector<std::shared_ptr<const GalleryBlock>> parts;
+    /* Blocks created by this batch, which it may still modify */
+    std::vector<std::shared_ptr<GalleryBlock>> owned;
+};
+
+/**
+ * @brief
+ * A gallery with versioned snapshots: searches read a consistent
+ * version while a writer prepares and atomically publishes the next one.
+ *
+ * @details
+ * current() never waits for a writer's batch to be prepared; it only
+ * copies a shared pointer, atomically.  That copy writes the snapshot's
+ * reference count, so processes forked to search a gallery that no
+ * longer changes should read it through peek(), which writes nothing.
+ * Published versions are retained until release(), and rollback()
+ * republishes any retained version, as a new version number, without
+ * copying templates.
+ * A version stays readable while any search holds it, even after
+ * release().
+ */
+class VersionedGallery {
+public:
+    /**
+     * @param[in] blockRows
+     * Rows per block; smaller blocks make batches cheaper to publish and
+     * larger ones make searches cheaper
+     */
+    explicit VersionedGallery(
+        size_t blockRows = 4096) :
+        blockRows{blockRows},
+        latest{0},
+        head{std::make_shared<const GallerySnapshot>(0, 0,
+            std::vector<std::shared_ptr<const GalleryBlock>>())}
+    {
+        this->retained[0] = this->head;
+    }
+
+    /**
+     * @brief
+     * Replace the gallery with the rows of a flat gallery, e.g. one built
+     * by createGallery(), as a new version.
+     */
+    ReturnStatus
+    load(
+        const GalleryView &gallery,
+        uint64_t &version)
+    {
+        std::lock_guard<std::mutex> lock(this->writer);
+        SnapshotBuilder batch(std::make_shared<const GallerySnapshot>(
+            this->latest, gallery.dimension,
+            std::vector<std::shared_ptr<const GalleryBlock>>()),
+            this->blockRows);
+        for (size_t row = 0; row < gallery.count; row++) {
+            const ReturnStatus rs = batch.enroll(gallery.templateAt(row),
+                gallery.dimension, gallery.ids[row]);
+            if (rs.code != ReturnCode::Success)
+                return (rs);
+        }
+        version = this->install(batch.seal(this->latest + 1));
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /** @brief Return the current version, for the duration of a search. */
+    std::shared_ptr<const GallerySnapshot>
+    current() const
+    {
+        return (std::atomic_load(&this->head));
+    }
+
+    /**
+     * @brief
+     * Return the current version without taking a reference to it.
+     *
+     * @details
+     * For searches in a process forked after the last publish(), where
+     * nothing publishes concurrently: unlike current(), it writes no
+     * reference count, so the snapshot's pages stay shared with the
+     * parent.  The version stays valid until this process publishes,
+     * rolls back or releases it.
+     */
+    const GallerySnapshot *
+    peek() const
+    {
+        return (this->head.get());
+    }
+
+    /** @brief Start a batch of mutations over the current version. */
+    SnapshotBuilder
+    begin() const
+    {
+        return (SnapshotBuilder(this->current(), this->blockRows));
+    }
+
+    /**
+     * @brief
+     * Start a batch that replaces the whole gallery: it begins empty, but
+     * publishes over the current version like any other batch.
+     */
+    SnapshotBuilder
+    beginEmpty() const
+    {
+        const std::shared_ptr<const GallerySnapshot> base = this->current();
+        return (SnapshotBuilder(std::make_shared<const GallerySnapshot>(
+            base->version(), 0,
+            std::vector<std::shared_ptr<const GalleryBlock>>()),
+            this->blockRows));
+    }
+
+    /**
+     * @brief
+     * Publish a batch as the next version.
+     *
+     * @details
+     * Fails if another batch was published after this one began, since
+     * its mutations would be lost; begin() again and re-apply.
+     *
+     * @param[in] batch
+     * Mutations to publish
+     * @param[out] version
+     * Number of the new version
+     */
+    ReturnStatus
+    publish(
+        SnapshotBuilder &batch,
+        uint64_t &version)
+    {
+        std::lock_guard<std::mutex> lock(this->writer);
+        if (batch.baseVersion() != this->current()->version())
+            return (ReturnStatus(ReturnCode::VendorError,
+                "gallery changed since the batch began"));
+        version = this->install(batch.seal(this->latest + 1));
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /**
+     * @brief
+     * Make a retained version current again, as a new version number.
+     *
+     * @param[in] target
+     * Retained version to restore
+     * @param[out] version
+     * Number of the new version
+     */
+    ReturnStatus
+    rollback(
+        uint64_t target,
+        uint64_t &version)
+    {
+        std::lock_guard<std::mutex> lock(this->writer);
+        const auto it = this->retained.find(target);
+        if (it == this->retained.end())
+            return (ReturnStatus(ReturnCode::InputLocationError,
+                "version " + std::to_string(target) + " is not retained"));
+        version = this->install(std::make_shared<const GallerySnapshot>(
+            this->latest + 1, it->second->dimension(),
+            it->second->blocks()));
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /**
+     * @brief
+     * Stop retaining a version for rollback.  The current version is
+     * always retained.
+     */
+    void
+    release(
+        uint64_t version)
+    {
+        std::lock_guard<std::mutex> lock(this->writer);
+        if (version != this->current()->version())
+            this->retained.erase(version);
+    }
+
+    /** @brief Return the retained version numbers, oldest first. */
+    std::vector<uint64_t>
+    versions() const
+    {
+        std::lock_guard<std::mutex> lock(this->writer);
+        std::vector<uint64_t> numbers;
+        for (const auto &r : this->retained)
+            numbers.push_back(r.first);
+        return (numbers);
+    }
+
+private:
+    /* Called with the writer lock held */
+    uint64_t
+    install(
+        std::shared_ptr<const GallerySnapshot> snapshot)
+    {
+        this->latest = snapshot->version();
+        this->retained[this->latest] = snapshot;
+        std::atomic_store(&this->head, snapshot);
+        return (this->latest);
+    }
+
+    size_t blockRows;
+    mutable std::mutex writer;
+    uint64_t latest;
+    std::shared_ptr<const GallerySnapshot> head;
+    std::map<uint64_t, std::shared_ptr<const GallerySnapshot>> retained;
+};
+}
+
+#endif /* FOFRA2018_SNAPSHOT_H_ */
@@ -0,0 +1,306 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_THREADS_H_
+#define FOFRA2018_THREADS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "fofra2018.h"
+
+namespace FOFRA {
+
+/**
+ * @brief
+ * A pool of worker threads that is safe to carry across fork().
+ *
+ * @details
+ * No thread is started until the pool is first used.  Each use checks the
+ * process ID, so a pool inherited through fork() abandons the parent's
+ * threads (which do not exist in the child) and starts its own.  Call
+ * stop() at the end of initialize() and createGallery() so the process
+ * is single-threaded when the NIST application forks; the threads are
+ * started again on the next use.
+ *
+ * Tasks must not throw or call parallelFor() on the same pool.  The pool
+ * must not be used concurrently with a call to fork() from another thread.
+ */
+class WorkerPool {
+public:
+    /**
+     * @brief
+     * Create a pool; no threads are started.
+     *
+     * @param[in] threads
+     * Number of threads to use, or 0 for one per hardware thread
+     */
+    explicit WorkerPool(
+        size_t threads = 0) :
+        count{threads != 0 ? threads :
+            std::max<size_t>(1, std::thread::hardware_concurrency())},
+        owner{0},
+        state{nullptr}
+        {}
+
+    ~WorkerPool()
+    {
+        this->stop();
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool &operator=(const WorkerPool&) = delete;
+
+    /** @brief Return the number of threads the pool uses. */
+    size_t
+    size() const
+    {
+        return (this->count);
+    }
+
+    /**
+     * @brief
+     * Queue a task to run on a worker thread, starting the workers if
+     * they are not running in this process.
+     */
+    void
+    submit(
+        std::function<void()> task)
+    {
+        State *s = this->running();
+        {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            s->tasks.push_back(std::move(task));
+        }
+        s->ready.notify_one();
+    }
+
+    /**
+     * @brief
+     * Run body over [0, n) in chunks of grain, on the calling thread and
+     * the workers, and return when every chunk is done.
+     *
+     * @details
+     * body(begin, end) is called once per chunk.  A pool of one thread
+     * runs everything on the calling thread and never starts a worker.
+     */
+    void
+    parallelFor(
+        size_t n,
+        size_t grain,
+        const std::function<void(size_t, size_t)> &body)
+    {
+        if (n == 0)
+            return;
+        grain = std::max<size_t>(1, grain);
+        const size_t chunks = (n + grain - 1) / grain;
+        const size_t helpers = std::min(this->count, chunks) - 1;
+        if (helpers == 0) {
+            body(0, n);
+            return;
+        }
+
+        std::atomic<size_t> next{0};
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t pending = helpers;
+        auto work = [&]() {
+            for (size_t c = next++; c < chunks; c = next++)
+                body(c * grain, std::min(n, (c + 1) * grain));
+        };
+
+        for (size_t i = 0; i < helpers; i++)
+            this->submit([&]() {
+                work();
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--pending == 0)
+                    done.notify_one();
+            });
+        work();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&]() { return (pending == 0); });
+    }
+
+    /**
+     * @brief
+     * Finish queued tasks and join the workers.  The pool may be used
+     * again afterwards.
+     */
+    void
+    stop()
+    {
+        std::lock_guard<std::mutex> lock(this->startMutex);
+        if (this->state == nullptr)
+            return;
+        if (this->owner == getpid()) {
+            {
+                std::lock_guard<std::mutex> stateLock(this->state->mutex);
+                this->state->stopping = true;
+            }
+            this->state->ready.notify_all();
+            for (auto &t : this->state->threads)
+                t.join();
+            delete this->state;
+        }
+        /* Otherwise the workers belong to the parent; leak their state */
+        this->state = nullptr;
+    }
+
+private:
+    struct State {
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<std::function<void()>> tasks;
+        std::vector<std::thread> threads;
+        bool stopping = false;
+    };
+
+    /* Return the workers of this process, starting them if needed */
+    State *
+    running()
+    {
+        std::lock_guard<std::mutex> lock(this->startMutex);
+        const pid_t pid = getpid();
+        if (this->state != nullptr && this->owner != pid) {
+            /*
+             * Inherited through fork(): the threads were not copied and
+             * their state may be mid-update, so never touch it again.
+             */
+            this->state = nullptr;
+        }
+        if (this->state == nullptr) {
+            this->state = new State();
+            this->owner = pid;
+            for (size_t i = 0; i < this->count; i++)
+                this->state->threads.emplace_back(loop, this->state);
+        }
+        return (this->state);
+    }
+
+    static void
+    loop(
+        State *s)
+    {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(s->mutex);
+                s->ready.wait(lock, [s]() {
+                    return (s->stopping || !s->tasks.empty()); });
+                if (s->tasks.empty())
+                    return;
+                task = std::move(s->tasks.front());
+                s->tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    size_t count;
+    std::mutex startMutex;
+    pid_t owner;
+    State *state;
+};
+
+/**
+ * @brief
+ * Report the private dirty memory of a process, i.e. the pages it has
+ * written and holds alone.
+ *
+ * @details
+ * After fork(), this is what each child costs beyond the pages shared with
+ * its parent.  Comparing it before and after a search workload in a child
+ * shows how much shared gallery or model state the workload copied.
+ * Linux only; reads /proc/<pid>/smaps_rollup, or smaps on older kernels.
+ *
+ * @param[in] pid
+ * Process to measure, e.g. getpid()
+ * @param[out] bytes
+ * Private dirty bytes of the process
+ */
+inline ReturnStatus
+privateDirtyBytes(
+    pid_t pid,
+    uint64_t &bytes)
+{
+    const std::string proc = "/proc/" + std::to_string(pid);
+    std::ifstream smaps(proc + "/smaps_rollup");
+    if (!smaps)
+        smaps.open(proc + "/smaps");
+    if (!smaps)
+        return (ReturnStatus(ReturnCode::InputLocationError,
+            proc + ": cannot read memory map"));
+
+    const std::string field = "Private_Dirty:";
+    uint64_t kilobytes = 0;
+    std::string line;
+    while (std::getline(smaps, line))
+        if (line.compare(0, field.size(), field) == 0)
+            kilobytes += std::stoull(line.substr(field.size()));
+    bytes = kilobytes * 1024;
+    return (ReturnStatus(ReturnCode::Success));
+}
+
+/**
+ * @brief
+ * Report how much of a range of this process's address space is resident
+ * in physical memory.
+ *
+ * @details
+ * The range is widened to whole pages, so adjacent ranges that share a
+ * page both count it.  Linux only; uses mincore().
+ *
+ * @param[in] address
+ * Start of the range
+ * @param[in] length
+ * Length of the range in bytes
+ * @param[out] bytes
+ * Resident bytes of the range
+ */
+inline ReturnStatus
+residentBytes(
+    const void *address,
+    size_t length,
+    uint64_t &bytes)
+{
+    bytes = 0;
+    if (length == 0)
+        return (ReturnStatus(ReturnCode::Success));
+    const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    const uintptr_t first = reinterpret_cast<uintptr_t>(address) / page *
+        page;
+    const uintptr_t last = (reinterpret_cast<uintptr_t>(address) + length +
+        page - 1) / page * page;
+    std::vector<unsigned char> resident((last - first) / page);
+    if (mincore(reinterpret_cast<void*>(first), last - first,
+        resident.data()) != 0)
+        return (ReturnStatus(ReturnCode::VendorError, "mincore failed"));
+    for (const auto r : resident)
+        if (r & 1)
+            bytes += page;
+    return (ReturnStatus(ReturnCode::Success));
+}
+}
+
+#endif /* FOFRA2018_THREADS_H_ */
@@ -0,0 +1,149 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+/*
+ * Trains a CalibrationTable for fused scores and writes it to a model
+ * directory.  The input is a text file of "score genuine" lines, genuine
+ * being 1/0 or TRUE/FALSE (as written by R), optionally after a header
+ * line: the fused scores of a development set of comparisons.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "fofra2018.h"
+#include "fofra2018_calibration.h"
+
+using namespace FOFRA;
+
+namespace {
+
+void
+usage(
+    const char *argv0)
+{
+    std::cerr << "Usage: " << argv0 << " <model dir> <scores file> "
+        "[options]\n"
+        "  --output <kind>     llr or probability (llr)\n"
+        "  --knots <n>         largest number of knots (256)\n";
+}
+
+bool
+parseLabel(
+    const std::string &value,
+    bool &genuine)
+{
+    if (value == "1" || value == "TRUE" || value == "true") {
+        genuine = true;
+        return (true);
+    }
+    if (value == "0" || value == "FALSE" || value == "false") {
+        genuine = false;
+        return (true);
+    }
+    return (false);
+}
+
+bool
+readScores(
+    const std::string &path,
+    std::vector<double> &scores,
+    std::vector<bool> &genuine)
+{
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << path << ": cannot open\n";
+        return (false);
+    }
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); number++) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        std::istringstream fields(line);
+        std::string label;
+        double score;
+        bool mate;
+        if (!(fields >> score >> label) || !parseLabel(label, mate)) {
+            if (number == 1)
+                continue;
+            std::cerr << path << ":" << number << ": cannot parse \"" <<
+                line << "\"\n";
+            return (false);
+        }
+        scores.push_back(score);
+        genuine.push_back(mate);
+    }
+    return (true);
+}
+}
+
+int
+main(
+    int argc,
+    char *argv[])
+{
+    if (argc < 3 || argv[1][0] == '-' || argv[2][0] == '-') {
+        usage(argv[0]);
+        return (EXIT_FAILURE);
+    }
+    const std::string modelDir = argv[1];
+    auto output = CalibrationTable::Output::LogLikelihoodRatio;
+    size_t knots = 256;
+    for (int i = 3; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return (EXIT_FAILURE);
+        }
+        const std::string value = argv[++i];
+        if (arg == "--output" && value == "llr")
+            output = CalibrationTable::Output::LogLikelihoodRatio;
+        else if (arg == "--output" && value == "probability")
+            output = CalibrationTable::Output::Probability;
+        else if (arg == "--knots")
+            knots = std::stoul(value);
+        else {
+            usage(argv[0]);
+            return (EXIT_FAILURE);
+        }
+    }
+
+    std::vector<double> scores;
+    std::vector<bool> genuine;
+    if (!readScores(argv[2], scores, genuine))
+        return (EXIT_FAILURE);
+
+    CalibrationTable table;
+    const auto start = std::chrono::steady_clock::now();
+    const ReturnStatus rs = trainCalibration(scores, genuine, output, knots,
+        table);
+    if (rs.code == ReturnCode::Success) {
+        const ReturnStatus written = table.write(modelDir);
+        if (written.code != ReturnCode::Success) {
+            std::cerr << written.code << " (" << written.info << ")\n";
+            return (EXIT_FAILURE);
+        }
+    } else {
+        std::cerr << rs.code << " (" << rs.info << ")\n";
+        return (EXIT_FAILURE);
+    }
+
+    std::cout << scores.size() << " scores -> " << table.scores.size() <<
+        " knots in " << std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count() << " s; " <<
+        "calibrated range " << table.values.front() << " to " <<
+        table.values.back() << "\n";
+    return (EXIT_SUCCESS);
+}
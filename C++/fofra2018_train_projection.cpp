@@ -0,0 +1,270 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+/*
+ * Trains a ProjectionModel for Action::Fuse from K files of training
+ * templates, one per algorithm, and writes it to a model directory.  Each
+ * input file holds N row-major templates of one algorithm as raw host
+ * doubles (or floats with ":f32"); row i of every file is the same image.
+ * The files are memory-mapped and streamed, so N is limited by disk, not
+ * memory.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fofra2018.h"
+#include "fofra2018_projection.h"
+#include "fofra2018_threads.h"
+
+using namespace FOFRA;
+
+namespace {
+
+struct Input {
+    std::string path;
+    size_t dimension = 0;
+    bool single = false;
+    const unsigned char *data = nullptr;
+    size_t bytes = 0;
+};
+
+/* Concatenates row i of each mapped input file */
+class MappedRowSource : public RowSource {
+public:
+    MappedRowSource(
+        std::vector<Input> &inputs,
+        size_t rows) :
+        inputs(inputs),
+        count{rows},
+        length{0}
+    {
+        for (const auto &input : inputs)
+            this->length += input.dimension;
+    }
+
+    size_t
+    rows() const
+    {
+        return (this->count);
+    }
+
+    size_t
+    dimension() const
+    {
+        return (this->length);
+    }
+
+    void
+    read(
+        size_t first,
+        size_t count,
+        double *out) const
+    {
+        for (size_t r = 0; r < count; r++) {
+            double *row = out + r * this->length;
+            for (const auto &input : this->inputs) {
+                const size_t D = input.dimension;
+                if (input.single) {
+                    const float *v = reinterpret_cast<const float*>(
+                        input.data) + (first + r) * D;
+                    for (size_t i = 0; i < D; i++)
+                        row[i] = v[i];
+                } else
+                    std::memcpy(row, reinterpret_cast<const double*>(
+                        input.data) + (first + r) * D, D * sizeof(double));
+                row += D;
+            }
+        }
+    }
+
+private:
+    const std::vector<Input> &inputs;
+    size_t count;
+    size_t length;
+};
+
+void
+usage(
+    const char *argv0)
+{
+    std::cerr << "Usage: " << argv0 << " <model dir> --components <k> "
+        "--input <file>:<dim>[:f32] [--input ...] [options]\n"
+        "  --components <k>    fused template dimension\n"
+        "  --input <file>:<d>  N x d templates of one algorithm, in order\n"
+        "  --oversample <p>    extra random directions (10)\n"
+        "  --power <q>         power iterations (2)\n"
+        "  --whiten            scale components to unit variance\n"
+        "  --threads <n>       worker threads (default: one per CPU)\n"
+        "  --block <rows>      rows read per block (4096)\n"
+        "  --seed <n>          random seed (2018)\n";
+}
+
+bool
+parseInput(
+    const std::string &value,
+    Input &input)
+{
+    std::string spec = value;
+    if (spec.size() > 4 && spec.compare(spec.size() - 4, 4, ":f32") == 0) {
+        input.single = true;
+        spec.resize(spec.size() - 4);
+    }
+    const auto colon = spec.rfind(':');
+    if (colon == std::string::npos || colon == 0)
+        return (false);
+    input.path = spec.substr(0, colon);
+    input.dimension = std::strtoul(spec.c_str() + colon + 1, nullptr, 10);
+    return (input.dimension > 0);
+}
+
+bool
+mapInput(
+    Input &input,
+    size_t &rows)
+{
+    const int fd = open(input.path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::perror(input.path.c_str());
+        if (fd >= 0)
+            close(fd);
+        return (false);
+    }
+    input.bytes = static_cast<size_t>(st.st_size);
+    const size_t rowBytes = input.dimension *
+        (input.single ? sizeof(float) : sizeof(double));
+    if (input.bytes == 0 || input.bytes % rowBytes != 0) {
+        std::cerr << input.path << ": size is not a multiple of " <<
+            rowBytes << " bytes\n";
+        close(fd);
+        return (false);
+    }
+    void *p = mmap(nullptr, input.bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        std::perror(input.path.c_str());
+        return (false);
+    }
+    /* Each block is read once per pass, front to back */
+    madvise(p, input.bytes, MADV_SEQUENTIAL);
+    input.data = static_cast<const unsigned char*>(p);
+    rows = input.bytes / rowBytes;
+    return (true);
+}
+}
+
+int
+main(
+    int argc,
+    char *argv[])
+{
+    if (argc < 2 || argv[1][0] == '-') {
+        usage(argv[0]);
+        return (EXIT_FAILURE);
+    }
+    const std::string modelDir = argv[1];
+    ProjectionTraining parameters;
+    std::vector<Input> inputs;
+    size_t threads = 0;
+    for (int i = 2; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--whiten") {
+            parameters.whiten = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return (EXIT_FAILURE);
+        }
+        const std::string value = argv[++i];
+        Input input;
+        if (arg == "--input" && parseInput(value, input))
+            inputs.push_back(input);
+        else if (arg == "--components")
+            parameters.components = std::stoul(value);
+        else if (arg == "--oversample")
+            parameters.oversample = std::stoul(value);
+        else if (arg == "--power")
+            parameters.powerIterations = std::stoul(value);
+        else if (arg == "--threads")
+            threads = std::stoul(value);
+        else if (arg == "--block")
+            parameters.blockRows = std::stoul(value);
+        else if (arg == "--seed")
+            parameters.seed = std::stoull(value);
+        else {
+            usage(argv[0]);
+            return (EXIT_FAILURE);
+        }
+    }
+    if (inputs.empty() || parameters.components == 0) {
+        usage(argv[0]);
+        return (EXIT_FAILURE);
+    }
+
+    size_t N = 0;
+    std::vector<uint64_t> dimensions;
+    for (auto &input : inputs) {
+        size_t rows;
+        if (!mapInput(input, rows))
+            return (EXIT_FAILURE);
+        if (N != 0 && rows != N) {
+            std::cerr << input.path << ": " << rows << " templates, " <<
+                "expected " << N << "\n";
+            return (EXIT_FAILURE);
+        }
+        N = rows;
+        dimensions.push_back(input.dimension);
+    }
+
+    MappedRowSource source(inputs, N);
+    WorkerPool pool(threads);
+    ProjectionModel model;
+    const auto start = std::chrono::steady_clock::now();
+    const ReturnStatus rs = trainProjection(source, dimensions, parameters,
+        pool, model);
+    if (rs.code == ReturnCode::Success) {
+        const ReturnStatus written = model.write(modelDir);
+        if (written.code != ReturnCode::Success) {
+            std::cerr << written.code << " (" << written.info << ")\n";
+            return (EXIT_FAILURE);
+        }
+    } else {
+        std::cerr << rs.code << " (" << rs.info << ")\n";
+        return (EXIT_FAILURE);
+    }
+
+    double kept = 0.0;
+    for (const auto v : model.variances)
+        kept += v;
+    std::cout << N << " templates, D = " << source.dimension() <<
+        " -> k = " << model.outputDimension() << " in " <<
+        std::chrono::duration<double>(std::chrono::steady_clock::now() -
+        start).count() << " s on " << pool.size() << " threads; " <<
+        "leading variances";
+    for (size_t c = 0; c < std::min<size_t>(5, model.variances.size()); c++)
+        std::cout << " " << model.variances[c];
+    std::cout << "; kept variance " << kept << "\n";
+    for (auto &input : inputs)
+        munmap(const_cast<unsigned char*>(input.data), input.bytes);
+    return (EXIT_SUCCESS);
+}
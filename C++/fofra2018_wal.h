@@ -0,0 +1,747 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+#ifndef FOFRA2018_WAL_H_
+#define FOFRA2018_WAL_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fofra2018.h"
+#include "fofra2018_gallery.h"
+#include "fofra2018_snapshot.h"
+
+namespace FOFRA {
+
+/** @brief One change to an identification gallery */
+struct GalleryMutation {
+    /** @brief Kind of change */
+    enum class Type : uint32_t {
+        /** Add a template for an identity */
+        Enroll = 1,
+        /** Remove every template of an identity */
+        Remove,
+        /** Replace every template of an identity with one */
+        Update
+    };
+
+    /** @brief Kind of change */
+    Type type;
+    /** @brief Identity changed */
+    uint32_t identity;
+    /** @brief Template, empty for Type::Remove */
+    Template values;
+};
+using GalleryMutation = struct GalleryMutation;
+
+/** @brief Apply mutations, in order, to a batch. */
+inline ReturnStatus
+applyMutations(
+    const std::vector<GalleryMutation> &mutations,
+    SnapshotBuilder &batch)
+{
+    for (const auto &m : mutations) {
+        ReturnStatus rs(ReturnCode::Success);
+        size_t removed;
+        switch (m.type) {
+        case GalleryMutation::Type::Enroll:
+            rs = batch.enroll(m.values, m.identity);
+            break;
+        case GalleryMutation::Type::Remove:
+            batch.remove(m.identity, removed);
+            break;
+        case GalleryMutation::Type::Update:
+            rs = batch.update(m.values, m.identity);
+            break;
+        }
+        if (rs.code != ReturnCode::Success)
+            return (rs);
+    }
+    return (ReturnStatus(ReturnCode::Success));
+}
+
+namespace Log {
+
+/** @brief CRC-32 (IEEE 802.3) of a byte range */
+inline uint32_t
+crc32(
+    const uint8_t *data,
+    size_t size)
+{
+    static const struct Table {
+        uint32_t entries[256];
+        Table()
+        {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? UINT32_C(0xEDB88320) ^ (c >> 1) : c >> 1;
+                this->entries[i] = c;
+            }
+        }
+    } table;
+    uint32_t c = UINT32_C(0xFFFFFFFF);
+    for (size_t i = 0; i < size; i++)
+        c = table.entries[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    return (c ^ UINT32_C(0xFFFFFFFF));
+}
+
+/*
+ * A record is a header of payload length and CRC-32 of the payload, then
+ * the payload: LSN, type, identity, dimension, padding and the template.
+ * Fields are in host byte order.
+ */
+struct RecordHeader {
+    uint32_t payloadBytes;
+    uint32_t crc;
+};
+
+struct RecordPayload {
+    uint64_t lsn;
+    uint32_t type;
+    uint32_t identity;
+    uint32_t dimension;
+    uint32_t reserved;
+};
+
+inline void
+encode(
+    uint64_t lsn,
+    const GalleryMutation &m,
+    std::vector<uint8_t> &out)
+{
+    RecordPayload p;
+    p.lsn = lsn;
+    p.type = static_cast<uint32_t>(m.type);
+    p.identity = m.identity;
+    p.dimension = static_cast<uint32_t>(m.values.size());
+    p.reserved = 0;
+    const size_t payloadBytes = sizeof(p) + m.values.size() * sizeof(double);
+
+    const size_t start = out.size();
+    out.resize(start + sizeof(RecordHeader) + payloadBytes);
+    uint8_t *payload = out.data() + start + sizeof(RecordHeader);
+    std::memcpy(payload, &p, sizeof(p));
+    if (!m.values.empty())
+        std::memcpy(payload + sizeof(p), m.values.data(),
+            m.values.size() * sizeof(double));
+    RecordHeader h;
+    h.payloadBytes = static_cast<uint32_t>(payloadBytes);
+    h.crc = crc32(payload, payloadBytes);
+    std::memcpy(out.data() + start, &h, sizeof(h));
+}
+
+/* Write all of a buffer, retrying short writes */
+inline bool
+writeAll(
+    int fd,
+    const uint8_t *data,
+    size_t size)
+{
+    while (size > 0) {
+        const ssize_t rv = write(fd, data, size);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return (false);
+        data += rv;
+        size -= static_cast<size_t>(rv);
+    }
+    return (true);
+}
+
+inline bool
+syncDirectory(
+    const std::string &directory)
+{
+    const int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return (false);
+    const bool ok = (fsync(fd) == 0);
+    close(fd);
+    return (ok);
+}
+
+/* LSNs in names of the form <prefix><lsn><suffix>, ascending */
+inline std::vector<uint64_t>
+listNumbered(
+    const std::string &directory,
+    const std::string &prefix,
+    const std::string &suffix)
+{
+    std::vector<uint64_t> numbers;
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr)
+        return (numbers);
+    while (const struct dirent *e = readdir(dir)) {
+        const std::string name = e->d_name;
+        if (name.size() <= prefix.size() + suffix.size() ||
+            name.compare(0, prefix.size(), prefix) != 0 ||
+            name.compare(name.size() - suffix.size(), suffix.size(),
+            suffix) != 0)
+            continue;
+        const std::string digits = name.substr(prefix.size(),
+            name.size() - prefix.size() - suffix.size());
+        if (digits.find_first_not_of("0123456789") == std::string::npos)
+            numbers.push_back(std::stoull(digits));
+    }
+    closedir(dir);
+    std::sort(numbers.begin(), numbers.end());
+    return (numbers);
+}
+}
+
+/**
+ * @brief
+ * A durable, append-only log of gallery mutations with checkpoints in
+ * the flat gallery image format of MappedGallery.
+ *
+ * @details
+ * The directory holds checkpoint.<lsn>.gal, the gallery after every
+ * mutation up to log sequence number lsn, and log segments
+ * wal.<first lsn>.log.  Each record carries a CRC, so recovery stops at a
+ * torn write at the end of the log.
+ *
+ * append() is group-committed: threads appending at the same time have
+ * their records written and synced together by whichever of them gets
+ * there first, so one fdatasync() covers many batches.
+ */
+class GalleryLog {
+public:
+    GalleryLog() :
+        fd{-1},
+        segmentStart{0},
+        next{1},
+        durable{0},
+        flushing{false},
+        broken{false}
+        {}
+
+    ~GalleryLog()
+    {
+        if (this->fd >= 0)
+            close(this->fd);
+    }
+
+    GalleryLog(const GalleryLog&) = delete;
+    GalleryLog &operator=(const GalleryLog&) = delete;
+
+    /**
+     * @brief
+     * Recover the gallery from a log directory and open the log for
+     * appending.
+     *
+     * @details
+     * Loads the newest checkpoint into the gallery, if there is one, then
+     * replays the records after it as one batch.  Without a checkpoint,
+     * the records are replayed onto the gallery as it is, so checkpoint a
+     * gallery loaded from createGallery() before logging changes to it.
+     * A torn or corrupt record ends the replay; later appends go to a new
+     * segment.
+     *
+     * @param[in] directory
+     * Log directory, created if missing
+     * @param[in,out] gallery
+     * Gallery to recover into
+     * @param[out] lsn
+     * LSN of the last mutation recovered
+     */
+    ReturnStatus
+    open(
+        const std::string &directory,
+        VersionedGallery &gallery,
+        uint64_t &lsn)
+    {
+        this->directory = directory;
+        mkdir(directory.c_str(), 0755);
+
+        uint64_t version;
+        uint64_t last = 0;
+        const std::vector<uint64_t> checkpoints = Log::listNumbered(
+            directory, "checkpoint.", ".gal");
+        if (!checkpoints.empty()) {
+            last = checkpoints.back();
+            MappedGallery image;
+            ReturnStatus rs = image.attach(this->checkpointPath(last));
+            if (rs.code == ReturnCode::Success)
+                rs = gallery.load(image.view(), version);
+            if (rs.code != ReturnCode::Success)
+                return (rs);
+        }
+
+        SnapshotBuilder batch = gallery.begin();
+        std::vector<GalleryMutation> mutations;
+        for (const auto start : Log::listNumbered(directory, "wal.", ".log")) {
+            /* Cut a torn tail so that appends after it stay reachable */
+            off_t valid;
+            bool torn;
+            const std::string path = this->segmentPath(start);
+            const ReturnStatus read = this->replay(path, last, mutations,
+                torn, valid);
+            if (read.code != ReturnCode::Success)
+                return (read);
+            if (torn) {
+                if (truncate(path.c_str(), valid) != 0)
+                    return (ReturnStatus(ReturnCode::VendorError,
+                        path + ": " + std::strerror(errno)));
+                break;
+            }
+        }
+        /* Segments past a break are unreachable; never replay them later */
+        for (const auto start : Log::listNumbered(directory, "wal.", ".log"))
+            if (start > last + 1)
+                unlink(this->segmentPath(start).c_str());
+        ReturnStatus rs = applyMutations(mutations, batch);
+        if (rs.code == ReturnCode::Success && !mutations.empty())
+            rs = gallery.publish(batch, version);
+        if (rs.code != ReturnCode::Success)
+            return (rs);
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->next = last + 1;
+        this->durable = last;
+        lsn = last;
+        return (this->rotate());
+    }
+
+    /**
+     * @brief
+     * Append a batch of mutations and wait until it is durable.
+     *
+     * @param[in] mutations
+     * Mutations, in order
+     * @param[out] first
+     * LSN of the first mutation; the batch has consecutive LSNs
+     */
+    ReturnStatus
+    append(
+        const std::vector<GalleryMutation> &mutations,
+        uint64_t &first)
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        if (this->broken || this->fd < 0)
+            return (ReturnStatus(ReturnCode::VendorError,
+                "gallery log is not writable"));
+        first = this->next;
+        for (const auto &m : mutations)
+            Log::encode(this->next++, m, this->pending);
+        const uint64_t last = this->next - 1;
+
+        while (this->durable < last && !this->broken) {
+            if (this->flushing) {
+                this->flushed.wait(lock);
+                continue;
+            }
+            /* Lead a group commit of everything pending */
+            this->flushing = true;
+            std::vector<uint8_t> group;
+            group.swap(this->pending);
+            const uint64_t through = this->next - 1;
+            const int out = this->fd;
+            lock.unlock();
+            const bool ok = Log::writeAll(out, group.data(), group.size()) &&
+                fdatasync(out) == 0;
+            lock.lock();
+            this->flushing = false;
+            if (ok)
+                this->durable = through;
+            else
+                this->broken = true;
+            this->flushed.notify_all();
+        }
+        if (this->broken)
+            return (ReturnStatus(ReturnCode::VendorError,
+                "gallery log write failed"));
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /**
+     * @brief
+     * Write a checkpoint of a gallery version and drop the log segments
+     * and checkpoints it makes redundant.
+     *
+     * @param[in] snapshot
+     * Gallery with every mutation up to lsn applied, and no later one
+     * @param[in] lsn
+     * LSN of the last mutation in snapshot; must be durable
+     */
+    ReturnStatus
+    checkpoint(
+        const GallerySnapshot &snapshot,
+        uint64_t lsn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (lsn > this->durable)
+                return (ReturnStatus(ReturnCode::VendorError,
+                    "checkpoint is ahead of the log"));
+        }
+
+        std::vector<Template> templates;
+        std::vector<uint32_t> ids;
+        templates.reserve(snapshot.count());
+        ids.reserve(snapshot.count());
+        for (const auto &b : snapshot.blocks())
+            for (size_t r = 0; r < b->rows(); r++) {
+                templates.emplace_back(b->matrix.begin() + r * b->dimension,
+                    b->matrix.begin() + (r + 1) * b->dimension);
+                ids.push_back(b->ids[r]);
+            }
+        MappedGallery image;
+        ReturnStatus rs = image.build(templates, ids);
+        if (rs.code == ReturnCode::Success)
+            rs = image.publish(this->checkpointPath(lsn));
+        if (rs.code != ReturnCode::Success)
+            return (rs);
+        if (!Log::syncDirectory(this->directory))
+            return (ReturnStatus(ReturnCode::VendorError,
+                this->directory + ": " + std::strerror(errno)));
+
+        /* Later appends go to a new segment; drop what lsn covers */
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (this->flushing)
+            this->flushed.wait(lock);
+        if (!this->pending.empty()) {
+            if (!Log::writeAll(this->fd, this->pending.data(),
+                this->pending.size()) || fdatasync(this->fd) != 0) {
+                this->broken = true;
+                return (ReturnStatus(ReturnCode::VendorError,
+                    "gallery log write failed"));
+            }
+            this->pending.clear();
+            this->durable = this->next - 1;
+            this->flushed.notify_all();
+        }
+        rs = this->rotate();
+        if (rs.code != ReturnCode::Success)
+            return (rs);
+
+        const std::vector<uint64_t> segments = Log::listNumbered(
+            this->directory, "wal.", ".log");
+        for (size_t i = 0; i + 1 < segments.size(); i++)
+            if (segments[i + 1] - 1 <= lsn)
+                unlink(this->segmentPath(segments[i]).c_str());
+        for (const auto c : Log::listNumbered(this->directory, "checkpoint.",
+            ".gal"))
+            if (c < lsn)
+                unlink(this->checkpointPath(c).c_str());
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+private:
+    std::string
+    checkpointPath(
+        uint64_t lsn) const
+    {
+        return (this->directory + "/checkpoint." + std::to_string(lsn) +
+            ".gal");
+    }
+
+    std::string
+    segmentPath(
+        uint64_t start) const
+    {
+        return (this->directory + "/wal." + std::to_string(start) + ".log");
+    }
+
+    /* Start a segment at next; called with the mutex held */
+    ReturnStatus
+    rotate()
+    {
+        if (this->fd >= 0 && this->segmentStart == this->next)
+            return (ReturnStatus(ReturnCode::Success));
+        const std::string path = this->segmentPath(this->next);
+        const int out = ::open(path.c_str(),
+            O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (out < 0 || !Log::syncDirectory(this->directory)) {
+            if (out >= 0)
+                close(out);
+            return (ReturnStatus(ReturnCode::VendorError,
+                path + ": " + std::strerror(errno)));
+        }
+        if (this->fd >= 0)
+            close(this->fd);
+        this->fd = out;
+        this->segmentStart = this->next;
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    /*
+     * Collect the records of a segment after LSN last, advancing last.
+     * Stops with torn set at a record whose header or CRC is bad, valid
+     * being the length of the segment before it.  A segment that cannot
+     * be read, or an intact record out of sequence, fails instead, so
+     * that good records are never cut.
+     */
+    ReturnStatus
+    replay(
+        const std::string &path,
+        uint64_t &last,
+        std::vector<GalleryMutation> &mutations,
+        bool &torn,
+        off_t &valid) const
+    {
+        torn = false;
+        valid = 0;
+        const int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0)
+            return (ReturnStatus(ReturnCode::VendorError,
+                path + ": " + std::strerror(errno)));
+        struct stat st;
+        if (fstat(in, &st) != 0) {
+            const int error = errno;
+            close(in);
+            return (ReturnStatus(ReturnCode::VendorError,
+                path + ": " + std::strerror(error)));
+        }
+        std::vector<uint8_t> data(static_cast<size_t>(st.st_size));
+        size_t got = 0;
+        while (got < data.size()) {
+            const ssize_t rv = read(in, data.data() + got,
+                data.size() - got);
+            if (rv < 0 && errno == EINTR)
+                continue;
+            if (rv <= 0) {
+                const int error = (rv < 0) ? errno : EIO;
+                close(in);
+                return (ReturnStatus(ReturnCode::VendorError,
+                    path + ": " + std::strerror(error)));
+            }
+            got += static_cast<size_t>(rv);
+        }
+        close(in);
+
+        size_t at = 0;
+        while (at + sizeof(Log::RecordHeader) <= data.size()) {
+            valid = static_cast<off_t>(at);
+            Log::RecordHeader h;
+            std::memcpy(&h, data.data() + at, sizeof(h));
+            const uint8_t *payload = data.data() + at + sizeof(h);
+            Log::RecordPayload p;
+            if (h.payloadBytes < sizeof(p) ||
+                h.payloadBytes > data.size() - at - sizeof(h) ||
+                Log::crc32(payload, h.payloadBytes) != h.crc) {
+                torn = true;
+                return (ReturnStatus(ReturnCode::Success));
+            }
+            std::memcpy(&p, payload, sizeof(p));
+            if (h.payloadBytes != sizeof(p) + p.dimension * sizeof(double) ||
+                p.type < 1 || p.type > 3) {
+                torn = true;
+                return (ReturnStatus(ReturnCode::Success));
+            }
+            at += sizeof(h) + h.payloadBytes;
+            if (p.lsn <= last)
+                continue;
+            if (p.lsn != last + 1)
+                return (ReturnStatus(ReturnCode::VendorError,
+                    path + ": record " + std::to_string(p.lsn) +
+                    " follows " + std::to_string(last)));
+
+            GalleryMutation m;
+            m.type = static_cast<GalleryMutation::Type>(p.type);
+            m.identity = p.identity;
+            m.values.resize(p.dimension);
+            if (p.dimension != 0)
+                std::memcpy(&m.values[0], payload + sizeof(p),
+                    p.dimension * sizeof(double));
+            mutations.push_back(std::move(m));
+            last = p.lsn;
+        }
+        valid = static_cast<off_t>(at);
+        torn = (at != data.size());
+        return (ReturnStatus(ReturnCode::Success));
+    }
+
+    std::string directory;
+    std::mutex mutex;
+    std::condition_variable flushed;
+    int fd;
+    uint64_t segmentStart;
+    uint64_t next;
+    uint64_t durable;
+    bool flushing;
+    bool broken;
+    std::vector<uint8_t> pending;
+};
+
+/**
+ * @brief
+ * A VersionedGallery whose mutations are logged before they are
+ * published, so a restart recovers every acknowledged mutation.
+ *
+ * @details
+ * Batches from many threads are logged together by group commit, then
+ * published one at a time in log order, so the published gallery always
+ * equals the replay of a prefix of the log.  Every change to the gallery
+ * must go through apply().
+ */
+class DurableGallery {
+public:
+    /**
+     * @brief
+     * Called with each batch once it is published, in log order, e.g. to
+     * forward it to replicas.  Must not call back into the gallery.
+     */
+    using Observer = std::function<void(uint64_t first,
+        const std::vector<GalleryMutation> &mutations)>;
+
+    explicit DurableGallery(
+        VersionedGallery &gallery) :
+        gallery(gallery),
+        applied{0},
+        dimension{0},
+        failed{false}
+        {}
+
+    /** @brief Recover the gallery from a log directory; see GalleryLog. */
+    ReturnStatus
+    open(
+        const std::string &directory)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        return (this->log.open(directory, this->gallery, this->applied));
+    }
+
+    /**
+     * @brief
+     * Log a batch of mutations, then publish it as a new version.
+     *
+     * @param[in] mutations
+     * Mutations, in order
+     * @param[out] version
+     * Gallery version that first includes the batch
+     */
+    ReturnStatus
+    apply(
+        const std::vector<GalleryMutation> &mutations,
+        uint64_t &version)
+    {
+        if (mutations.empty()) {
+            version = this->gallery.current()->version();
+            return (ReturnStatus(ReturnCode::Success));
+        }
+        /*
+         * Reject what replay could not apply before it is logged.  The
+         * first enrollment fixes the dimension under the mutex, before
+         * its record is appended, so concurrent first enrollments of
+         * different dimensions cannot both reach the log.
+         */
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            size_t dimension = (this->dimension != 0) ? this->dimension :
+                this->gallery.current()->dimension();
+            for (const auto &m : mutations) {
+                if (m.type == GalleryMutation::Type::Remove)
+                    continue;
+                if (dimension == 0)
+                    dimension = m.values.size();
+                if (m.values.empty() || m.values.size() != dimension)
+                    return (ReturnStatus(ReturnCode::NonCongruentVectors,
+                        "template and gallery differ in dimension"));
+            }
+            this->dimension = dimension;
+        }
+
+        uint64_t first;
+        ReturnStatus rs = this->log.append(mutations, first);
+
+        /* Publish in log order */
+        std::unique_lock<std::mutex> lock(this->mutex);
+        if (rs.code != ReturnCode::Success) {
+            this->failed = true;
+            this->ordered.notify_all();
+            return (rs);
+        }
+        while (this->applied != first - 1 && !this->failed)
+            this->ordered.wait(lock);
+        if (this->failed)
+            return (ReturnStatus(ReturnCode::VendorError,
+                "an earlier batch was not logged"));
+
+        SnapshotBuilder batch = this->gallery.begin();
+        rs = applyMutations(mutations, batch);
+        if (rs.code == ReturnCode::Success)
+            rs = this->gallery.publish(batch, version);
+        /* Logged, so replay would apply it: never leave a gap */
+        this->applied = first + mutations.size() - 1;
+        if (rs.code != ReturnCode::Success)
+            this->failed = true;
+        else if (this->observer)
+            this->observer(first, mutations);
+        this->ordered.notify_all();
+        return (rs);
+    }
+
+    /** @brief Set the function told of each published batch. */
+    void
+    observe(
+        Observer observer)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->observer = std::move(observer);
+    }
+
+    /**
+     * @brief
+     * Call a function with the current version and the LSN of its last
+     * mutation, while no batch can be published, e.g. to start a replica
+     * from that version and forward every later batch.
+     */
+    void
+    consistent(
+        const std::function<void(
+            const std::shared_ptr<const GallerySnapshot> &snapshot,
+            uint64_t lsn)> &f)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        f(this->gallery.current(), this->applied);
+    }
+
+    /** @brief Checkpoint the current version and trim the log. */
+    ReturnStatus
+    checkpoint()
+    {
+        std::shared_ptr<const GallerySnapshot> snapshot;
+        uint64_t lsn;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            snapshot = this->gallery.current();
+            lsn = this->applied;
+        }
+        return (this->log.checkpoint(*snapshot, lsn));
+    }
+
+private:
+    VersionedGallery &gallery;
+    GalleryLog log;
+    std::mutex mutex;
+    std::condition_variable ordered;
+    uint64_t applied;
+    /* Dimension of every enrollment logged, 0 until the first */
+    size_t dimension;
+    bool failed;
+    Observer observer;
+};
+}
+
+#endif /* FOFRA2018_WAL_H_ */
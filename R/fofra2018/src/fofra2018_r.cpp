@@ -0,0 +1,451 @@
+/*
+ * This software was developed at the National Institute of Standards and
+ * Technology (NIST) by employees of the Federal Government in the course
+ * of their official duties. Pursuant to title 17 Section 105 of the
+ * United States Code, this software is not subject to copyright protection
+ * and is in the public domain. NIST assumes no responsibility whatsoever for
+ * its use by other parties, and makes no guarantees, expressed or implied,
+ * about its quality, reliability, or any other characteristic.
+ */
+
+/*
+ * R bindings of the FOFRA 2018 interfaces, the reference gallery search
+ * and the DET engine.  R/fofra2018.R wraps these entry points in the
+ * functions of the R fusion examples.
+ *
+ * R matrices are column-major, so a D x N matrix of templates, one per
+ * column as in R/fusion_example_template_level.R, is the N x D row-major
+ * matrix of a GalleryView: native_gallery() searches it in place.  Where
+ * an interface takes std::vector arguments, the R data are copied into
+ * them once, in C++.
+ */
+
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <Rcpp.h>
+#include <R_ext/Rdynload.h>
+
+#include "fofra2018.h"
+#include "fofra2018_det.h"
+#include "fofra2018_gallery.h"
+#include "fofra2018_threads.h"
+
+using namespace FOFRA;
+
+namespace {
+
+/* Raise an R error for a failed call */
+void
+check(
+    const std::string &what,
+    const ReturnStatus &rs)
+{
+    if (rs.code == ReturnCode::Success)
+        return;
+    std::ostringstream message;
+    message << what << ": " << rs.code;
+    if (!rs.info.empty())
+        message << " (" << rs.info << ")";
+    Rcpp::stop(message.str());
+}
+
+struct ScoreFuser {
+    std::shared_ptr<ScoreFuserInterface> impl;
+};
+
+struct TemplateFuser {
+    std::shared_ptr<TemplateFuserInterface> impl;
+};
+
+/* A gallery over the memory of an R matrix, kept alive by the pointer */
+struct NativeGallery {
+    GalleryView view;
+    /* Labels, when the R labels could not be used in place */
+    std::vector<uint32_t> ids;
+};
+
+/* Non-negative whole numbers from R to size_t */
+size_t
+count(
+    SEXP value)
+{
+    const double v = Rcpp::as<double>(value);
+    if (!(v >= 0.0))
+        Rcpp::stop("expected a non-negative number");
+    return (static_cast<size_t>(v));
+}
+
+std::vector<uint32_t>
+labels(
+    SEXP ids)
+{
+    const Rcpp::NumericVector values(ids);
+    std::vector<uint32_t> out(values.size());
+    for (R_xlen_t i = 0; i < values.size(); i++) {
+        if (!(values[i] >= 0.0 && values[i] <= 4294967295.0))
+            Rcpp::stop("identity labels must be in 0 .. 2^32 - 1");
+        out[i] = static_cast<uint32_t>(values[i]);
+    }
+    return (out);
+}
+
+/* Column c of a D x N matrix as a template */
+Template
+column(
+    const Rcpp::NumericMatrix &m,
+    int c)
+{
+    const double *first = m.begin() + static_cast<size_t>(c) * m.nrow();
+    return (Template(first, first + m.nrow()));
+}
+
+Rcpp::DataFrame
+candidateFrame(
+    const std::vector<CandidateList> &lists)
+{
+    size_t n = 0;
+    for (const auto &l : lists)
+        n += l.size();
+    Rcpp::IntegerVector probe(n);
+    Rcpp::NumericVector scores(n), ids(n);
+    size_t i = 0;
+    for (size_t p = 0; p < lists.size(); p++)
+        for (const auto &c : lists[p]) {
+            probe[i] = static_cast<int>(p + 1);
+            scores[i] = c.score;
+            ids[i] = c.identity;
+            i++;
+        }
+    return (Rcpp::DataFrame::create(Rcpp::Named("probe") = probe,
+        Rcpp::Named("scores") = scores,
+        Rcpp::Named("hypothesized_ids") = ids));
+}
+}
+
+RcppExport SEXP
+fofra_score_fuser(
+    SEXP directory,
+    SEXP identification)
+{
+BEGIN_RCPP
+    Rcpp::XPtr<ScoreFuser> fuser(new ScoreFuser());
+    fuser->impl = ScoreFuserInterface::getImplementation();
+    check("initialize", fuser->impl->initialize(
+        Rcpp::as<std::string>(directory), Rcpp::as<bool>(identification) ?
+        ScoreFuserInterface::Type::Identification :
+        ScoreFuserInterface::Type::Verification));
+    return (fuser);
+END_RCPP
+}
+
+/* n x K matrix, one comparison per row, to n fused scores */
+RcppExport SEXP
+fofra_fuse_scores(
+    SEXP fuser,
+    SEXP scores)
+{
+BEGIN_RCPP
+    Rcpp::XPtr<ScoreFuser> f(fuser);
+    const Rcpp::NumericMatrix m(scores);
+    const size_t n = m.nrow(), K = m.ncol();
+    std::vector<ScoreSet> sets(n, ScoreSet(K));
+    for (size_t k = 0; k < K; k++) {
+        const double *col = m.begin() + k * n;
+        for (size_t i = 0; i < n; i++)
+            sets[i][k] = col[i];
+    }
+    std::vector<double> fused;
+    check("fuseVerificationScoreBatch", f->impl->fuseVerificationScoreBatch(
+        sets, fused));
+    return (Rcpp::wrap(fused));
+END_RCPP
+}
+
+/* K data frames of scores and hypothesized_ids to one fused data frame */
+RcppExport SEXP
+fofra_fuse_candidate_lists(
+    SEXP fuser,
+    SEXP lists)
+{
+BEGIN_RCPP
+    Rcpp::XPtr<ScoreFuser> f(fuser);
+    const Rcpp::List input(lists);
+    std::vector<CandidateList> candidates(input.size());
+    for (R_xlen_t k = 0; k < input.size(); k++) {
+        const Rcpp::DataFrame frame(input[k]);
+        const Rcpp::NumericVector scores(frame["scores"]);
+        const std::vector<uint32_t> ids = labels(frame["hypothesized_ids"]);
+        if (ids.size() != static_cast<size_t>(scores.size()))
+            Rcpp::stop("candidate list columns differ in length");
+        for (R_xlen_t i = 0; i < scores.size(); i++)
+            candidates[k].push_back(Candidate(ids[i], scores[i]));
+    }
+    CandidateList fused;
+    check("fuseCandidateLists", f->impl->fuseCandidateLists(candidates,
+        fused));
+    return (candidateFrame(std::vector<CandidateList>(1, fused)));
+END_RCPP
+}
+
+RcppExport SEXP
+fofra_template_fuser(
+    SEXP directory,
+    SEXP action)
+{
+BEGIN_RCPP
+    const std::string a = Rcpp::as<std::string>(action);
+    Rcpp::XPtr<TemplateFuser> fuser(new TemplateFuser());
+    fuser->impl = TemplateFuserInterface::getImplementation();
+    check("initialize", fuser->impl->initialize(
+        Rcpp::as<std::string>(directory), a == "identify" ?
+        TemplateFuserInterface::Action::Identify : a == "verify" ?
+        TemplateFuserInterface::Action::Verify :
+        TemplateFuserInterface::Action::Fuse));
+    return (fuser);
+END_RCPP
+}
+
+/* List of K templates to one fused template */
+RcppExport SEXP
+fofra_fuse_templates(
+    SEXP fuser,
+    SEXP templates)
+{
+BEGIN_RCPP
+    Rcpp::XPtr<TemplateFuser> f(fuser);
+    const Rcpp::List input(templates);
+    std::vector<Template> in;
+    for (R_xlen_t k = 0; k < input.size(); k++)
+        in.push_back(Rcpp::as<Template>(input[k]));
+    Template fused;
+    check("fuseTemplates", f->impl->fuseTemplates(in, fused));
+    return (Rcpp::wrap(fused));
+END_RCPP
+}
+
+/* D x B enrollment and verification matrices to B scores */
+RcppExport SEXP
+fofra_verify(
+    SEXP fuser,
+    SEXP enrollment,
+    SEXP verification)
+{
+BEGIN_RCPP
+    Rcpp::XPtr<TemplateFuser> f(fuser);
+    const Rcpp::NumericMatrix e(enrollment), v(verification);
+    std::vector<Template> enroll, authentication;
+    for (int c = 0; c < e.ncol(); c++)
+        enroll.push_back(column(e, c));
+    for (int c = 0; c < v.ncol(); c++)
+        authentication.push_back(column(v, c));
+    std::vector<double> scores;
+    check("verifyBatch", f->impl->verifyBatch(enroll, authentication,
+        scores));
+    return (Rcpp::wrap(scores));
+END_RCPP
+}
+
+/* D x N matrix and N labels to the implementation's gallery */
+RcppExport SEXP
+fofra_create_gallery(
+    SEXP fuser,
+    SEXP templates,
+    SEXP ids)
+{
+BEGIN_RCPP
+    Rcpp::XPtr<TemplateFuser> f(fuser);
+    const Rcpp::NumericMatrix m(templates);
+    std::vector<Template> gallery;
+    gallery.reserve(m.ncol());
+    for (int c = 0; c < m.ncol(); c++)
+        gallery.push_back(column(m, c));
+    check("createGallery", f->impl->createGallery(gallery, labels(ids)));
+    return (R_NilValue);
+END_RCPP
+}
+
+/* D x P probes to the top L candidates of each, by the implementation */
+RcppExport SEXP
+fofra_search(
+    SEXP fuser,
+    SEXP probes,
+    SEXP length)
+{
+BEGIN_RCPP
+    Rcpp::XPtr<TemplateFuser> f(fuser);
+    const Rcpp::NumericMatrix m(probes);
+    std::vector<Template> in;
+    for (int c = 0; c < m.ncol(); c++)
+        in.push_back(column(m, c));
+    std::vector<CandidateList> candidates(in.size(),
+        CandidateList(count(length)));
+    check("searchBatch", f->impl->searchBatch(in, candidates));
+    return (candidateFrame(candidates));
+END_RCPP
+}
+
+/*
+ * A gallery searched in place: the D x N matrix (double storage) and,
+ * when they are non-negative integers, the N labels are not copied.  The
+ * returned pointer protects both from the garbage collector and, as R
+ * copies on modification an object that is still referenced, from being
+ * changed under it.
+ */
+RcppExport SEXP
+fofra_native_gallery(
+    SEXP templates,
+    SEXP ids)
+{
+BEGIN_RCPP
+    const Rcpp::NumericMatrix m(templates);
+    if (Rf_xlength(ids) != m.ncol())
+        Rcpp::stop("need one identity label per gallery column");
+    std::unique_ptr<NativeGallery> gallery(new NativeGallery());
+    gallery->view.matrix = m.begin();
+    gallery->view.count = m.ncol();
+    gallery->view.dimension = m.nrow();
+
+    bool inPlace = (TYPEOF(ids) == INTSXP);
+    if (inPlace) {
+        const int *values = INTEGER(ids);
+        for (R_xlen_t i = 0; i < Rf_xlength(ids) && inPlace; i++)
+            inPlace = (values[i] >= 0);
+    }
+    if (inPlace)
+        gallery->view.ids = reinterpret_cast<const uint32_t*>(INTEGER(ids));
+    else {
+        gallery->ids = labels(ids);
+        gallery->view.ids = gallery->ids.data();
+    }
+    return (Rcpp::XPtr<NativeGallery>(gallery.release(), true, R_NilValue,
+        Rcpp::List::create(m, ids)));
+END_RCPP
+}
+
+/* D x P probes to the top L candidates of each, over threads */
+RcppExport SEXP
+fofra_search_native(
+    SEXP gallery,
+    SEXP probes,
+    SEXP length,
+    SEXP threads)
+{
+BEGIN_RCPP
+    Rcpp::XPtr<NativeGallery> g(gallery);
+    const Rcpp::NumericMatrix m(probes);
+    if (static_cast<size_t>(m.nrow()) != g->view.dimension)
+        Rcpp::stop("probes and gallery differ in dimension");
+    const size_t P = m.ncol(), L = count(length);
+    const double *first = m.begin();
+    const GalleryView view = g->view;
+
+    /* No R objects are touched on the pool's threads */
+    std::vector<CandidateList> candidates(P, CandidateList(L));
+    WorkerPool pool(count(threads));
+    pool.parallelFor(P, 1, [&](size_t begin, size_t end) {
+        Template probe;
+        for (size_t p = begin; p < end; p++) {
+            probe.assign(first + p * view.dimension,
+                first + (p + 1) * view.dimension);
+            searchGallery(view, probe, candidates[p]);
+        }
+    });
+    return (candidateFrame(candidates));
+END_RCPP
+}
+
+/*
+ * DET points at target FMRs and, with replicates > 0, subject-level
+ * bootstrap intervals of FNMR.  Subjects are 0-based labels.
+ */
+RcppExport SEXP
+fofra_det(
+    SEXP scores,
+    SEXP genuine,
+    SEXP subjects,
+    SEXP fmrs,
+    SEXP replicates,
+    SEXP level,
+    SEXP seed,
+    SEXP threads)
+{
+BEGIN_RCPP
+    const Rcpp::NumericVector s(scores);
+    const Rcpp::LogicalVector m(genuine);
+    const Rcpp::IntegerVector subject(subjects);
+    if (m.size() != s.size() || subject.size() != s.size())
+        Rcpp::stop("need one genuine flag and subject per score");
+    std::vector<bool> mated(s.size());
+    std::vector<uint32_t> subjectLabels(s.size());
+    for (R_xlen_t i = 0; i < s.size(); i++) {
+        if (m[i] == NA_LOGICAL || subject[i] == NA_INTEGER ||
+            subject[i] < 0)
+            Rcpp::stop("genuine flags and subjects must not be NA");
+        mated[i] = (m[i] != 0);
+        subjectLabels[i] = static_cast<uint32_t>(subject[i]);
+    }
+    const DetBootstrap det(std::vector<double>(s.begin(), s.end()), mated,
+        subjectLabels);
+    const std::vector<double> targets = Rcpp::as<std::vector<double>>(fmrs);
+    const size_t B = count(replicates);
+    const size_t T = targets.size();
+
+    std::vector<DetInterval> intervals(T);
+    if (B == 0) {
+        std::vector<DetPoint> points;
+        check("DET", det.compute(targets, points));
+        for (size_t t = 0; t < T; t++) {
+            intervals[t].targetFMR = targets[t];
+            intervals[t].point = points[t];
+            intervals[t].fnmrLower = intervals[t].fnmrUpper = NA_REAL;
+        }
+    } else {
+        WorkerPool pool(count(threads));
+        check("DET", det.confidenceIntervals(targets, B,
+            Rcpp::as<double>(level), static_cast<uint64_t>(count(seed)), pool,
+            intervals));
+    }
+
+    Rcpp::NumericVector target(T), threshold(T), fmr(T), fnmr(T),
+        lower(T), upper(T);
+    for (size_t t = 0; t < T; t++) {
+        target[t] = intervals[t].targetFMR;
+        threshold[t] = intervals[t].point.threshold;
+        fmr[t] = intervals[t].point.fmr;
+        fnmr[t] = intervals[t].point.fnmr;
+        lower[t] = intervals[t].fnmrLower;
+        upper[t] = intervals[t].fnmrUpper;
+    }
+    return (Rcpp::DataFrame::create(Rcpp::Named("target_fmr") = target,
+        Rcpp::Named("threshold") = threshold, Rcpp::Named("fmr") = fmr,
+        Rcpp::Named("fnmr") = fnmr, Rcpp::Named("fnmr_lower") = lower,
+        Rcpp::Named("fnmr_upper") = upper));
+END_RCPP
+}
+
+static const R_CallMethodDef callMethods[] = {
+    {"fofra_score_fuser", (DL_FUNC) &fofra_score_fuser, 2},
+    {"fofra_fuse_scores", (DL_FUNC) &fofra_fuse_scores, 2},
+    {"fofra_fuse_candidate_lists", (DL_FUNC) &fofra_fuse_candidate_lists, 2},
+    {"fofra_template_fuser", (DL_FUNC) &fofra_template_fuser, 2},
+    {"fofra_fuse_templates", (DL_FUNC) &fofra_fuse_templates, 2},
+    {"fofra_verify", (DL_FUNC) &fofra_verify, 3},
+    {"fofra_create_gallery", (DL_FUNC) &fofra_create_gallery, 3},
+    {"fofra_search", (DL_FUNC) &fofra_search, 3},
+    {"fofra_native_gallery", (DL_FUNC) &fofra_native_gallery, 2},
+    {"fofra_search_native", (DL_FUNC) &fofra_search_native, 4},
+    {"fofra_det", (DL_FUNC) &fofra_det, 8},
+    {NULL, NULL, 0}
+};
+
+RcppExport void
+R_init_fofra2018(
+    DllInfo *dll)
+{
+    R_registerRoutines(dll, NULL, callMethods, NULL, NULL);
+    R_useDynamicSymbols(dll, FALSE);
+}